@@ -0,0 +1,116 @@
+#!/bin/sh
+
+# Copyright (c) 2026 agent <agent@local>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Generate a synthetic backup with mkbackup and time the main sigbak commands
+# on it. Each command is run several times and the fastest run is reported.
+# The timings are taken from the statistics that sigbak -s prints. The keys are
+# derived once and saved to a key file, so that the timings do not include the
+# key derivation.
+
+usage()
+{
+	echo "usage: bench.sh [-k] [-n runs] sigbak mkbackup" \
+	    "[mkbackup-option ...]" >&2
+	exit 1
+}
+
+keep=0
+runs=3
+
+while getopts kn: opt; do
+	case $opt in
+	k)	keep=1 ;;
+	n)	case $OPTARG in
+		''|*[!0-9]*|0)	usage ;;
+		esac
+		runs=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ $# -ge 2 ] || usage
+
+sigbak=$1
+mkbackup=$2
+shift 2
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/sigbak-bench.XXXXXXXXXX") || exit 1
+
+cleanup()
+{
+	if [ $keep -eq 1 ]; then
+		echo "Files kept in $dir" >&2
+	else
+		rm -rf "$dir"
+	fi
+}
+
+trap cleanup EXIT
+trap 'exit 1' HUP INT TERM
+
+backup=$dir/bench.backup
+out=$dir/out
+
+echo 000000000000000000000000000000 > "$dir/passfile"
+
+"$mkbackup" -p "$dir/passfile" "$@" "$backup" || exit 1
+"$sigbak" threads -p "$dir/passfile" -k "$dir/keyfile" "$backup" > /dev/null ||
+    exit 1
+
+echo "backup: $(wc -c < "$backup" | tr -d ' ') bytes"
+
+# Usage: bench name command [argument ...]
+bench()
+{
+	name=$1
+	shift
+	best=
+
+	i=0
+	while [ $i -lt "$runs" ]; do
+		rm -rf "$out"
+		case $name in
+		attachments)	mkdir "$out" ;;
+		esac
+
+		if ! "$sigbak" -s "$@" > /dev/null 2> "$dir/stats"; then
+			echo "$name: failed" >&2
+			cat "$dir/stats" >&2
+			return
+		fi
+
+		t=$(awk '$1 == "elapsed" { print $2 }' "$dir/stats")
+		if [ -z "$best" ] ||
+		    awk -v a="$t" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+			best=$t
+		fi
+
+		i=$((i + 1))
+	done
+
+	printf "%-20s %8s s\n" "$name" "$best"
+}
+
+k="-k $dir/keyfile"
+
+bench check		check $k "$backup"
+bench sqlite		sqlite $k "$backup" "$out"
+bench messages-csv	messages -f csv $k "$backup" "$out"
+bench messages-maildir	messages -f maildir $k "$backup" "$out"
+bench messages-text	messages -f text $k "$backup" "$out"
+bench attachments	attachments $k "$backup" "$out"
+bench extract		extract $k "$backup" "$out"
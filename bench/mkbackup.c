@@ -0,0 +1,1088 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generate a synthetic Signal backup for benchmarking. The backup is encrypted
+ * in the same way as a real one, so every sigbak command can be run on it. The
+ * contents are deterministic; only the salt and IV are random.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/hkdf.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include "backup.pb-c.h"
+#include "database.pb-c.h"
+
+/* These must match sbk.c */
+#define MK_IV_LEN		16
+#define MK_SALT_LEN		32
+#define MK_KEY_LEN		32
+#define MK_CIPHERKEY_LEN	32
+#define MK_MACKEY_LEN		32
+#define MK_DERIVKEY_LEN		(MK_CIPHERKEY_LEN + MK_MACKEY_LEN)
+#define MK_MAC_LEN		10
+#define MK_ROUNDS		250000
+#define MK_HKDF_INFO		"Backup Export"
+
+#define MK_DB_VERSION		80
+#define MK_CHUNK_SIZE		(64 * 1024)
+#define MK_MAX_PARAMS		16
+#define MK_DEFAULT_PASSPHRASE	"000000000000000000000000000000"
+#define MK_LONG_TEXT_TYPE	"text/x-signal-plain"
+#define MK_LONG_TEXT_SIZE	4096
+#define MK_MENTION_PLACEHOLDER	"\357\277\274"	/* U+FFFC */
+#define MK_AVATAR_SIZE		2048
+#define MK_MAX_AVATARS		16
+#define MK_STICKER_SIZE		4096
+
+#define MK_INBOX_TYPE		20
+#define MK_SENT_TYPE		23
+
+#define MK_FIRST_DATE		INT64_C(1600000000000)
+#define MK_DATE_STEP		60000	/* One minute */
+
+struct mk_ctx {
+	FILE		*fp;
+	EVP_CIPHER_CTX	*cipher;
+	HMAC_CTX	*hmac;
+	unsigned char	 cipherkey[MK_CIPHERKEY_LEN];
+	unsigned char	 mackey[MK_MACKEY_LEN];
+	unsigned char	 iv[MK_IV_LEN];
+	uint32_t	 counter;
+	unsigned char	*buf;
+	size_t		 bufsize;
+	uint64_t	 rng;
+};
+
+struct mk_params {
+	Signal__SqlStatement__SqlParameter	 param[MK_MAX_PARAMS];
+	Signal__SqlStatement__SqlParameter	*ptr[MK_MAX_PARAMS];
+	size_t					 n;
+};
+
+struct mk_config {
+	int	threads;
+	int	messages;
+	int	attachments;
+	int	attachment_size;
+	int	long_messages;
+	int	mentions;
+	int	reactions;
+};
+
+__dead static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-a attachments] [-l long-messages] "
+	    "[-m messages] [-n mentions] [-p passfile] [-r reactions] "
+	    "[-s size] [-t threads] backup\n", getprogname());
+	exit(1);
+}
+
+/* A simple and fast PRNG, so that the contents are reproducible */
+static uint64_t
+mk_random(struct mk_ctx *ctx)
+{
+	ctx->rng ^= ctx->rng << 13;
+	ctx->rng ^= ctx->rng >> 7;
+	ctx->rng ^= ctx->rng << 17;
+	return ctx->rng;
+}
+
+/*
+ * Return whether message i out of total is one of the count messages that
+ * have a certain property. The messages are spread evenly.
+ */
+static int
+mk_spread(int i, int count, int total)
+{
+	return (int64_t)(i + 1) * count / total >
+	    (int64_t)i * count / total;
+}
+
+static int
+mk_enlarge_buffer(struct mk_ctx *ctx, size_t size)
+{
+	unsigned char *buf;
+
+	if (ctx->bufsize >= size)
+		return 0;
+
+	if ((buf = realloc(ctx->buf, size)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	ctx->buf = buf;
+	ctx->bufsize = size;
+	return 0;
+}
+
+static int
+mk_write(struct mk_ctx *ctx, const void *buf, size_t len)
+{
+	if (fwrite(buf, len, 1, ctx->fp) != 1) {
+		warn("fwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+mk_put_uint32(unsigned char *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+/* Same key schedule as sbk_compute_keys() */
+static int
+mk_compute_keys(struct mk_ctx *ctx, const char *passphr,
+    const unsigned char *salt, size_t saltlen)
+{
+	unsigned char	key[SHA512_DIGEST_LENGTH];
+	unsigned char	derivkey[MK_DERIVKEY_LEN];
+	SHA512_CTX	sha;
+	size_t		passphrlen;
+	int		i, ret;
+
+	passphrlen = strlen(passphr);
+
+	SHA512_Init(&sha);
+	SHA512_Update(&sha, salt, saltlen);
+	SHA512_Update(&sha, passphr, passphrlen);
+	SHA512_Update(&sha, passphr, passphrlen);
+	SHA512_Final(key, &sha);
+
+	for (i = 0; i < MK_ROUNDS - 1; i++) {
+		SHA512_Init(&sha);
+		SHA512_Update(&sha, key, sizeof key);
+		SHA512_Update(&sha, passphr, passphrlen);
+		SHA512_Final(key, &sha);
+	}
+
+	if (HKDF(derivkey, sizeof derivkey, EVP_sha256(), key, MK_KEY_LEN,
+	    (const unsigned char *)"", 0, (const unsigned char *)MK_HKDF_INFO,
+	    strlen(MK_HKDF_INFO)) == 0) {
+		warnx("Cannot compute keys");
+		ret = -1;
+	} else {
+		memcpy(ctx->cipherkey, derivkey, MK_CIPHERKEY_LEN);
+		memcpy(ctx->mackey, derivkey + MK_CIPHERKEY_LEN,
+		    MK_MACKEY_LEN);
+		ret = 0;
+	}
+
+	explicit_bzero(key, sizeof key);
+	explicit_bzero(derivkey, sizeof derivkey);
+	return ret;
+}
+
+static int
+mk_encrypt_init(struct mk_ctx *ctx)
+{
+	mk_put_uint32(ctx->iv, ctx->counter++);
+
+	if (HMAC_Init_ex(ctx->hmac, ctx->mackey, sizeof ctx->mackey,
+	    EVP_sha256(), NULL) == 0) {
+		warnx("Cannot initialise HMAC");
+		return -1;
+	}
+
+	if (EVP_EncryptInit_ex(ctx->cipher, EVP_aes_256_ctr(), NULL,
+	    ctx->cipherkey, ctx->iv) == 0) {
+		warnx("Cannot initialise cipher");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Encrypt in place */
+static int
+mk_encrypt_update(struct mk_ctx *ctx, unsigned char *buf, size_t len)
+{
+	int outlen;
+
+	if (EVP_EncryptUpdate(ctx->cipher, buf, &outlen, buf, len) == 0) {
+		warnx("Cannot encrypt data");
+		return -1;
+	}
+
+	if (HMAC_Update(ctx->hmac, buf, len) == 0) {
+		warnx("Cannot compute HMAC");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+mk_encrypt_final(struct mk_ctx *ctx, unsigned char *mac)
+{
+	unsigned char	digest[EVP_MAX_MD_SIZE];
+	unsigned int	digestlen;
+
+	if (HMAC_Final(ctx->hmac, digest, &digestlen) == 0) {
+		warnx("Cannot compute HMAC");
+		return -1;
+	}
+
+	memcpy(mac, digest, MK_MAC_LEN);
+	return 0;
+}
+
+/* The header frame is the only frame that is not encrypted */
+static int
+mk_write_frame(struct mk_ctx *ctx, Signal__BackupFrame *frm, int encrypt)
+{
+	size_t len, framelen;
+
+	len = signal__backup_frame__get_packed_size(frm);
+	framelen = encrypt ? len + MK_MAC_LEN : len;
+
+	if (framelen > UINT32_MAX) {
+		warnx("Frame too large");
+		return -1;
+	}
+
+	if (mk_enlarge_buffer(ctx, 4 + framelen) == -1)
+		return -1;
+
+	mk_put_uint32(ctx->buf, framelen);
+	signal__backup_frame__pack(frm, ctx->buf + 4);
+
+	if (encrypt) {
+		if (mk_encrypt_init(ctx) == -1)
+			return -1;
+		if (mk_encrypt_update(ctx, ctx->buf + 4, len) == -1)
+			return -1;
+		if (mk_encrypt_final(ctx, ctx->buf + 4 + len) == -1)
+			return -1;
+	}
+
+	return mk_write(ctx, ctx->buf, 4 + framelen);
+}
+
+/*
+ * Write the data of an attachment, avatar or sticker. Text is repeated to fill
+ * the file; if text is NULL, the file is filled with random data.
+ */
+static int
+mk_write_file_data(struct mk_ctx *ctx, size_t len, const char *text)
+{
+	unsigned char	mac[MK_MAC_LEN];
+	uint64_t	r;
+	size_t		i, n, textlen, textpos;
+
+	if (mk_enlarge_buffer(ctx, MK_CHUNK_SIZE) == -1)
+		return -1;
+
+	if (mk_encrypt_init(ctx) == -1)
+		return -1;
+
+	/* The MAC of file data also covers the IV */
+	if (HMAC_Update(ctx->hmac, ctx->iv, sizeof ctx->iv) == 0) {
+		warnx("Cannot compute HMAC");
+		return -1;
+	}
+
+	textlen = (text != NULL) ? strlen(text) : 0;
+	textpos = 0;
+
+	while (len > 0) {
+		n = (len < MK_CHUNK_SIZE) ? len : MK_CHUNK_SIZE;
+
+		if (text != NULL)
+			for (i = 0; i < n; i++) {
+				ctx->buf[i] = text[textpos++];
+				if (textpos == textlen)
+					textpos = 0;
+			}
+		else
+			for (i = 0; i < n; i += sizeof r) {
+				r = mk_random(ctx);
+				memcpy(ctx->buf + i, &r,
+				    (n - i < sizeof r) ? n - i : sizeof r);
+			}
+
+		if (mk_encrypt_update(ctx, ctx->buf, n) == -1)
+			return -1;
+
+		if (mk_write(ctx, ctx->buf, n) == -1)
+			return -1;
+
+		len -= n;
+	}
+
+	if (mk_encrypt_final(ctx, mac) == -1)
+		return -1;
+
+	return mk_write(ctx, mac, sizeof mac);
+}
+
+static Signal__SqlStatement__SqlParameter *
+mk_add_param(struct mk_params *par)
+{
+	Signal__SqlStatement__SqlParameter *p;
+
+	if (par->n == MK_MAX_PARAMS)
+		errx(1, "Too many SQL parameters");
+
+	p = &par->param[par->n];
+	signal__sql_statement__sql_parameter__init(p);
+	par->ptr[par->n++] = p;
+	return p;
+}
+
+static void
+mk_add_int(struct mk_params *par, int64_t val)
+{
+	Signal__SqlStatement__SqlParameter *p;
+
+	p = mk_add_param(par);
+	p->has_integerparameter = 1;
+	p->integerparameter = val;
+}
+
+/* A NULL string is added as a null parameter */
+static void
+mk_add_text(struct mk_params *par, const char *val)
+{
+	Signal__SqlStatement__SqlParameter *p;
+
+	p = mk_add_param(par);
+	if (val != NULL)
+		p->stringparamter = (char *)val;
+	else {
+		p->has_nullparameter = 1;
+		p->nullparameter = 1;
+	}
+}
+
+static void
+mk_add_blob(struct mk_params *par, unsigned char *val, size_t len)
+{
+	Signal__SqlStatement__SqlParameter *p;
+
+	p = mk_add_param(par);
+	p->has_blobparameter = 1;
+	p->blobparameter.data = val;
+	p->blobparameter.len = len;
+}
+
+static int
+mk_write_statement(struct mk_ctx *ctx, const char *sql, struct mk_params *par)
+{
+	Signal__BackupFrame	frm = SIGNAL__BACKUP_FRAME__INIT;
+	Signal__SqlStatement	stm = SIGNAL__SQL_STATEMENT__INIT;
+
+	stm.statement = (char *)sql;
+	if (par != NULL) {
+		stm.n_parameters = par->n;
+		stm.parameters = par->ptr;
+		par->n = 0;
+	}
+
+	frm.statement = &stm;
+	return mk_write_frame(ctx, &frm, 1);
+}
+
+static const char *mk_schema[] = {
+	"CREATE TABLE recipient (_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	    "phone TEXT UNIQUE, email TEXT UNIQUE, group_id TEXT UNIQUE, "
+	    "system_display_name TEXT, system_phone_label TEXT, "
+	    "signal_profile_name TEXT, profile_family_name TEXT, "
+	    "profile_joined_name TEXT)",
+	"CREATE TABLE groups (_id INTEGER PRIMARY KEY, group_id TEXT, "
+	    "recipient_id INTEGER, title TEXT)",
+	"CREATE TABLE thread (_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	    "date INTEGER DEFAULT 0, message_count INTEGER DEFAULT 0, "
+	    "recipient_ids INTEGER)",
+	"CREATE TABLE sms (_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	    "thread_id INTEGER, address INTEGER, date INTEGER, "
+	    "date_sent INTEGER, type INTEGER, body TEXT, reactions BLOB)",
+	"CREATE TABLE mms (_id INTEGER PRIMARY KEY, thread_id INTEGER, "
+	    "date INTEGER, date_received INTEGER, msg_box INTEGER, "
+	    "body TEXT, part_count INTEGER, address INTEGER, "
+	    "reactions BLOB)",
+	"CREATE TABLE part (_id INTEGER PRIMARY KEY, mid INTEGER, "
+	    "ct TEXT, pending_push INTEGER, data_size INTEGER, "
+	    "file_name TEXT, unique_id INTEGER NOT NULL)",
+	"CREATE TABLE mention (_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	    "thread_id INTEGER, message_id INTEGER, recipient_id INTEGER, "
+	    "range_start INTEGER, range_length INTEGER)",
+	"CREATE TABLE sticker (_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	    "pack_id TEXT NOT NULL, sticker_id INTEGER, file_length INTEGER)",
+};
+
+/*
+ * Thread t (starting at 1) has recipient t. Every fourth thread is a group
+ * thread; the other threads are with a single contact.
+ */
+static int
+mk_is_group(int recipient)
+{
+	return recipient % 4 == 0;
+}
+
+/* Return the id of the n-th contact (starting at 0) */
+static int
+mk_contact(int n)
+{
+	return n + n / 3 + 1;
+}
+
+struct mk_message {
+	int	index;
+	int	thread;
+	int	address;
+	int	contact;
+	int	outgoing;
+	int	mms;
+	int	attachment;
+	int	long_text;
+	int	mention;
+	int	reaction;
+	int64_t	date;
+};
+
+static void
+mk_get_message(const struct mk_config *cfg, int i, struct mk_message *msg)
+{
+	int ncontacts;
+
+	ncontacts = cfg->threads - cfg->threads / 4;
+
+	msg->index = i;
+	msg->thread = i % cfg->threads + 1;
+	msg->outgoing = (i / cfg->threads) % 2;
+	msg->date = MK_FIRST_DATE + (int64_t)i * MK_DATE_STEP;
+	msg->attachment = mk_spread(i, cfg->attachments, cfg->messages);
+	msg->long_text = mk_spread(i, cfg->long_messages, cfg->messages);
+	/* The long text does not contain the mention placeholder */
+	msg->mention = mk_spread(i, cfg->mentions, cfg->messages) &&
+	    !msg->long_text;
+	msg->reaction = mk_spread(i, cfg->reactions, cfg->messages);
+	msg->mms = msg->attachment || msg->long_text || msg->mention ||
+	    i % 2 == 1;
+
+	/* In group threads, incoming messages and reactions are from members */
+	if (mk_is_group(msg->thread))
+		msg->contact = mk_contact(i % ncontacts);
+	else
+		msg->contact = msg->thread;
+
+	msg->address = msg->outgoing ? msg->thread : msg->contact;
+}
+
+static int
+mk_write_recipients(struct mk_ctx *ctx, const struct mk_config *cfg)
+{
+	struct mk_params	par;
+	char			phone[32], name[64], group[64];
+	int			i;
+
+	par.n = 0;
+
+	for (i = 1; i <= cfg->threads; i++) {
+		mk_add_int(&par, i);
+		if (mk_is_group(i)) {
+			snprintf(group, sizeof group,
+			    "__signal_group__v2__!%08x", i);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, group);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+		} else {
+			snprintf(phone, sizeof phone, "+31600%06d", i);
+			snprintf(name, sizeof name, "Contact %d", i);
+			mk_add_text(&par, phone);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, NULL);
+			/* Only some contacts are in the address book */
+			mk_add_text(&par, (i % 3 == 0) ? NULL : name);
+			mk_add_text(&par, NULL);
+			mk_add_text(&par, "Profile");
+			mk_add_text(&par, "Name");
+			mk_add_text(&par, "Profile Name");
+		}
+		if (mk_write_statement(ctx, "INSERT INTO recipient VALUES "
+		    "(?,?,?,?,?,?,?,?,?)", &par) == -1)
+			return -1;
+	}
+
+	for (i = 4; i <= cfg->threads; i += 4) {
+		snprintf(group, sizeof group, "__signal_group__v2__!%08x", i);
+		snprintf(name, sizeof name, "Group %d", i);
+		mk_add_int(&par, i / 4);
+		mk_add_text(&par, group);
+		mk_add_int(&par, i);
+		mk_add_text(&par, name);
+		if (mk_write_statement(ctx, "INSERT INTO groups VALUES "
+		    "(?,?,?,?)", &par) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+mk_write_threads(struct mk_ctx *ctx, const struct mk_config *cfg)
+{
+	struct mk_params	par;
+	struct mk_message	msg;
+	int			i, last;
+
+	par.n = 0;
+
+	for (i = 1; i <= cfg->threads; i++) {
+		last = cfg->messages - 1;
+		while (last >= 0 && last % cfg->threads + 1 != i)
+			last--;
+
+		mk_add_int(&par, i);
+		if (last >= 0) {
+			mk_get_message(cfg, last, &msg);
+			mk_add_int(&par, msg.date);
+		} else
+			mk_add_int(&par, 0);
+		mk_add_int(&par, cfg->messages / cfg->threads +
+		    (i <= cfg->messages % cfg->threads));
+		mk_add_int(&par, i);
+		if (mk_write_statement(ctx, "INSERT INTO thread VALUES "
+		    "(?,?,?,?)", &par) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The body is formatted into buf, which must remain valid */
+static void
+mk_add_body(struct mk_params *par, const struct mk_message *msg, char *buf,
+    size_t bufsize)
+{
+	/* Include characters that need to be escaped in CSV */
+	if (msg->mention)
+		snprintf(buf, bufsize, "Hello " MK_MENTION_PLACEHOLDER
+		    ", this is message %d", msg->index);
+	else
+		snprintf(buf, bufsize, "This is message %d, in thread "
+		    "%d, with \"quotes\"", msg->index, msg->thread);
+
+	mk_add_text(par, buf);
+}
+
+/* The reaction list is packed into buf, which must remain valid */
+static void
+mk_add_reactions(struct mk_params *par, const struct mk_message *msg,
+    unsigned char *buf, size_t bufsize)
+{
+	Signal__ReactionList		 lst = SIGNAL__REACTION_LIST__INIT;
+	Signal__ReactionList__Reaction	 rct =
+	    SIGNAL__REACTION_LIST__REACTION__INIT;
+	Signal__ReactionList__Reaction	*rcts[1];
+
+	if (!msg->reaction) {
+		mk_add_text(par, NULL);
+		return;
+	}
+
+	rct.emoji = "\360\237\221\215";	/* U+1F44D */
+	rct.author = msg->contact;
+	rct.senttime = msg->date + MK_DATE_STEP / 2;
+	rct.receivedtime = msg->date + MK_DATE_STEP / 2 + 1000;
+	rcts[0] = &rct;
+	lst.n_reactions = 1;
+	lst.reactions = rcts;
+
+	if (signal__reaction_list__get_packed_size(&lst) > bufsize)
+		errx(1, "Reaction list too large");
+
+	mk_add_blob(par, buf, signal__reaction_list__pack(&lst, buf));
+}
+
+static int
+mk_write_messages(struct mk_ctx *ctx, const struct mk_config *cfg, int mms)
+{
+	struct mk_params	par;
+	struct mk_message	msg;
+	unsigned char		reactions[128];
+	char			body[128];
+	int			i, id;
+
+	par.n = 0;
+	id = 0;
+
+	for (i = 0; i < cfg->messages; i++) {
+		mk_get_message(cfg, i, &msg);
+		if (msg.mms != mms)
+			continue;
+
+		mk_add_int(&par, ++id);
+		mk_add_int(&par, msg.thread);
+
+		if (mms) {
+			mk_add_int(&par, msg.date);
+			mk_add_int(&par, msg.date + 1000);
+			mk_add_int(&par, msg.outgoing ? MK_SENT_TYPE :
+			    MK_INBOX_TYPE);
+			mk_add_body(&par, &msg, body, sizeof body);
+			mk_add_int(&par, msg.attachment + msg.long_text);
+			mk_add_int(&par, msg.address);
+			mk_add_reactions(&par, &msg, reactions,
+			    sizeof reactions);
+			if (mk_write_statement(ctx, "INSERT INTO mms VALUES "
+			    "(?,?,?,?,?,?,?,?,?)", &par) == -1)
+				return -1;
+		} else {
+			mk_add_int(&par, msg.address);
+			mk_add_int(&par, msg.date + 1000);
+			mk_add_int(&par, msg.date);
+			mk_add_int(&par, msg.outgoing ? MK_SENT_TYPE :
+			    MK_INBOX_TYPE);
+			mk_add_body(&par, &msg, body, sizeof body);
+			mk_add_reactions(&par, &msg, reactions,
+			    sizeof reactions);
+			if (mk_write_statement(ctx, "INSERT INTO sms VALUES "
+			    "(?,?,?,?,?,?,?,?)", &par) == -1)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+mk_write_part(struct mk_ctx *ctx, int64_t id, int mid, const char *type,
+    const char *name, int64_t size, const char *text)
+{
+	Signal__BackupFrame	frm = SIGNAL__BACKUP_FRAME__INIT;
+	Signal__Attachment	att = SIGNAL__ATTACHMENT__INIT;
+	struct mk_params	par;
+	int64_t			uniqueid;
+
+	uniqueid = MK_FIRST_DATE + id;
+
+	par.n = 0;
+	mk_add_int(&par, id);
+	mk_add_int(&par, mid);
+	mk_add_text(&par, type);
+	mk_add_int(&par, 0);
+	mk_add_int(&par, size);
+	mk_add_text(&par, name);
+	mk_add_int(&par, uniqueid);
+	if (mk_write_statement(ctx, "INSERT INTO part VALUES "
+	    "(?,?,?,?,?,?,?)", &par) == -1)
+		return -1;
+
+	att.has_rowid = 1;
+	att.rowid = id;
+	att.has_attachmentid = 1;
+	att.attachmentid = uniqueid;
+	att.has_length = 1;
+	att.length = size;
+	frm.attachment = &att;
+
+	if (mk_write_frame(ctx, &frm, 1) == -1)
+		return -1;
+
+	return mk_write_file_data(ctx, size, text);
+}
+
+/* Attachments vary in size between half and one and a half times the size */
+static int
+mk_write_parts(struct mk_ctx *ctx, const struct mk_config *cfg)
+{
+	struct mk_message	msg;
+	char			name[32];
+	int64_t			size;
+	int			i, id, mid;
+
+	id = mid = 0;
+
+	for (i = 0; i < cfg->messages; i++) {
+		mk_get_message(cfg, i, &msg);
+		if (!msg.mms)
+			continue;
+		mid++;
+
+		if (msg.long_text && mk_write_part(ctx, ++id, mid,
+		    MK_LONG_TEXT_TYPE, NULL, MK_LONG_TEXT_SIZE,
+		    "This is a long message. ") == -1)
+			return -1;
+
+		if (msg.attachment) {
+			size = cfg->attachment_size / 2;
+			if (cfg->attachment_size > 0)
+				size += mk_random(ctx) %
+				    (cfg->attachment_size + 1);
+			snprintf(name, sizeof name, "IMG_%06d.jpg", i);
+			if (mk_write_part(ctx, ++id, mid, "image/jpeg", name,
+			    size, NULL) == -1)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+mk_write_mentions(struct mk_ctx *ctx, const struct mk_config *cfg)
+{
+	struct mk_params	par;
+	struct mk_message	msg;
+	int			i, id, mid;
+
+	par.n = 0;
+	id = mid = 0;
+
+	for (i = 0; i < cfg->messages; i++) {
+		mk_get_message(cfg, i, &msg);
+		if (!msg.mms)
+			continue;
+		mid++;
+
+		if (!msg.mention)
+			continue;
+
+		mk_add_int(&par, ++id);
+		mk_add_int(&par, msg.thread);
+		mk_add_int(&par, mid);
+		mk_add_int(&par, mk_contact(0));
+		mk_add_int(&par, 6);
+		mk_add_int(&par, 1);
+		if (mk_write_statement(ctx, "INSERT INTO mention VALUES "
+		    "(?,?,?,?,?,?)", &par) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+mk_write_extras(struct mk_ctx *ctx, const struct mk_config *cfg)
+{
+	Signal__BackupFrame		frm = SIGNAL__BACKUP_FRAME__INIT;
+	Signal__SharedPreference	pref = SIGNAL__SHARED_PREFERENCE__INIT;
+	Signal__KeyValue		kv = SIGNAL__KEY_VALUE__INIT;
+	Signal__Avatar			avt = SIGNAL__AVATAR__INIT;
+	Signal__Sticker			stk = SIGNAL__STICKER__INIT;
+	struct mk_params		par;
+	char				id[16];
+	int				i, n;
+
+	pref.file = "org.thoughtcrime.securesms_preferences";
+	pref.key = "pref_theme";
+	pref.value = "dark";
+	frm.preference = &pref;
+	if (mk_write_frame(ctx, &frm, 1) == -1)
+		return -1;
+	frm.preference = NULL;
+
+	kv.key = "account.registered_at";
+	kv.has_longvalue = 1;
+	kv.longvalue = MK_FIRST_DATE;
+	frm.keyvalue = &kv;
+	if (mk_write_frame(ctx, &frm, 1) == -1)
+		return -1;
+	frm.keyvalue = NULL;
+
+	for (i = 1, n = 0; i <= cfg->threads && n < MK_MAX_AVATARS; i++) {
+		if (mk_is_group(i))
+			continue;
+		snprintf(id, sizeof id, "%d", i);
+		avt.recipientid = id;
+		avt.has_length = 1;
+		avt.length = MK_AVATAR_SIZE;
+		frm.avatar = &avt;
+		if (mk_write_frame(ctx, &frm, 1) == -1)
+			return -1;
+		if (mk_write_file_data(ctx, MK_AVATAR_SIZE, NULL) == -1)
+			return -1;
+		n++;
+	}
+	frm.avatar = NULL;
+
+	par.n = 0;
+	mk_add_int(&par, 1);
+	mk_add_text(&par, "0123456789abcdef0123456789abcdef");
+	mk_add_int(&par, 0);
+	mk_add_int(&par, MK_STICKER_SIZE);
+	if (mk_write_statement(ctx, "INSERT INTO sticker VALUES (?,?,?,?)",
+	    &par) == -1)
+		return -1;
+
+	stk.has_rowid = 1;
+	stk.rowid = 1;
+	stk.has_length = 1;
+	stk.length = MK_STICKER_SIZE;
+	frm.sticker = &stk;
+	if (mk_write_frame(ctx, &frm, 1) == -1)
+		return -1;
+
+	return mk_write_file_data(ctx, MK_STICKER_SIZE, NULL);
+}
+
+static int
+mk_write_backup(struct mk_ctx *ctx, const struct mk_config *cfg,
+    const char *passphr)
+{
+	Signal__BackupFrame	frm = SIGNAL__BACKUP_FRAME__INIT;
+	Signal__Header		hdr = SIGNAL__HEADER__INIT;
+	Signal__DatabaseVersion	ver = SIGNAL__DATABASE_VERSION__INIT;
+	unsigned char		iv[MK_IV_LEN], salt[MK_SALT_LEN];
+	size_t			i;
+
+	arc4random_buf(iv, sizeof iv);
+	arc4random_buf(salt, sizeof salt);
+
+	if (mk_compute_keys(ctx, passphr, salt, sizeof salt) == -1)
+		return -1;
+
+	/* The counter is stored in the first four bytes of the IV */
+	memcpy(ctx->iv, iv, sizeof iv);
+	ctx->counter = (uint32_t)iv[0] << 24 | (uint32_t)iv[1] << 16 |
+	    (uint32_t)iv[2] << 8 | iv[3];
+
+	hdr.has_iv = 1;
+	hdr.iv.data = iv;
+	hdr.iv.len = sizeof iv;
+	hdr.has_salt = 1;
+	hdr.salt.data = salt;
+	hdr.salt.len = sizeof salt;
+	frm.header = &hdr;
+	if (mk_write_frame(ctx, &frm, 0) == -1)
+		return -1;
+	frm.header = NULL;
+
+	ver.has_version = 1;
+	ver.version = MK_DB_VERSION;
+	frm.version = &ver;
+	if (mk_write_frame(ctx, &frm, 1) == -1)
+		return -1;
+	frm.version = NULL;
+
+	for (i = 0; i < sizeof mk_schema / sizeof mk_schema[0]; i++)
+		if (mk_write_statement(ctx, mk_schema[i], NULL) == -1)
+			return -1;
+
+	if (mk_write_recipients(ctx, cfg) == -1)
+		return -1;
+
+	if (mk_write_threads(ctx, cfg) == -1)
+		return -1;
+
+	if (mk_write_messages(ctx, cfg, 0) == -1)
+		return -1;
+
+	if (mk_write_messages(ctx, cfg, 1) == -1)
+		return -1;
+
+	if (mk_write_parts(ctx, cfg) == -1)
+		return -1;
+
+	if (mk_write_mentions(ctx, cfg) == -1)
+		return -1;
+
+	if (mk_write_extras(ctx, cfg) == -1)
+		return -1;
+
+	frm.has_end = 1;
+	frm.end = 1;
+	return mk_write_frame(ctx, &frm, 1);
+}
+
+/* Read the passphrase like sigbak does: up to the first newline, no spaces */
+static int
+read_passphrase(const char *passfile, char *buf, size_t bufsize)
+{
+	FILE	*fp;
+	char	*c, *d;
+
+	if ((fp = fopen(passfile, "r")) == NULL) {
+		warn("%s", passfile);
+		return -1;
+	}
+
+	if (fgets(buf, bufsize, fp) == NULL) {
+		if (ferror(fp))
+			warn("%s", passfile);
+		else
+			warnx("%s: Empty file", passfile);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	for (c = d = buf; *c != '\0' && *c != '\n'; c++)
+		if (*c != ' ')
+			*d++ = *c;
+	*d = '\0';
+
+	return 0;
+}
+
+static int
+get_count(const char *arg, const char *what, int max)
+{
+	const char	*errstr;
+	int		 n;
+
+	n = strtonum(arg, 0, max, &errstr);
+	if (errstr != NULL)
+		errx(1, "%s: number of %s is %s", arg, what, errstr);
+
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mk_config	 cfg;
+	struct mk_ctx		 ctx;
+	char			 passphr[128];
+	const char		*passfile;
+	int			 c, fd, ret;
+
+	/* By default, the other counts are proportional to the messages */
+	cfg.threads = 10;
+	cfg.messages = 10000;
+	cfg.attachments = -1;
+	cfg.attachment_size = 100000;
+	cfg.long_messages = -1;
+	cfg.mentions = -1;
+	cfg.reactions = -1;
+	passfile = NULL;
+
+	while ((c = getopt(argc, argv, "a:l:m:n:p:r:s:t:")) != -1)
+		switch (c) {
+		case 'a':
+			cfg.attachments = get_count(optarg, "attachments",
+			    INT_MAX);
+			break;
+		case 'l':
+			cfg.long_messages = get_count(optarg, "long messages",
+			    INT_MAX);
+			break;
+		case 'm':
+			cfg.messages = get_count(optarg, "messages", INT_MAX);
+			break;
+		case 'n':
+			cfg.mentions = get_count(optarg, "mentions", INT_MAX);
+			break;
+		case 'p':
+			passfile = optarg;
+			break;
+		case 'r':
+			cfg.reactions = get_count(optarg, "reactions",
+			    INT_MAX);
+			break;
+		case 's':
+			cfg.attachment_size = get_count(optarg,
+			    "attachment bytes", UINT32_MAX / 2);
+			break;
+		case 't':
+			cfg.threads = get_count(optarg, "threads", INT_MAX);
+			break;
+		default:
+			usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	if (cfg.threads == 0)
+		errx(1, "At least one thread is needed");
+
+	if (cfg.attachments == -1)
+		cfg.attachments = cfg.messages / 10;
+	if (cfg.long_messages == -1)
+		cfg.long_messages = cfg.messages / 100;
+	if (cfg.mentions == -1)
+		cfg.mentions = cfg.messages / 20;
+	if (cfg.reactions == -1)
+		cfg.reactions = cfg.messages / 10;
+
+	if (cfg.attachments > cfg.messages ||
+	    cfg.long_messages > cfg.messages ||
+	    cfg.mentions > cfg.messages ||
+	    cfg.reactions > cfg.messages)
+		errx(1, "More attachments, long messages, mentions or "
+		    "reactions than messages");
+
+	if (passfile == NULL)
+		snprintf(passphr, sizeof passphr, "%s", MK_DEFAULT_PASSPHRASE);
+	else if (read_passphrase(passfile, passphr, sizeof passphr) == -1)
+		return 1;
+
+	memset(&ctx, 0, sizeof ctx);
+	ctx.rng = 0x9e3779b97f4a7c15ULL;
+
+	if ((ctx.cipher = EVP_CIPHER_CTX_new()) == NULL)
+		errx(1, "Cannot create cipher context");
+
+	if ((ctx.hmac = HMAC_CTX_new()) == NULL)
+		errx(1, "Cannot create HMAC context");
+
+	if ((fd = open(argv[0], O_WRONLY | O_CREAT | O_EXCL, 0666)) == -1)
+		err(1, "%s", argv[0]);
+
+	if ((ctx.fp = fdopen(fd, "w")) == NULL)
+		err(1, "%s", argv[0]);
+
+	ret = mk_write_backup(&ctx, &cfg, passphr);
+
+	if (fclose(ctx.fp) == EOF) {
+		warn("%s", argv[0]);
+		ret = -1;
+	}
+
+	if (ret == -1)
+		unlink(argv[0]);
+
+	explicit_bzero(passphr, sizeof passphr);
+	explicit_bzero(ctx.cipherkey, sizeof ctx.cipherkey);
+	explicit_bzero(ctx.mackey, sizeof ctx.mackey);
+	EVP_CIPHER_CTX_free(ctx.cipher);
+	HMAC_CTX_free(ctx.hmac);
+	free(ctx.buf);
+
+	return (ret == 0) ? 0 : 1;
+}
@@ -15,11 +15,14 @@
  */
 
 #include <sys/stat.h>
+#include <sys/tree.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +30,12 @@
 
 #include "sigbak.h"
 
+#define ATTACHMENTS_MAX_JOBS	64
+
+/* Suffix of the temporary name under which a duplicate is linked */
+#define ATTACHMENT_LINK_SUFFIX	".link"
+#define ATTACHMENT_PART_SUFFIX	".part"
+
 static struct {
 	const char *type;
 	const char *extension;
@@ -68,6 +77,45 @@ static struct {
 	{ "video/mpeg",						"mpg" },
 };
 
+/* The tables needed to find the attachments */
+static const char *tables[] = {
+	"mms",
+	"part",
+	NULL
+};
+
+/* An exported attachment that later attachments may be linked to */
+struct dedup_file {
+	unsigned char	 digest[SBK_DIGEST_LEN];
+	char		*name;
+	SLIST_ENTRY(dedup_file) entries;
+};
+
+/* The attachments that have the same size and content type */
+struct dedup_group {
+	uint64_t	 size;
+	const char	*type;
+	int		 count;
+	SLIST_HEAD(, dedup_file) files;
+	RB_ENTRY(dedup_group) entries;
+};
+
+RB_HEAD(dedup_tree, dedup_group);
+
+struct attachment_state {
+	pthread_mutex_t		 mtx;
+	struct sbk_attachment	*next;
+	struct dedup_tree	*dedup;
+	struct manifest		*manifest;
+	int			 ret;
+};
+
+struct attachment_worker {
+	pthread_t		 thread;
+	struct sbk_ctx		*ctx;
+	struct attachment_state	*state;
+};
+
 static const char *
 get_extension(const char *type)
 {
@@ -80,8 +128,8 @@ get_extension(const char *type)
 	return NULL;
 }
 
-static char *
-get_filename(struct sbk_attachment *att)
+char *
+get_attachment_filename(struct sbk_attachment *att)
 {
 	char		*fname;
 	const char	*ext;
@@ -103,56 +151,414 @@ get_filename(struct sbk_attachment *att)
 	return fname;
 }
 
+/* If digest is not NULL, the digest of the attachment is computed as well */
 static int
-write_attachments(struct sbk_ctx *ctx, struct sbk_attachment_list *lst)
+write_attachment(struct sbk_ctx *ctx, struct sbk_attachment *att,
+    const char *fname, unsigned char *digest)
 {
-	struct sbk_attachment	*att;
-	FILE			*fp;
-	char			*fname;
-	int			 ret;
+	int fd, ret;
+
+	ret = 0;
+
+	if ((fd = open(fname, O_WRONLY | O_CREAT | O_EXCL, 0666)) == -1) {
+		warn("%s", fname);
+		ret = 1;
+	} else {
+		if (sbk_write_file_digest(ctx, att->file, fd, digest) == -1) {
+			warnx("%s: %s", fname, sbk_error(ctx));
+			ret = 1;
+		}
+		if (close(fd) == -1) {
+			warn("%s", fname);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Write the attachment under a temporary name, flush it to disk and rename it
+ * to fname. A run that is interrupted thus never leaves a partial file under
+ * fname, and a file that is not in the manifest yet is simply replaced.
+ */
+static int
+write_attachment_atomic(struct sbk_ctx *ctx, struct sbk_attachment *att,
+    const char *fname, unsigned char *digest)
+{
+	char	*tmp;
+	int	 fd, ret;
+
+	if (asprintf(&tmp, "%s" ATTACHMENT_PART_SUFFIX, fname) == -1) {
+		warnx("asprintf() failed");
+		return 1;
+	}
 
 	ret = 0;
 
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+		warn("%s", tmp);
+		free(tmp);
+		return 1;
+	}
+
+	if (sbk_write_file_digest(ctx, att->file, fd, digest) == -1) {
+		warnx("%s: %s", fname, sbk_error(ctx));
+		ret = 1;
+	} else if (fsync(fd) == -1) {
+		warn("fsync: %s", tmp);
+		ret = 1;
+	}
+
+	if (close(fd) == -1) {
+		warn("%s", tmp);
+		ret = 1;
+	}
+
+	if (ret == 0 && rename(tmp, fname) == -1) {
+		warn("rename: %s", fname);
+		ret = 1;
+	}
+
+	if (ret != 0)
+		unlink(tmp);
+
+	free(tmp);
+	return ret;
+}
+
+/* With a manifest, attachments are written so that they can be resumed */
+static int
+export_attachment_file(struct sbk_ctx *ctx, struct attachment_state *st,
+    struct sbk_attachment *att, const char *fname, unsigned char *digest)
+{
+	if (st->manifest != NULL)
+		return write_attachment_atomic(ctx, att, fname, digest);
+	else
+		return write_attachment(ctx, att, fname, digest);
+}
+
+static int
+cmp_dedup_groups(struct dedup_group *a, struct dedup_group *b)
+{
+	if (a->size != b->size)
+		return (a->size < b->size) ? -1 : 1;
+
+	return strcmp(a->type, b->type);
+}
+
+RB_GENERATE_STATIC(dedup_tree, dedup_group, entries, cmp_dedup_groups)
+
+static struct dedup_group *
+find_dedup_group(struct dedup_tree *tree, struct sbk_attachment *att)
+{
+	struct dedup_group find;
+
+	find.size = att->size;
+	find.type = (att->content_type != NULL) ? att->content_type : "";
+	return RB_FIND(dedup_tree, tree, &find);
+}
+
+static void
+free_dedup_groups(struct dedup_tree *tree)
+{
+	struct dedup_group	*grp;
+	struct dedup_file	*df;
+
+	while ((grp = RB_ROOT(tree)) != NULL) {
+		RB_REMOVE(dedup_tree, tree, grp);
+		while ((df = SLIST_FIRST(&grp->files)) != NULL) {
+			SLIST_REMOVE_HEAD(&grp->files, entries);
+			free(df->name);
+			free(df);
+		}
+		free(grp);
+	}
+}
+
+/*
+ * Group the attachments by size and content type. Only attachments in a group
+ * of two or more can be duplicates, so the others need not be hashed.
+ */
+static int
+add_dedup_groups(struct dedup_tree *tree, struct sbk_attachment_list *lst)
+{
+	struct sbk_attachment	*att;
+	struct dedup_group	*grp;
+
 	TAILQ_FOREACH(att, lst, entries) {
 		if (att->file == NULL)
 			continue;
 
-		if ((fname = get_filename(att)) == NULL) {
-			ret = 1;
+		if ((grp = find_dedup_group(tree, att)) != NULL) {
+			grp->count++;
 			continue;
 		}
 
-		if ((fp = fopen(fname, "wx")) == NULL) {
-			warn("%s", fname);
-			ret = 1;
-		} else {
-			if (sbk_write_file(ctx, att->file, fp) == -1) {
-				warnx("%s: %s", fname, sbk_error(ctx));
-				ret = 1;
-			}
-			fclose(fp);
+		if ((grp = malloc(sizeof *grp)) == NULL) {
+			warn(NULL);
+			return -1;
 		}
 
-		free(fname);
+		grp->size = att->size;
+		grp->type = (att->content_type != NULL) ? att->content_type :
+		    "";
+		grp->count = 1;
+		SLIST_INIT(&grp->files);
+		RB_INSERT(dedup_tree, tree, grp);
 	}
 
+	return 0;
+}
+
+/*
+ * Replace the copy in fname with a hard link to the identical file target. The
+ * link is created under a temporary name and renamed over the copy, so fname
+ * exists throughout. If linking is not possible, the copy is kept.
+ */
+static void
+replace_with_link(const char *target, const char *fname)
+{
+	char *tmp;
+
+	if (asprintf(&tmp, "%s" ATTACHMENT_LINK_SUFFIX, fname) == -1) {
+		warnx("asprintf() failed");
+		return;
+	}
+
+	/* A link may have been left by an interrupted run */
+	unlink(tmp);
+
+	if (link(target, tmp) == 0 && rename(tmp, fname) == -1) {
+		warn("rename: %s", fname);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+/*
+ * Write the attachment and compute its digest in the same pass. If an
+ * identical attachment has been written already, link to it instead.
+ */
+static int
+dedup_attachment(struct sbk_ctx *ctx, struct attachment_state *st,
+    struct sbk_attachment *att, const char *fname)
+{
+	struct dedup_group	*grp;
+	struct dedup_file	*df, *new;
+	unsigned char		 digest[SBK_DIGEST_LEN];
+	int			 ret;
+
+	grp = find_dedup_group(st->dedup, att);
+	if (grp == NULL || grp->count < 2)
+		return export_attachment_file(ctx, st, att, fname, NULL);
+
+	if ((ret = export_attachment_file(ctx, st, att, fname, digest)) != 0)
+		return ret;
+
+	/* Entries are never removed, so df remains valid after unlocking */
+	pthread_mutex_lock(&st->mtx);
+	SLIST_FOREACH(df, &grp->files, entries)
+		if (memcmp(df->digest, digest, sizeof digest) == 0)
+			break;
+	pthread_mutex_unlock(&st->mtx);
+
+	if (df != NULL) {
+		replace_with_link(df->name, fname);
+		return 0;
+	}
+
+	if ((new = malloc(sizeof *new)) == NULL) {
+		warn(NULL);
+		return 0;
+	}
+
+	if ((new->name = strdup(fname)) == NULL) {
+		warn(NULL);
+		free(new);
+		return 0;
+	}
+
+	memcpy(new->digest, digest, sizeof digest);
+
+	pthread_mutex_lock(&st->mtx);
+	SLIST_INSERT_HEAD(&grp->files, new, entries);
+	pthread_mutex_unlock(&st->mtx);
+
+	return 0;
+}
+
+static int
+export_attachment(struct sbk_ctx *ctx, struct attachment_state *st,
+    struct sbk_attachment *att)
+{
+	char	*fname;
+	int	 ret;
+
+	if (att->file == NULL)
+		return 0;
+
+	if ((fname = get_attachment_filename(att)) == NULL)
+		return 1;
+
+	if (st->dedup != NULL)
+		ret = dedup_attachment(ctx, st, att, fname);
+	else
+		ret = export_attachment_file(ctx, st, att, fname, NULL);
+
+	free(fname);
+
+	if (ret == 0 && st->manifest != NULL) {
+		pthread_mutex_lock(&st->mtx);
+		if (manifest_add_attachment(st->manifest, att->rowid,
+		    att->attachmentid) == -1)
+			ret = 1;
+		pthread_mutex_unlock(&st->mtx);
+	}
+
+	return ret;
+}
+
+/* Move the attachments that have been exported before to another list */
+static void
+skip_exported_attachments(struct manifest *mf,
+    struct sbk_attachment_list *lst, struct sbk_attachment_list *skipped)
+{
+	struct sbk_attachment *att, *next;
+
+	for (att = TAILQ_FIRST(lst); att != NULL; att = next) {
+		next = TAILQ_NEXT(att, entries);
+		if (manifest_has_attachment(mf, att->rowid,
+		    att->attachmentid)) {
+			TAILQ_REMOVE(lst, att, entries);
+			TAILQ_INSERT_TAIL(skipped, att, entries);
+		}
+	}
+}
+
+static int
+write_attachments(struct sbk_ctx *ctx, struct sbk_attachment_list *lst,
+    struct attachment_state *st)
+{
+	struct sbk_attachment	*att;
+	int			 ret;
+
+	ret = 0;
+
+	TAILQ_FOREACH(att, lst, entries)
+		ret |= export_attachment(ctx, st, att);
+
 	return ret;
 }
 
+static void *
+attachment_worker(void *arg)
+{
+	struct attachment_worker	*wrk;
+	struct attachment_state		*st;
+	struct sbk_attachment		*att;
+
+	wrk = arg;
+	st = wrk->state;
+
+	for (;;) {
+		pthread_mutex_lock(&st->mtx);
+		if ((att = st->next) != NULL)
+			st->next = TAILQ_NEXT(att, entries);
+		pthread_mutex_unlock(&st->mtx);
+
+		if (att == NULL)
+			break;
+
+		if (export_attachment(wrk->ctx, st, att) != 0) {
+			pthread_mutex_lock(&st->mtx);
+			st->ret = 1;
+			pthread_mutex_unlock(&st->mtx);
+		}
+	}
+
+	return NULL;
+}
+
+/* Each worker has its own backup context and takes the next attachment */
+static int
+write_attachments_parallel(struct sbk_attachment_list *lst,
+    struct attachment_state *st, struct attachment_worker *workers,
+    int nworkers)
+{
+	int i, n;
+
+	st->next = TAILQ_FIRST(lst);
+	st->ret = 0;
+
+	for (n = 0; n < nworkers; n++) {
+		workers[n].state = st;
+		if (pthread_create(&workers[n].thread, NULL, attachment_worker,
+		    &workers[n]) != 0) {
+			warnx("Cannot create thread");
+			break;
+		}
+	}
+
+	/* If no thread could be created, do the work ourselves */
+	if (n == 0)
+		attachment_worker(&workers[0]);
+
+	for (i = 0; i < n; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	return st->ret;
+}
+
 int
 cmd_attachments(int argc, char **argv)
 {
+	struct attachment_worker	 workers[ATTACHMENTS_MAX_JOBS];
+	struct attachment_state		 st;
+	struct dedup_tree		 dedup;
 	struct sbk_ctx			*ctx;
-	struct sbk_attachment_list	*lst;
-	char				*passfile, passphr[128];
-	const char			*errstr, *outdir;
-	int				 c, ret, thread;
-
+	struct sbk_attachment_list	*lst, skipped;
+	struct manifest			*mf;
+	char				*cache, *index, *keyfile, *manifest;
+	char				*passfile;
+	const char			*errstr, *outdir, *promises;
+	int				 c, dbfile, dflag, i, njobs, nworkers;
+	int				 ret, thread;
+
+	cache = NULL;
+	dflag = 0;
+	index = NULL;
+	keyfile = NULL;
+	manifest = NULL;
+	njobs = 1;
 	passfile = NULL;
 	thread = -1;
 
-	while ((c = getopt(argc, argv, "p:t:")) != -1)
+	while ((c = getopt(argc, argv, "c:di:j:k:m:p:t:")) != -1)
 		switch (c) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'd':
+			dflag = 1;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, ATTACHMENTS_MAX_JOBS,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -187,6 +593,21 @@ cmd_attachments(int argc, char **argv)
 	if (unveil(outdir, "rwc") == -1)
 		err(1, "unveil");
 
+	/* The cache is replaced by a temporary file in the same directory */
+	if (cache != NULL && unveil_dirname(cache, "rwc") == -1)
+		return 1;
+
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	/* The manifest is replaced through a temporary file */
+	if (manifest != NULL && unveil_dirname(manifest, "rwc") == -1)
+		return 1;
+
 	/* For SQLite */
 	if (unveil("/dev/urandom", "r") == -1)
 		err(1, "unveil");
@@ -195,42 +616,79 @@ cmd_attachments(int argc, char **argv)
 	if (unveil("/tmp", "rwc") == -1)
 		err(1, "unveil");
 
+	/* SQLite locks the cache and the temporary database used with -M */
+	dbfile = (cache != NULL || sbk_get_memory_budget() != 0);
+	promises = dbfile ? "stdio rpath wpath cpath flock" :
+	    "stdio rpath wpath cpath";
+
 	if (passfile == NULL) {
-		if (pledge("stdio rpath wpath cpath tty", NULL) == -1)
+		if (pledge(dbfile ? "stdio rpath wpath cpath flock tty" :
+		    "stdio rpath wpath cpath tty", NULL) == -1)
 			err(1, "pledge");
 	} else {
 		if (unveil(passfile, "r") == -1)
 			err(1, "unveil");
 
-		if (pledge("stdio rpath wpath cpath", NULL) == -1)
+		if (pledge(promises, NULL) == -1)
 			err(1, "pledge");
 	}
 
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
+	if (cache != NULL && sbk_set_cache(ctx, cache) == -1) {
+		warnx("%s", sbk_error(ctx));
+		sbk_close(ctx);
+		sbk_ctx_free(ctx);
+		return 1;
+	}
 
-	if (chdir(outdir) == -1) {
-		warn("chdir: %s", outdir);
+	if (sbk_set_tables(ctx, tables) == -1) {
+		warnx("%s", sbk_error(ctx));
 		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	if (passfile == NULL && pledge("stdio rpath wpath cpath", NULL) == -1)
+	/*
+	 * Open the manifest and the backup for the workers before changing the
+	 * directory.
+	 */
+	mf = NULL;
+	nworkers = 0;
+
+	if (manifest != NULL && (mf = manifest_open(manifest)) == NULL) {
+		ret = 1;
+		goto out;
+	}
+
+	if (njobs > 1)
+		for (; nworkers < njobs; nworkers++)
+			if ((workers[nworkers].ctx = clone_backup(ctx,
+			    argv[0])) == NULL) {
+				ret = 1;
+				goto out;
+			}
+
+	if (chdir(outdir) == -1) {
+		warn("chdir: %s", outdir);
+		ret = 1;
+		goto out;
+	}
+
+	if (passfile == NULL && pledge(promises, NULL) == -1)
 		err(1, "pledge");
 
 	if (thread == -1)
@@ -241,15 +699,65 @@ cmd_attachments(int argc, char **argv)
 	if (lst == NULL) {
 		warnx("%s", sbk_error(ctx));
 		ret = 1;
-	} else {
-		ret = write_attachments(ctx, lst);
+		goto out;
+	}
+
+	if (pthread_mutex_init(&st.mtx, NULL) != 0) {
+		warnx("Cannot initialise mutex");
 		sbk_free_attachment_list(lst);
+		ret = 1;
+		goto out;
+	}
+
+	RB_INIT(&dedup);
+	TAILQ_INIT(&skipped);
+	st.dedup = NULL;
+	st.manifest = mf;
+
+	if (mf != NULL)
+		skip_exported_attachments(mf, lst, &skipped);
+
+	if (dflag) {
+		if (add_dedup_groups(&dedup, lst) == -1) {
+			ret = 1;
+			goto done;
+		}
+		st.dedup = &dedup;
+	}
+
+	/* Read the backup sequentially rather than in message order */
+	if (sbk_sort_attachments(ctx, lst) == -1)
+		warnx("%s", sbk_error(ctx));
+
+	if (nworkers > 0)
+		ret = write_attachments_parallel(lst, &st, workers, nworkers);
+	else
+		ret = write_attachments(ctx, lst, &st);
+
+	/* Record what has been exported, even if some attachments failed */
+	if (mf != NULL && manifest_write(mf) == -1)
+		ret = 1;
+
+done:
+	free_dedup_groups(&dedup);
+	pthread_mutex_destroy(&st.mtx);
+	TAILQ_CONCAT(lst, &skipped, entries);
+	sbk_free_attachment_list(lst);
+
+out:
+	for (i = 0; i < nworkers; i++) {
+		sbk_close(workers[i].ctx);
+		sbk_ctx_free(workers[i].ctx);
 	}
 
+	manifest_free(mf);
+
 	sbk_close(ctx);
 	sbk_ctx_free(ctx);
 	return ret;
 
 usage:
-	usage("attachments", "[-p passfile] [-t thread] backup [directory]");
+	usage("attachments", "[-d] [-c cache] [-i index] [-j jobs] "
+	    "[-k keyfile] [-m manifest] [-p passfile] [-t thread] backup "
+	    "[directory]");
 }
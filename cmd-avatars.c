@@ -18,6 +18,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,18 +32,18 @@ enum type {
 	STICKER
 };
 
-static int
-write_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm,
-    struct sbk_file *file, enum type type)
+/*
+ * Write the avatar or sticker of the frame to the directory dfd, which may be
+ * AT_FDCWD. Other frames are ignored.
+ */
+int
+write_frame_file(struct sbk_ctx *ctx, int dfd, Signal__BackupFrame *frm,
+    struct sbk_file *file)
 {
-	FILE	*fp;
 	char	*base, *fname;
-	int	 ret;
+	int	 fd, ret;
 
-	switch (type) {
-	case AVATAR:
-		if (frm->avatar == NULL)
-			return 0;
+	if (frm->avatar != NULL) {
 		if (frm->avatar->recipientid != NULL)
 			base = frm->avatar->recipientid;
 		else if (frm->avatar->name != NULL)
@@ -59,10 +60,7 @@ write_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm,
 			warnx("asprintf() failed");
 			return 1;
 		}
-		break;
-	case STICKER:
-		if (frm->sticker == NULL)
-			return 0;
+	} else if (frm->sticker != NULL) {
 		if (!frm->sticker->has_rowid) {
 			warnx("Invalid sticker frame");
 			return 1;
@@ -72,22 +70,24 @@ write_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm,
 			warnx("asprintf() failed");
 			return 1;
 		}
-		break;
-	default:
+	} else
 		return 0;
-	}
 
 	ret = 0;
 
-	if ((fp = fopen(fname, "wx")) == NULL) {
+	if ((fd = openat(dfd, fname, O_WRONLY | O_CREAT | O_EXCL, 0666)) ==
+	    -1) {
 		warn("%s", fname);
 		ret = 1;
 	} else {
-		if (sbk_write_file(ctx, file, fp) == -1) {
+		if (sbk_write_file(ctx, file, fd) == -1) {
 			warnx("%s: %s", fname, sbk_error(ctx));
 			ret = 1;
 		}
-		fclose(fp);
+		if (close(fd) == -1) {
+			warn("%s", fname);
+			ret = 1;
+		}
 	}
 
 	free(fname);
@@ -100,15 +100,24 @@ write_files(int argc, char **argv, enum type type)
 	struct sbk_ctx		*ctx;
 	struct sbk_file		*file;
 	Signal__BackupFrame	*frm;
-	char			*cmd, *passfile, passphr[128];
+	char			*cmd, *index, *keyfile, *passfile;
 	const char		*outdir;
+	unsigned int		 types;
 	int			 c, ret;
 
 	cmd = argv[0];
+	index = NULL;
+	keyfile = NULL;
 	passfile = NULL;
 
-	while ((c = getopt(argc, argv, "p:")) != -1)
+	while ((c = getopt(argc, argv, "i:k:p:")) != -1)
 		switch (c) {
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -135,6 +144,13 @@ write_files(int argc, char **argv, enum type type)
 	if (unveil(argv[0], "r") == -1 || unveil(outdir, "rwc") == -1)
 		err(1, "unveil");
 
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
 	if (passfile == NULL) {
 		if (pledge("stdio rpath wpath cpath tty", NULL) == -1)
 			err(1, "pledge");
@@ -149,20 +165,18 @@ write_files(int argc, char **argv, enum type type)
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
-
 	if (chdir(outdir) == -1) {
 		warn("chdir: %s", outdir);
 		sbk_close(ctx);
@@ -173,10 +187,11 @@ write_files(int argc, char **argv, enum type type)
 	if (pledge("stdio wpath cpath", NULL) == -1)
 		err(1, "pledge");
 
+	types = (type == AVATAR) ? SBK_FRAME_AVATAR : SBK_FRAME_STICKER;
 	ret = 0;
 
-	while ((frm = sbk_get_frame(ctx, &file)) != NULL) {
-		ret |= write_file(ctx, frm, file, type);
+	while ((frm = sbk_get_filtered_frame(ctx, &file, types)) != NULL) {
+		ret |= write_frame_file(ctx, AT_FDCWD, frm, file);
 		sbk_free_frame(frm);
 		sbk_free_file(file);
 	}
@@ -191,7 +206,8 @@ write_files(int argc, char **argv, enum type type)
 	return ret;
 
 usage:
-	usage(cmd, "[-p passfile] backup [directory]");
+	usage(cmd, "[-i index] [-k keyfile] [-p passfile] backup "
+	    "[directory]");
 }
 
 int
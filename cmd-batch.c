@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sigbak.h"
+
+#define BATCH_MAX_JOBS	64
+
+struct batch_job {
+	char		*backup;
+	char		*passfile;
+	char		*database;
+	off_t		 size;
+	int		 ret;
+};
+
+struct batch_state {
+	pthread_mutex_t	 mtx;
+	struct batch_job **jobs;
+	size_t		 njobs;
+	size_t		 next;
+};
+
+static void
+free_jobs(struct batch_job *jobs, size_t njobs)
+{
+	size_t i;
+
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].backup);
+		free(jobs[i].passfile);
+		free(jobs[i].database);
+	}
+
+	free(jobs);
+}
+
+/*
+ * Each line of the job file contains the path to a backup, the path to its
+ * passphrase file and the path to export the database to. Empty lines and
+ * lines starting with '#' are ignored.
+ */
+static struct batch_job *
+read_jobs(const char *path, size_t *njobs)
+{
+	struct batch_job *jobs, *newjobs;
+	FILE		*fp;
+	char		*field[3], *line, *p;
+	size_t		 i, n, size, linesize;
+	ssize_t		 len;
+	int		 lineno;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return NULL;
+	}
+
+	jobs = NULL;
+	line = NULL;
+	linesize = 0;
+	lineno = 0;
+	n = size = 0;
+
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		lineno++;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		p = line;
+		for (i = 0; i < nitems(field); ) {
+			if ((field[i] = strsep(&p, " \t")) == NULL)
+				break;
+			if (field[i][0] != '\0')
+				i++;
+		}
+
+		while (p != NULL && (*p == ' ' || *p == '\t'))
+			p++;
+
+		if (i != nitems(field) || (p != NULL && *p != '\0')) {
+			warnx("%s:%d: Invalid job", path, lineno);
+			goto error;
+		}
+
+		if (n == size) {
+			newjobs = reallocarray(jobs, size + 16, sizeof *jobs);
+			if (newjobs == NULL) {
+				warn(NULL);
+				goto error;
+			}
+			jobs = newjobs;
+			size += 16;
+		}
+
+		jobs[n].backup = strdup(field[0]);
+		jobs[n].passfile = strdup(field[1]);
+		jobs[n].database = strdup(field[2]);
+		jobs[n].size = 0;
+		jobs[n].ret = -1;
+		n++;
+
+		if (jobs[n - 1].backup == NULL ||
+		    jobs[n - 1].passfile == NULL ||
+		    jobs[n - 1].database == NULL) {
+			warn(NULL);
+			goto error;
+		}
+	}
+
+	if (ferror(fp)) {
+		warn("%s", path);
+		goto error;
+	}
+
+	if (n == 0) {
+		warnx("%s: No jobs", path);
+		goto error;
+	}
+
+	free(line);
+	fclose(fp);
+	*njobs = n;
+	return jobs;
+
+error:
+	free_jobs(jobs, n);
+	free(line);
+	fclose(fp);
+	return NULL;
+}
+
+/* Start with the largest backups, so that the small ones fill the gaps */
+static int
+cmp_jobs(const void *a, const void *b)
+{
+	const struct batch_job *x, *y;
+
+	x = *(struct batch_job * const *)a;
+	y = *(struct batch_job * const *)b;
+
+	return (x->size > y->size) ? -1 : (x->size < y->size);
+}
+
+/* The database of a failed job is removed, so that the job can be retried */
+static int
+run_job(struct batch_job *job)
+{
+	struct sbk_ctx	*ctx;
+	int		 fd, ret;
+
+	/* Prevent SQLite from writing to an existing file */
+	if ((fd = open(job->database, O_RDONLY | O_CREAT | O_EXCL, 0666)) ==
+	    -1) {
+		warn("%s", job->database);
+		return -1;
+	}
+
+	close(fd);
+	ret = -1;
+
+	if ((ctx = sbk_ctx_new()) == NULL)
+		warnx("Cannot create backup context");
+	else {
+		if (open_backup(ctx, job->backup, job->passfile, NULL) == 0) {
+			if ((ret = sbk_write_database(ctx, job->database)) ==
+			    -1)
+				warnx("%s: %s", job->backup, sbk_error(ctx));
+			sbk_close(ctx);
+		}
+		sbk_ctx_free(ctx);
+	}
+
+	if (ret == -1 && unlink(job->database) == -1)
+		warn("unlink: %s", job->database);
+
+	return ret;
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch_state	*st;
+	struct batch_job	*job;
+
+	st = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&st->mtx);
+		job = (st->next < st->njobs) ? st->jobs[st->next++] : NULL;
+		pthread_mutex_unlock(&st->mtx);
+
+		if (job == NULL)
+			break;
+
+		job->ret = run_job(job);
+	}
+
+	return NULL;
+}
+
+int
+cmd_batch(int argc, char **argv)
+{
+	struct batch_state	 st;
+	struct batch_job	*jobs, **order;
+	struct stat		 sb;
+	pthread_t		 threads[BATCH_MAX_JOBS];
+	const char		*errstr;
+	size_t			 i, njobs;
+	int			 c, j, n, nthreads, ret;
+
+	nthreads = 1;
+
+	while ((c = getopt(argc, argv, "j:")) != -1)
+		switch (c) {
+		case 'j':
+			nthreads = strtonum(optarg, 1, BATCH_MAX_JOBS, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		goto usage;
+
+	if ((jobs = read_jobs(argv[0], &njobs)) == NULL)
+		return 1;
+
+	for (i = 0; i < njobs; i++) {
+		if (unveil(jobs[i].backup, "r") == -1)
+			err(1, "unveil: %s", jobs[i].backup);
+
+		if (unveil(jobs[i].passfile, "r") == -1)
+			err(1, "unveil: %s", jobs[i].passfile);
+
+		if (unveil(jobs[i].database, "rwc") == -1)
+			err(1, "unveil: %s", jobs[i].database);
+
+		/*
+		 * SQLite creates temporary files in the same dir as the
+		 * database.
+		 */
+		if (unveil_dirname(jobs[i].database, "rwc") == -1)
+			return 1;
+	}
+
+	/* For SQLite */
+	if (unveil("/dev/urandom", "r") == -1)
+		err(1, "unveil");
+
+	/* For SQLite */
+	if (unveil("/tmp", "rwc") == -1)
+		err(1, "unveil");
+
+	if (pledge("stdio rpath wpath cpath flock", NULL) == -1)
+		err(1, "pledge");
+
+	/* Check every database before any job creates one */
+	ret = 0;
+
+	for (i = 0; i < njobs; i++) {
+		if (lstat(jobs[i].database, &sb) == 0) {
+			warnx("%s: File exists", jobs[i].database);
+			ret = 1;
+		} else if (errno != ENOENT) {
+			warn("%s", jobs[i].database);
+			ret = 1;
+		}
+
+		if (stat(jobs[i].backup, &sb) == 0)
+			jobs[i].size = sb.st_size;
+	}
+
+	if (ret != 0) {
+		free_jobs(jobs, njobs);
+		return 1;
+	}
+
+	if ((order = reallocarray(NULL, njobs, sizeof *order)) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < njobs; i++)
+		order[i] = &jobs[i];
+
+	qsort(order, njobs, sizeof *order, cmp_jobs);
+
+	if (pthread_mutex_init(&st.mtx, NULL) != 0)
+		errx(1, "Cannot initialise mutex");
+
+	st.jobs = order;
+	st.njobs = njobs;
+	st.next = 0;
+
+	if ((size_t)nthreads > njobs)
+		nthreads = njobs;
+
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, batch_worker, &st) != 0) {
+			warnx("Cannot create thread");
+			break;
+		}
+
+	/* If no thread could be created, do the work ourselves */
+	if (n == 0)
+		batch_worker(&st);
+
+	for (j = 0; j < n; j++)
+		pthread_join(threads[j], NULL);
+
+	pthread_mutex_destroy(&st.mtx);
+	free(order);
+
+	ret = 0;
+
+	for (i = 0; i < njobs; i++) {
+		printf("%s: %s\n", jobs[i].backup,
+		    (jobs[i].ret == 0) ? "ok" : "failed");
+		if (jobs[i].ret != 0)
+			ret = 1;
+	}
+
+	free_jobs(jobs, njobs);
+	return ret;
+
+usage:
+	usage("batch", "[-j jobs] file");
+}
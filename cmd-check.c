@@ -14,25 +14,276 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
+
 #include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "sigbak.h"
 
+#define CHECK_MAX_JOBS		64
+#define CHECK_QUEUE_FACTOR	4
+
+struct check_job {
+	struct sbk_file		*file;
+	unsigned long		 seq;
+	SIMPLEQ_ENTRY(check_job) entries;
+};
+
+SIMPLEQ_HEAD(check_job_queue, check_job);
+
+struct check_state {
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 jobcond;	/* Job queued or done */
+	pthread_cond_t		 spacecond;	/* Space in queue */
+	struct check_job_queue	 queue;
+	size_t			 queuelen;
+	size_t			 maxqueuelen;
+	int			 done;
+	unsigned long		 errseq;	/* Sequence number of failure */
+	char			*errmsg;
+};
+
+struct check_worker {
+	pthread_t		 thread;
+	struct sbk_ctx		*ctx;
+	struct check_state	*state;
+};
+
+static int
+check_serial(struct sbk_ctx *ctx, const char *path)
+{
+	struct sbk_file		*file;
+	Signal__BackupFrame	*frm;
+	int			 ret;
+
+	ret = 0;
+
+	while ((frm = sbk_get_frame(ctx, &file)) != NULL) {
+		sbk_free_frame(frm);
+		if (file != NULL) {
+			ret = sbk_write_file(ctx, file, -1);
+			sbk_free_file(file);
+			if (ret == -1)
+				break;
+		}
+	}
+
+	if (!sbk_eof(ctx) || ret == -1) {
+		warnx("%s: %s", path, sbk_error(ctx));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Record a failure, unless an earlier one has already been recorded */
+static void
+check_set_error(struct check_state *st, unsigned long seq, const char *msg)
+{
+	if (seq < st->errseq) {
+		free(st->errmsg);
+		st->errmsg = strdup(msg);
+		st->errseq = seq;
+	}
+}
+
+static void *
+check_worker(void *arg)
+{
+	struct check_worker	*wrk;
+	struct check_state	*st;
+	struct check_job	*job;
+	int			 ret;
+
+	wrk = arg;
+	st = wrk->state;
+
+	pthread_mutex_lock(&st->mtx);
+
+	for (;;) {
+		while (SIMPLEQ_EMPTY(&st->queue) && !st->done)
+			pthread_cond_wait(&st->jobcond, &st->mtx);
+
+		if ((job = SIMPLEQ_FIRST(&st->queue)) == NULL)
+			break;
+
+		SIMPLEQ_REMOVE_HEAD(&st->queue, entries);
+		st->queuelen--;
+		pthread_cond_signal(&st->spacecond);
+
+		/* Files after an earlier failure need not be checked */
+		if (job->seq < st->errseq) {
+			pthread_mutex_unlock(&st->mtx);
+			ret = sbk_write_file(wrk->ctx, job->file, -1);
+			pthread_mutex_lock(&st->mtx);
+
+			if (ret == -1)
+				check_set_error(st, job->seq,
+				    sbk_error(wrk->ctx));
+		}
+
+		sbk_free_file(job->file);
+		free(job);
+	}
+
+	pthread_mutex_unlock(&st->mtx);
+	return NULL;
+}
+
+/*
+ * The main thread reads the frames and queues the file data for
+ * verification by the worker threads. Every file receives a sequence
+ * number, so that the first failure in backup order can be reported,
+ * regardless of the order in which the workers finish.
+ */
+static int
+check_parallel(struct sbk_ctx *ctx, const char *path, int njobs)
+{
+	struct check_worker	 workers[CHECK_MAX_JOBS];
+	struct check_state	 st;
+	struct check_job	*job;
+	struct sbk_file		*file;
+	Signal__BackupFrame	*frm;
+	unsigned long		 seq;
+	int			 i, nworkers, ret;
+
+	SIMPLEQ_INIT(&st.queue);
+	st.queuelen = 0;
+	st.maxqueuelen = njobs * CHECK_QUEUE_FACTOR;
+	st.done = 0;
+	st.errseq = ULONG_MAX;
+	st.errmsg = NULL;
+
+	if (pthread_mutex_init(&st.mtx, NULL) != 0 ||
+	    pthread_cond_init(&st.jobcond, NULL) != 0 ||
+	    pthread_cond_init(&st.spacecond, NULL) != 0) {
+		warnx("Cannot initialise thread state");
+		return 1;
+	}
+
+	for (i = 0; i < njobs; i++) {
+		workers[i].state = &st;
+		if ((workers[i].ctx = clone_backup(ctx, path)) == NULL) {
+			while (i-- > 0) {
+				sbk_close(workers[i].ctx);
+				sbk_ctx_free(workers[i].ctx);
+			}
+			ret = 1;
+			goto out;
+		}
+	}
+
+	if (pledge("stdio", NULL) == -1)
+		err(1, "pledge");
+
+	ret = 0;
+
+	for (nworkers = 0; nworkers < njobs; nworkers++)
+		if (pthread_create(&workers[nworkers].thread, NULL,
+		    check_worker, &workers[nworkers]) != 0) {
+			warnx("Cannot create thread");
+			ret = 1;
+			break;
+		}
+
+	for (seq = 0; ret == 0; ) {
+		if ((frm = sbk_get_frame(ctx, &file)) == NULL) {
+			pthread_mutex_lock(&st.mtx);
+			if (!sbk_eof(ctx))
+				check_set_error(&st, seq, sbk_error(ctx));
+			pthread_mutex_unlock(&st.mtx);
+			break;
+		}
+
+		sbk_free_frame(frm);
+
+		if (file == NULL)
+			continue;
+
+		if ((job = malloc(sizeof *job)) == NULL) {
+			warn(NULL);
+			sbk_free_file(file);
+			ret = 1;
+			break;
+		}
+
+		job->file = file;
+		job->seq = seq++;
+
+		pthread_mutex_lock(&st.mtx);
+
+		while (st.queuelen >= st.maxqueuelen)
+			pthread_cond_wait(&st.spacecond, &st.mtx);
+
+		SIMPLEQ_INSERT_TAIL(&st.queue, job, entries);
+		st.queuelen++;
+		pthread_cond_signal(&st.jobcond);
+
+		/* Stop reading after a failure */
+		if (st.errseq != ULONG_MAX) {
+			pthread_mutex_unlock(&st.mtx);
+			break;
+		}
+
+		pthread_mutex_unlock(&st.mtx);
+	}
+
+	pthread_mutex_lock(&st.mtx);
+	st.done = 1;
+	pthread_cond_broadcast(&st.jobcond);
+	pthread_mutex_unlock(&st.mtx);
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < njobs; i++) {
+		sbk_close(workers[i].ctx);
+		sbk_ctx_free(workers[i].ctx);
+	}
+
+	if (st.errseq != ULONG_MAX) {
+		warnx("%s: %s", path, (st.errmsg != NULL) ? st.errmsg :
+		    "Unknown error");
+		ret = 1;
+	}
+
+	free(st.errmsg);
+
+out:
+	pthread_cond_destroy(&st.spacecond);
+	pthread_cond_destroy(&st.jobcond);
+	pthread_mutex_destroy(&st.mtx);
+	return ret;
+}
+
 int
 cmd_check(int argc, char **argv)
 {
 	struct sbk_ctx		*ctx;
-	struct sbk_file		*file;
-	Signal__BackupFrame	*frm;
-	char			*passfile, passphr[128];
-	int			 c, ret;
+	char			*keyfile, *passfile;
+	const char		*errstr, *promises;
+	int			 c, njobs, ret;
 
+	keyfile = NULL;
+	njobs = 1;
 	passfile = NULL;
 
-	while ((c = getopt(argc, argv, "p:")) != -1)
+	while ((c = getopt(argc, argv, "j:k:p:")) != -1)
 		switch (c) {
+		case 'j':
+			njobs = strtonum(optarg, 1, CHECK_MAX_JOBS, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -49,58 +300,43 @@ cmd_check(int argc, char **argv)
 	if (unveil(argv[0], "r") == -1)
 		err(1, "unveil");
 
-	if (passfile == NULL) {
-		if (pledge("stdio rpath tty", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (unveil(passfile, "r") == -1)
-			err(1, "unveil");
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
 
-		if (pledge("stdio rpath", NULL) == -1)
-			err(1, "pledge");
-	}
+	/* The key file may have to be created */
+	if (keyfile != NULL)
+		promises = (passfile == NULL) ? "stdio rpath wpath cpath tty" :
+		    "stdio rpath wpath cpath";
+	else
+		promises = (passfile == NULL) ? "stdio rpath tty" :
+		    "stdio rpath";
+
+	if (passfile != NULL && unveil(passfile, "r") == -1)
+		err(1, "unveil");
+
+	if (pledge(promises, NULL) == -1)
+		err(1, "pledge");
 
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
-		sbk_ctx_free(ctx);
-		return 1;
-	}
-
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
-
-	if (pledge("stdio", NULL) == -1)
-		err(1, "pledge");
-
-	ret = 0;
-
-	while ((frm = sbk_get_frame(ctx, &file)) != NULL) {
-		sbk_free_frame(frm);
-		if (file != NULL) {
-			ret = sbk_write_file(ctx, file, NULL);
-			sbk_free_file(file);
-			if (ret == -1)
-				break;
-		}
-	}
-
-	if (!sbk_eof(ctx) || ret == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		ret = 1;
-	}
+	if (njobs == 1) {
+		if (pledge("stdio", NULL) == -1)
+			err(1, "pledge");
+		ret = check_serial(ctx, argv[0]);
+	} else
+		/* The worker threads open the backup themselves */
+		ret = check_parallel(ctx, argv[0], njobs);
 
 	sbk_close(ctx);
 	sbk_ctx_free(ctx);
 	return ret;
 
 usage:
-	usage("check", "[-p passfile] backup");
+	usage("check", "[-j jobs] [-k keyfile] [-p passfile] backup");
 }
@@ -15,8 +15,7 @@
  */
 
 #include <err.h>
-#include <inttypes.h>
-#include <stdarg.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,256 +24,442 @@
 
 #include "sigbak.h"
 
+enum {
+	FORMAT_JSONL,
+	FORMAT_TEXT
+};
+
+/*
+ * In text format, every field is printed on a line of its own, indented by
+ * its depth. In JSONL format, every frame is printed as an object on a line of
+ * its own. Repeated fields become arrays; their elements have no key.
+ */
+struct dump {
+	struct sink	*snk;
+	int		 format;
+	unsigned int	 depth;
+	unsigned int	 arraydepth;	/* Depth of the current array, if any */
+	int		 inarray;
+	int		 first;		/* No member at this depth yet */
+};
+
+static const struct {
+	const char	*name;
+	unsigned int	 type;
+} dump_types[] = {
+	{ "attachment",	SBK_FRAME_ATTACHMENT },
+	{ "avatar",	SBK_FRAME_AVATAR },
+	{ "end",	SBK_FRAME_END },
+	{ "header",	SBK_FRAME_HEADER },
+	{ "keyvalue",	SBK_FRAME_KEYVALUE },
+	{ "preference",	SBK_FRAME_PREFERENCE },
+	{ "statement",	SBK_FRAME_STATEMENT },
+	{ "sticker",	SBK_FRAME_STICKER },
+	{ "version",	SBK_FRAME_VERSION }
+};
+
+/* Parse a comma-separated list of frame types */
+static unsigned int
+parse_types(char *list)
+{
+	char		*name;
+	size_t		 i;
+	unsigned int	 types;
+
+	types = 0;
+
+	while ((name = strsep(&list, ",")) != NULL) {
+		for (i = 0; i < nitems(dump_types); i++)
+			if (strcmp(name, dump_types[i].name) == 0)
+				break;
+
+		if (i == nitems(dump_types))
+			errx(1, "%s: invalid frame type", name);
+
+		types |= dump_types[i].type;
+	}
+
+	return types;
+}
+
+/* Write the name and type of a field */
 static void
-dump_var(unsigned int ind, const char *name, const char *type, const char *fmt,
-    ...)
+dump_key(struct dump *d, const char *name, const char *type)
 {
-	va_list ap;
-
-	va_start(ap, fmt);
-	while (ind-- > 0)
-		putchar('\t');
-	printf("%s (%s):", name, type);
-	if (fmt != NULL) {
-		putchar(' ');
-		vprintf(fmt, ap);
+	unsigned int ind;
+
+	if (d->format == FORMAT_TEXT) {
+		for (ind = d->depth; ind > 0; ind--)
+			sink_putc(d->snk, '\t');
+		sink_puts(d->snk, name);
+		sink_write(d->snk, " (", 2);
+		sink_puts(d->snk, type);
+		sink_write(d->snk, "):", 2);
+		return;
 	}
-	putchar('\n');
-	va_end(ap);
+
+	if (!d->first)
+		sink_putc(d->snk, ',');
+	d->first = 0;
+
+	if (!d->inarray || d->arraydepth != d->depth)
+		sink_put_json_key(d->snk, name);
+}
+
+/* Write the name and type of a field, up to its value */
+static void
+dump_field(struct dump *d, const char *name, const char *type)
+{
+	dump_key(d, name, type);
+	if (d->format == FORMAT_TEXT)
+		sink_putc(d->snk, ' ');
 }
 
 static void
-dump_bool(unsigned int ind, const char *name, int val)
+dump_begin(struct dump *d, const char *name, const char *type)
 {
-	dump_var(ind, name, "bool", "%d", val);
+	dump_key(d, name, type);
+
+	if (d->format == FORMAT_TEXT)
+		sink_putc(d->snk, '\n');
+	else {
+		sink_putc(d->snk, '{');
+		d->first = 1;
+	}
+
+	d->depth++;
 }
 
 static void
-dump_int32(unsigned int ind, const char *name, int32_t val)
+dump_end(struct dump *d)
 {
-	dump_var(ind, name, "int32", "%" PRId32, val);
+	d->depth--;
+
+	if (d->format == FORMAT_JSONL) {
+		sink_putc(d->snk, '}');
+		d->first = 0;
+	}
 }
 
+/* In text format, the elements of an array are separate fields */
 static void
-dump_uint32(unsigned int ind, const char *name, uint32_t val)
+dump_begin_array(struct dump *d, const char *name)
 {
-	dump_var(ind, name, "uint32", "%" PRIu32, val);
+	if (d->format == FORMAT_JSONL) {
+		dump_key(d, name, NULL);
+		sink_putc(d->snk, '[');
+		d->first = 1;
+		d->inarray = 1;
+		d->arraydepth = d->depth;
+	}
 }
 
 static void
-dump_int64(unsigned int ind, const char *name, int64_t val)
+dump_end_array(struct dump *d)
 {
-	dump_var(ind, name, "int64", "%" PRId64, val);
+	if (d->format == FORMAT_JSONL) {
+		sink_putc(d->snk, ']');
+		d->first = 0;
+		d->inarray = 0;
+	}
 }
 
 static void
-dump_uint64(unsigned int ind, const char *name, uint64_t val)
+dump_end_field(struct dump *d)
 {
-	dump_var(ind, name, "uint64", "%" PRIu64, val);
+	if (d->format == FORMAT_TEXT)
+		sink_putc(d->snk, '\n');
 }
 
 static void
-dump_float(unsigned int ind, const char *name, float val)
+dump_bool(struct dump *d, const char *name, int val)
 {
-	dump_var(ind, name, "float", "%g", val);
+	dump_field(d, name, "bool");
+	if (d->format == FORMAT_TEXT)
+		sink_putc(d->snk, val ? '1' : '0');
+	else
+		sink_puts(d->snk, val ? "true" : "false");
+	dump_end_field(d);
 }
 
 static void
-dump_double(unsigned int ind, const char *name, double val)
+dump_int(struct dump *d, const char *name, const char *type, int64_t val)
 {
-	dump_var(ind, name, "double", "%g", val);
+	dump_field(d, name, type);
+	sink_put_int(d->snk, val);
+	dump_end_field(d);
 }
 
 static void
-dump_string(unsigned int ind, const char *name, const char *val)
+dump_uint(struct dump *d, const char *name, const char *type, uint64_t val)
 {
-	dump_var(ind, name, "string", "%s", val);
+	dump_field(d, name, type);
+	sink_put_uint(d->snk, val, 0);
+	dump_end_field(d);
 }
 
 static void
-dump_binary(unsigned int ind, const char *name, ProtobufCBinaryData *bin)
+dump_double(struct dump *d, const char *name, const char *type, double val)
 {
-	char	*hex;
-	size_t	 i;
+	char buf[32];
 
-	if (bin->len == SIZE_MAX) {
-		warnx("Binary data too large");
-		return;
-	}
+	dump_field(d, name, type);
 
-	if ((hex = reallocarray(NULL, bin->len + 1, 2)) == NULL) {
-		warn(NULL);
-		return;
+	if (d->format == FORMAT_TEXT) {
+		snprintf(buf, sizeof buf, "%g", val);
+		sink_puts(d->snk, buf);
+	} else if (!isfinite(val))
+		/* JSON has no representation for infinity or NaN */
+		sink_write(d->snk, "null", 4);
+	else {
+		snprintf(buf, sizeof buf, "%.17g", val);
+		sink_puts(d->snk, buf);
 	}
 
-	for (i = 0; i < bin->len; i++)
-		snprintf(hex + (i * 2), 3, "%02" PRIx8, bin->data[i]);
+	dump_end_field(d);
+}
 
-	dump_var(ind, name, "bytes", "%s", hex);
-	free(hex);
+static void
+dump_string(struct dump *d, const char *name, const char *val)
+{
+	dump_field(d, name, "string");
+	if (d->format == FORMAT_TEXT)
+		sink_puts(d->snk, val);
+	else
+		sink_put_json_string(d->snk, val);
+	dump_end_field(d);
+}
+
+/* Binary data is written in hexadecimal, or as a base64 string in JSON */
+static void
+dump_binary(struct dump *d, const char *name, ProtobufCBinaryData *bin)
+{
+	dump_field(d, name, "bytes");
+	if (d->format == FORMAT_TEXT)
+		sink_put_hex(d->snk, bin->data, bin->len);
+	else {
+		sink_putc(d->snk, '"');
+		sink_put_base64(d->snk, bin->data, bin->len);
+		sink_putc(d->snk, '"');
+	}
+	dump_end_field(d);
 }
 
 static void
-dump_attachment(unsigned int ind, const char *name, Signal__Attachment *att)
+dump_attachment(struct dump *d, const char *name, Signal__Attachment *att)
 {
-	dump_var(ind++, name, "Attachment", NULL);
+	dump_begin(d, name, "Attachment");
 	if (att->has_rowid)
-		dump_uint64(ind, "rowId", att->rowid);
+		dump_uint(d, "rowId", "uint64", att->rowid);
 	if (att->has_attachmentid)
-		dump_uint64(ind, "attachmentId", att->attachmentid);
+		dump_uint(d, "attachmentId", "uint64", att->attachmentid);
 	if (att->has_length)
-		dump_uint32(ind, "length", att->length);
+		dump_uint(d, "length", "uint32", att->length);
+	dump_end(d);
 }
 
 static void
-dump_avatar(unsigned int ind, const char *name, Signal__Avatar *avt)
+dump_avatar(struct dump *d, const char *name, Signal__Avatar *avt)
 {
-	dump_var(ind++, name, "Avatar", NULL);
+	dump_begin(d, name, "Avatar");
 	if (avt->name != NULL)
-		dump_string(ind, "name", avt->name);
+		dump_string(d, "name", avt->name);
 	if (avt->has_length)
-		dump_uint32(ind, "length", avt->length);
+		dump_uint(d, "length", "uint32", avt->length);
 	if (avt->recipientid != NULL)
-		dump_string(ind, "recipientId", avt->recipientid);
+		dump_string(d, "recipientId", avt->recipientid);
+	dump_end(d);
 }
 
 static void
-dump_header(unsigned int ind, const char *name, Signal__Header *hdr)
+dump_header(struct dump *d, const char *name, Signal__Header *hdr)
 {
-	dump_var(ind++, name, "Header", NULL);
+	dump_begin(d, name, "Header");
 	if (hdr->has_iv)
-		dump_binary(ind, "iv", &hdr->iv);
+		dump_binary(d, "iv", &hdr->iv);
 	if (hdr->has_salt)
-		dump_binary(ind, "salt", &hdr->salt);
+		dump_binary(d, "salt", &hdr->salt);
+	dump_end(d);
 }
 
 static void
-dump_preference(unsigned int ind, const char *name,
+dump_preference(struct dump *d, const char *name,
     Signal__SharedPreference *prf)
 {
 	size_t i;
 
-	dump_var(ind++, name, "SharedPreference", NULL);
+	dump_begin(d, name, "SharedPreference");
 	if (prf->file != NULL)
-		dump_string(ind, "file", prf->file);
+		dump_string(d, "file", prf->file);
 	if (prf->key != NULL)
-		dump_string(ind, "key", prf->key);
+		dump_string(d, "key", prf->key);
 	if (prf->value != NULL)
-		dump_string(ind, "value", prf->value);
+		dump_string(d, "value", prf->value);
 	if (prf->has_booleanvalue)
-		dump_bool(ind, "booleanValue", prf->booleanvalue);
-	for (i = 0; i < prf->n_stringsetvalue; i++)
-		dump_string(ind, "stringSetValue", prf->stringsetvalue[i]);
+		dump_bool(d, "booleanValue", prf->booleanvalue);
+	if (prf->n_stringsetvalue > 0) {
+		dump_begin_array(d, "stringSetValue");
+		for (i = 0; i < prf->n_stringsetvalue; i++)
+			dump_string(d, "stringSetValue",
+			    prf->stringsetvalue[i]);
+		dump_end_array(d);
+	}
 	if (prf->has_isstringsetvalue)
-		dump_bool(ind, "isStringSetValue", prf->isstringsetvalue);
+		dump_bool(d, "isStringSetValue", prf->isstringsetvalue);
+	dump_end(d);
 }
 
 static void
-dump_parameter(unsigned int ind, const char *name,
+dump_parameter(struct dump *d, const char *name,
     Signal__SqlStatement__SqlParameter *par)
 {
-	dump_var(ind++, name, "SqlParameter", NULL);
+	dump_begin(d, name, "SqlParameter");
 	if (par->stringparamter != NULL)
-		dump_string(ind, "stringParamter", par->stringparamter);
+		dump_string(d, "stringParamter", par->stringparamter);
 	if (par->has_integerparameter)
-		dump_uint64(ind, "integerParameter", par->integerparameter);
+		dump_uint(d, "integerParameter", "uint64",
+		    par->integerparameter);
 	if (par->has_doubleparameter)
-		dump_double(ind, "doubleParameter", par->doubleparameter);
+		dump_double(d, "doubleParameter", "double",
+		    par->doubleparameter);
 	if (par->has_blobparameter)
-		dump_binary(ind, "blobParameter", &par->blobparameter);
+		dump_binary(d, "blobParameter", &par->blobparameter);
 	if (par->has_nullparameter)
-		dump_bool(ind, "nullparameter", par->nullparameter);
+		dump_bool(d, "nullparameter", par->nullparameter);
+	dump_end(d);
 }
 
 static void
-dump_statement(unsigned int ind, const char *name, Signal__SqlStatement *stm)
+dump_statement(struct dump *d, const char *name, Signal__SqlStatement *stm)
 {
 	size_t i;
 
-	dump_var(ind++, name, "SqlStatement", NULL);
+	dump_begin(d, name, "SqlStatement");
 	if (stm->statement != NULL)
-		dump_string(ind, "statement", stm->statement);
-	for (i = 0; i < stm->n_parameters; i++)
-		dump_parameter(ind, "parameters", stm->parameters[i]);
+		dump_string(d, "statement", stm->statement);
+	if (stm->n_parameters > 0) {
+		dump_begin_array(d, "parameters");
+		for (i = 0; i < stm->n_parameters; i++)
+			dump_parameter(d, "parameters", stm->parameters[i]);
+		dump_end_array(d);
+	}
+	dump_end(d);
 }
 
 static void
-dump_sticker(unsigned int ind, const char *name, Signal__Sticker *stk)
+dump_sticker(struct dump *d, const char *name, Signal__Sticker *stk)
 {
-	dump_var(ind++, name, "Sticker", NULL);
+	dump_begin(d, name, "Sticker");
 	if (stk->has_rowid)
-		dump_uint64(ind, "rowId", stk->rowid);
+		dump_uint(d, "rowId", "uint64", stk->rowid);
 	if (stk->has_length)
-		dump_uint32(ind, "length", stk->length);
+		dump_uint(d, "length", "uint32", stk->length);
+	dump_end(d);
 }
 
 static void
-dump_version(unsigned int ind, const char *name, Signal__DatabaseVersion *ver)
+dump_version(struct dump *d, const char *name, Signal__DatabaseVersion *ver)
 {
-	dump_var(ind++, name, "DatabaseVersion", NULL);
+	dump_begin(d, name, "DatabaseVersion");
 	if (ver->has_version)
-		dump_uint32(ind, "version", ver->version);
+		dump_uint(d, "version", "uint32", ver->version);
+	dump_end(d);
 }
 
 static void
-dump_keyvalue(unsigned int ind, const char *name, Signal__KeyValue *key)
+dump_keyvalue(struct dump *d, const char *name, Signal__KeyValue *key)
 {
-	dump_var(ind++, name, "KeyValue", NULL);
+	dump_begin(d, name, "KeyValue");
 	if (key->key != NULL)
-		dump_string(ind, "key", key->key);
+		dump_string(d, "key", key->key);
 	if (key->has_blobvalue)
-		dump_binary(ind, "blobValue", &key->blobvalue);
+		dump_binary(d, "blobValue", &key->blobvalue);
 	if (key->has_booleanvalue)
-		dump_bool(ind, "booleanValue", key->booleanvalue);
+		dump_bool(d, "booleanValue", key->booleanvalue);
 	if (key->has_floatvalue)
-		dump_float(ind, "floatValue", key->floatvalue);
+		dump_double(d, "floatValue", "float", key->floatvalue);
 	if (key->has_integervalue)
-		dump_int32(ind, "integerValue", key->integervalue);
+		dump_int(d, "integerValue", "int32", key->integervalue);
 	if (key->has_longvalue)
-		dump_int64(ind, "longValue", key->longvalue);
+		dump_int(d, "longValue", "int64", key->longvalue);
 	if (key->stringvalue != NULL)
-		dump_string(ind, "stringValue", key->stringvalue);
+		dump_string(d, "stringValue", key->stringvalue);
+	dump_end(d);
 }
 
 static void
-dump_frame(Signal__BackupFrame *frm)
+dump_frame(struct dump *d, Signal__BackupFrame *frm)
 {
-	dump_var(0, "frame", "BackupFrame", NULL);
+	/* A JSONL frame is a top-level object without a key */
+	d->first = 1;
+	d->inarray = 1;
+	d->arraydepth = 0;
+
+	dump_begin(d, "frame", "BackupFrame");
+	d->inarray = 0;
 	if (frm->header != NULL)
-		dump_header(1, "header", frm->header);
+		dump_header(d, "header", frm->header);
 	if (frm->statement != NULL)
-		dump_statement(1, "statement", frm->statement);
+		dump_statement(d, "statement", frm->statement);
 	if (frm->preference != NULL)
-		dump_preference(1, "preference", frm->preference);
+		dump_preference(d, "preference", frm->preference);
 	if (frm->attachment != NULL)
-		dump_attachment(1, "attachment", frm->attachment);
+		dump_attachment(d, "attachment", frm->attachment);
 	if (frm->version != NULL)
-		dump_version(1, "version", frm->version);
+		dump_version(d, "version", frm->version);
 	if (frm->has_end)
-		dump_bool(1, "end", frm->end);
+		dump_bool(d, "end", frm->end);
 	if (frm->avatar != NULL)
-		dump_avatar(1, "avatar", frm->avatar);
+		dump_avatar(d, "avatar", frm->avatar);
 	if (frm->sticker != NULL)
-		dump_sticker(1, "sticker", frm->sticker);
+		dump_sticker(d, "sticker", frm->sticker);
 	if (frm->keyvalue != NULL)
-		dump_keyvalue(1, "keyValue", frm->keyvalue);
+		dump_keyvalue(d, "keyValue", frm->keyvalue);
+	dump_end(d);
+
+	if (d->format == FORMAT_JSONL)
+		sink_putc(d->snk, '\n');
 }
 
 int
 cmd_dump(int argc, char **argv)
 {
+	struct dump		 d;
 	struct sbk_ctx		*ctx;
 	Signal__BackupFrame	*frm;
-	char			*passfile, passphr[128];
+	char			*index, *keyfile, *passfile;
+	const char		*promises;
+	unsigned int		 types;
 	int			 c, ret;
 
+	d.format = FORMAT_TEXT;
+	index = NULL;
+	keyfile = NULL;
 	passfile = NULL;
+	types = SBK_FRAME_ALL;
 
-	while ((c = getopt(argc, argv, "p:")) != -1)
+	while ((c = getopt(argc, argv, "f:i:k:p:t:")) != -1)
 		switch (c) {
+		case 'f':
+			if (strcmp(optarg, "jsonl") == 0)
+				d.format = FORMAT_JSONL;
+			else if (strcmp(optarg, "text") == 0)
+				d.format = FORMAT_TEXT;
+			else
+				errx(1, "%s: invalid format", optarg);
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
+		case 't':
+			types = parse_types(optarg);
+			break;
 		default:
 			goto usage;
 		}
@@ -288,39 +473,55 @@ cmd_dump(int argc, char **argv)
 	if (unveil(argv[0], "r") == -1)
 		err(1, "unveil");
 
-	if (passfile == NULL) {
-		if (pledge("stdio rpath tty", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (unveil(passfile, "r") == -1)
-			err(1, "unveil");
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
 
-		if (pledge("stdio rpath", NULL) == -1)
-			err(1, "pledge");
-	}
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	/* The index and key file may have to be created */
+	if (index != NULL || keyfile != NULL)
+		promises = (passfile == NULL) ? "stdio rpath wpath cpath tty" :
+		    "stdio rpath wpath cpath";
+	else
+		promises = (passfile == NULL) ? "stdio rpath tty" :
+		    "stdio rpath";
+
+	if (passfile != NULL && unveil(passfile, "r") == -1)
+		err(1, "unveil");
+
+	if (pledge(promises, NULL) == -1)
+		err(1, "pledge");
+
+	if ((d.snk = sink_new(STDOUT_FILENO)) == NULL)
+		err(1, NULL);
+
+	d.depth = 0;
 
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
+		sink_free(d.snk);
 		return 1;
 	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	/* With an index, frames of other types are not even decrypted */
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
+		sink_free(d.snk);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
-
 	if (pledge("stdio", NULL) == -1)
 		err(1, "pledge");
 
-	while ((frm = sbk_get_frame(ctx, NULL)) != NULL) {
-		dump_frame(frm);
+	while ((frm = sbk_get_filtered_frame(ctx, NULL, types)) != NULL) {
+		dump_frame(&d, frm);
 		sbk_free_frame(frm);
 	}
 
@@ -331,10 +532,17 @@ cmd_dump(int argc, char **argv)
 		ret = 1;
 	}
 
+	if (sink_flush(d.snk) == -1) {
+		warn("write: stdout");
+		ret = 1;
+	}
+
+	sink_free(d.snk);
 	sbk_close(ctx);
 	sbk_ctx_free(ctx);
 	return ret;
 
 usage:
-	usage("dump", "[-p passfile] backup");
+	usage("dump", "[-f format] [-i index] [-k keyfile] [-p passfile] "
+	    "[-t types] backup");
 }
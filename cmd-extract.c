@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sigbak.h"
+
+#define EXTRACT_DATABASE	"database.sqlite"
+#define EXTRACT_ATTACHMENTS	"attachments"
+#define EXTRACT_AVATARS		"avatars"
+#define EXTRACT_STICKERS	"stickers"
+
+struct extract_state {
+	int	attfd;
+	int	avatarfd;
+	int	stickerfd;
+	int	ret;
+};
+
+/* Create a subdirectory of dfd if needed and open it */
+static int
+open_directory(int dfd, const char *outdir, const char *name)
+{
+	int fd;
+
+	if (mkdirat(dfd, name, 0777) == -1 && errno != EEXIST) {
+		warn("mkdir: %s/%s", outdir, name);
+		return -1;
+	}
+
+	if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) == -1)
+		warn("%s/%s", outdir, name);
+
+	return fd;
+}
+
+/*
+ * The content type of an attachment is in the database, which may not be
+ * complete yet. So attachments are first named after their ids only.
+ */
+static char *
+get_attachment_basename(int64_t rowid, int64_t attachmentid)
+{
+	char *fname;
+
+	if (asprintf(&fname, "%" PRId64 "-%" PRId64, rowid, attachmentid) ==
+	    -1) {
+		warnx("asprintf() failed");
+		fname = NULL;
+	}
+
+	return fname;
+}
+
+static int
+extract_attachment(struct sbk_ctx *ctx, int dfd, Signal__BackupFrame *frm,
+    struct sbk_file *file)
+{
+	char	*fname;
+	int	 fd, ret;
+
+	if (!frm->attachment->has_rowid ||
+	    !frm->attachment->has_attachmentid) {
+		warnx("Invalid attachment frame");
+		return 1;
+	}
+
+	if ((fname = get_attachment_basename(frm->attachment->rowid,
+	    frm->attachment->attachmentid)) == NULL)
+		return 1;
+
+	ret = 0;
+
+	if ((fd = openat(dfd, fname, O_WRONLY | O_CREAT | O_EXCL, 0666)) ==
+	    -1) {
+		warn("%s", fname);
+		ret = 1;
+	} else {
+		if (sbk_write_file(ctx, file, fd) == -1) {
+			warnx("%s: %s", fname, sbk_error(ctx));
+			ret = 1;
+		}
+		if (close(fd) == -1) {
+			warn("%s", fname);
+			ret = 1;
+		}
+	}
+
+	free(fname);
+	return ret;
+}
+
+/* Called by sbk_extract() for every file, right after its frame is read */
+static int
+extract_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm,
+    struct sbk_file *file, void *arg)
+{
+	struct extract_state *st;
+
+	st = arg;
+
+	if (frm->attachment != NULL)
+		st->ret |= extract_attachment(ctx, st->attfd, frm, file);
+	else if (frm->avatar != NULL)
+		st->ret |= write_frame_file(ctx, st->avatarfd, frm, file);
+	else if (frm->sticker != NULL)
+		st->ret |= write_frame_file(ctx, st->stickerfd, frm, file);
+
+	return 0;
+}
+
+/* Give the attachments the same names as the attachments command does */
+static int
+rename_attachments(struct sbk_ctx *ctx, int dfd)
+{
+	struct sbk_attachment_list	*lst;
+	struct sbk_attachment		*att;
+	char				*from, *to;
+	int				 ret;
+
+	if ((lst = sbk_get_all_attachments(ctx)) == NULL) {
+		warnx("%s", sbk_error(ctx));
+		return 1;
+	}
+
+	ret = 0;
+
+	TAILQ_FOREACH(att, lst, entries) {
+		if (att->file == NULL)
+			continue;
+
+		from = get_attachment_basename(att->rowid, att->attachmentid);
+		to = get_attachment_filename(att);
+
+		/*
+		 * Link rather than rename, so that an existing file is not
+		 * replaced. A missing file has been reported already.
+		 */
+		if (from == NULL || to == NULL)
+			ret = 1;
+		else if (strcmp(from, to) != 0) {
+			if (linkat(dfd, from, dfd, to, 0) == -1) {
+				if (errno != ENOENT) {
+					warn("%s", to);
+					ret = 1;
+				}
+			} else if (unlinkat(dfd, from, 0) == -1) {
+				warn("unlink: %s", from);
+				ret = 1;
+			}
+		}
+
+		free(from);
+		free(to);
+	}
+
+	sbk_free_attachment_list(lst);
+	return ret;
+}
+
+int
+cmd_extract(int argc, char **argv)
+{
+	struct extract_state	 st;
+	struct sbk_ctx		*ctx;
+	char			*database, *keyfile, *passfile;
+	const char		*outdir;
+	int			 c, dfd, fd, ret;
+
+	keyfile = NULL;
+	passfile = NULL;
+
+	while ((c = getopt(argc, argv, "k:p:")) != -1)
+		switch (c) {
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'p':
+			passfile = optarg;
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		goto usage;
+
+	outdir = argv[1];
+
+	if (mkdir(outdir, 0777) == -1 && errno != EEXIST)
+		err(1, "mkdir: %s", outdir);
+
+	if (asprintf(&database, "%s/%s", outdir, EXTRACT_DATABASE) == -1)
+		errx(1, "asprintf() failed");
+
+	if (unveil(argv[0], "r") == -1)
+		err(1, "unveil");
+
+	/* SQLite creates temporary files in the same dir as the database */
+	if (unveil(outdir, "rwc") == -1)
+		err(1, "unveil");
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	/* For SQLite */
+	if (unveil("/dev/urandom", "r") == -1)
+		err(1, "unveil");
+
+	/* For SQLite */
+	if (unveil("/tmp", "rwc") == -1)
+		err(1, "unveil");
+
+	if (passfile == NULL) {
+		if (pledge("stdio rpath wpath cpath flock tty", NULL) == -1)
+			err(1, "pledge");
+	} else {
+		if (unveil(passfile, "r") == -1)
+			err(1, "unveil");
+
+		if (pledge("stdio rpath wpath cpath flock", NULL) == -1)
+			err(1, "pledge");
+	}
+
+	/* Prevent SQLite from writing to an existing file */
+	if ((fd = open(database, O_RDONLY | O_CREAT | O_EXCL, 0666)) == -1)
+		err(1, "%s", database);
+
+	close(fd);
+
+	if ((dfd = open(outdir, O_RDONLY | O_DIRECTORY)) == -1)
+		err(1, "%s", outdir);
+
+	if ((st.attfd = open_directory(dfd, outdir, EXTRACT_ATTACHMENTS)) ==
+	    -1 ||
+	    (st.avatarfd = open_directory(dfd, outdir, EXTRACT_AVATARS)) ==
+	    -1 ||
+	    (st.stickerfd = open_directory(dfd, outdir, EXTRACT_STICKERS)) ==
+	    -1)
+		return 1;
+
+	close(dfd);
+
+	if ((ctx = sbk_ctx_new()) == NULL)
+		errx(1, "Cannot create backup context");
+
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
+		sbk_ctx_free(ctx);
+		return 1;
+	}
+
+	if (passfile == NULL &&
+	    pledge("stdio rpath wpath cpath flock", NULL) == -1)
+		err(1, "pledge");
+
+	st.ret = 0;
+
+	/* Read the backup once: the files are written as they are read */
+	if (sbk_extract(ctx, extract_file, &st) == -1) {
+		warnx("%s", sbk_error(ctx));
+		ret = 1;
+		goto out;
+	}
+
+	ret = st.ret;
+
+	if (sbk_write_database(ctx, database) == -1) {
+		warnx("%s: %s", database, sbk_error(ctx));
+		ret = 1;
+	}
+
+	if (rename_attachments(ctx, st.attfd) != 0)
+		ret = 1;
+
+out:
+	close(st.attfd);
+	close(st.avatarfd);
+	close(st.stickerfd);
+	free(database);
+	sbk_close(ctx);
+	sbk_ctx_free(ctx);
+	return ret;
+
+usage:
+	usage("extract", "[-k keyfile] [-p passfile] backup directory");
+}
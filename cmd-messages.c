@@ -16,11 +16,13 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/tree.h>
 
 #include <err.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,49 +32,281 @@
 
 #include "sigbak.h"
 
+#define MESSAGES_MAX_JOBS	64
+
 enum {
 	FORMAT_CSV,
+	FORMAT_JSONL,
 	FORMAT_MAILDIR,
+	FORMAT_MBOX,
 	FORMAT_TEXT
 };
 
-static void
-csv_print_quoted_string(FILE *fp, const char *str)
+struct message_state {
+	pthread_mutex_t	 mtx;
+	struct sbk_thread **threads;
+	size_t		 nthreads;
+	size_t		 next;
+	const char	*dest;
+	int		 format;
+	struct manifest	*mf;
+	int		 ret;
+};
+
+struct message_worker {
+	pthread_t	 thread;
+	struct sbk_ctx	*ctx;
+	struct message_state *state;
+};
+
+/* The time the most recent message in a thread was received */
+struct message_mark {
+	int		thread;
+	int64_t		date;
+	RB_ENTRY(message_mark) entries;
+};
+
+RB_HEAD(message_mark_tree, message_mark);
+
+static int
+cmp_message_marks(struct message_mark *a, struct message_mark *b)
 {
-	const char *c;
+	return (a->thread < b->thread) ? -1 : (a->thread > b->thread);
+}
 
-	if (str == NULL || str[0] == '\0')
-		return;
+RB_GENERATE_STATIC(message_mark_tree, message_mark, entries,
+    cmp_message_marks)
+
+static int
+add_message_mark(struct message_mark_tree *marks, int thread, int64_t date)
+{
+	struct message_mark find, *mark;
+
+	find.thread = thread;
 
-	putc('"', fp);
+	if ((mark = RB_FIND(message_mark_tree, marks, &find)) != NULL) {
+		if (mark->date < date)
+			mark->date = date;
+		return 0;
+	}
 
-	for (c = str; *c != '\0'; c++) {
-		putc(*c, fp);
-		if (*c == '"')
-			putc('"', fp);
+	if ((mark = malloc(sizeof *mark)) == NULL) {
+		warn(NULL);
+		return -1;
 	}
 
-	putc('"', fp);
+	mark->thread = thread;
+	mark->date = date;
+	RB_INSERT(message_mark_tree, marks, mark);
+	return 0;
+}
+
+/* Raise the marks in the manifest and free the marks */
+static int
+set_message_marks(struct message_mark_tree *marks, struct manifest *mf)
+{
+	struct message_mark	*mark;
+	int			 ret;
+
+	ret = 0;
+
+	while ((mark = RB_ROOT(marks)) != NULL) {
+		RB_REMOVE(message_mark_tree, marks, mark);
+		if (mf != NULL && manifest_set_mark(mf, mark->thread,
+		    mark->date) == -1)
+			ret = -1;
+		free(mark);
+	}
+
+	return ret;
+}
+
+/* With a manifest, new messages are appended to the earlier ones */
+static int
+open_output(const char *outfile, struct manifest *mf)
+{
+	int fd, flags;
+
+	if (outfile == NULL)
+		return STDOUT_FILENO;
+
+	flags = O_WRONLY | O_CREAT;
+	flags |= (mf != NULL) ? O_APPEND : (O_TRUNC | O_EXCL);
+
+	if ((fd = open(outfile, flags, 0666)) == -1)
+		warn("open: %s", outfile);
+
+	return fd;
+}
+
+static int
+close_output(struct sink *snk, const char *outfile, int fd)
+{
+	int ret;
+
+	ret = 0;
+
+	if (sink_flush(snk) == -1) {
+		warn("write: %s", (outfile != NULL) ? outfile : "stdout");
+		ret = -1;
+	}
+
+	if (fd != STDOUT_FILENO && close(fd) == -1) {
+		warn("close: %s", outfile);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Pass the messages of a thread, or of all threads, to write_fn. Afterwards,
+ * close_fn, if not NULL, is called to finish the output. Every format is
+ * written through this function.
+ *
+ * Write errors may only be reported when the output is flushed. So the marks
+ * in the manifest are only raised once all messages have been written and the
+ * output has been closed without error.
+ */
+static int
+write_messages(struct sbk_ctx *ctx, int thread, struct manifest *mf,
+    int (*write_fn)(struct sbk_message *, void *), int (*close_fn)(void *),
+    void *arg)
+{
+	struct message_mark_tree marks;
+	struct sbk_message_iter	*it;
+	struct sbk_message	*msg;
+	int			 n, ret;
+
+	if (thread == -1)
+		it = sbk_open_all_messages(ctx);
+	else
+		it = sbk_open_messages_for_thread(ctx, thread);
+
+	if (it == NULL) {
+		warnx("Cannot get messages: %s", sbk_error(ctx));
+		if (close_fn != NULL)
+			close_fn(arg);
+		return -1;
+	}
+
+	RB_INIT(&marks);
+	ret = 0;
+
+	while ((n = sbk_next_message(it, &msg)) == 1) {
+		if (write_fn(msg, arg) == -1)
+			ret = -1;
+		else if (mf != NULL && ret == 0 && add_message_mark(&marks,
+		    msg->thread, msg->time_recv) == -1)
+			ret = -1;
+		sbk_free_message(msg);
+	}
+
+	if (n == -1) {
+		warnx("Cannot get messages: %s", sbk_error(ctx));
+		ret = -1;
+	}
+
+	sbk_close_messages(it);
+
+	if (close_fn != NULL && close_fn(arg) == -1)
+		ret = -1;
+
+	if (set_message_marks(&marks, (ret == 0) ? mf : NULL) == -1)
+		ret = -1;
+
+	return ret;
+}
+
+/* A single output file, or stdout, for the csv, jsonl and text formats */
+struct stream_output {
+	struct sink	*snk;
+	const char	*outfile;
+	int		 fd;
+	int		(*write_fn)(struct sink *, struct sbk_message *);
+};
+
+static int
+stream_write_message(struct sbk_message *msg, void *arg)
+{
+	struct stream_output *out;
+
+	out = arg;
+	return out->write_fn(out->snk, msg);
+}
+
+static int
+stream_close(void *arg)
+{
+	struct stream_output *out;
+
+	out = arg;
+	return close_output(out->snk, out->outfile, out->fd);
+}
+
+static int
+stream_write_messages(struct sbk_ctx *ctx, const char *outfile, int thread,
+    struct manifest *mf, int (*write_fn)(struct sink *, struct sbk_message *))
+{
+	struct stream_output	out;
+	int			ret;
+
+	if ((out.fd = open_output(outfile, mf)) == -1)
+		return -1;
+
+	if ((out.snk = sink_new(out.fd)) == NULL) {
+		warn(NULL);
+		if (out.fd != STDOUT_FILENO)
+			close(out.fd);
+		return -1;
+	}
+
+	out.outfile = outfile;
+	out.write_fn = write_fn;
+
+	ret = write_messages(ctx, thread, mf, stream_write_message,
+	    stream_close, &out);
+
+	sink_free(out.snk);
+	return ret;
+}
+
+static void
+csv_print_quoted_string(struct sink *snk, const char *str)
+{
+	if (str == NULL || str[0] == '\0')
+		return;
+
+	sink_putc(snk, '"');
+	sink_put_escaped(snk, str, '"', '"');
+	sink_putc(snk, '"');
 }
 
 static void
-csv_write_record(FILE *fp, uint64_t time_sent, uint64_t time_recv,
+csv_write_record(struct sink *snk, uint64_t time_sent, uint64_t time_recv,
     int thread, int type, int nattachments, const char *addr,
     const char *name, const char *text)
 {
-	fprintf(fp, "%" PRIu64 ",%" PRIu64 ",%d,%d,%d,",
-	    time_sent, time_recv, thread, type, nattachments);
-
-	csv_print_quoted_string(fp, addr);
-	putc(',', fp);
-	csv_print_quoted_string(fp, name);
-	putc(',', fp);
-	csv_print_quoted_string(fp, text);
-	putc('\n', fp);
+	sink_put_uint(snk, time_sent, 0);
+	sink_putc(snk, ',');
+	sink_put_uint(snk, time_recv, 0);
+	sink_putc(snk, ',');
+	sink_put_int(snk, thread);
+	sink_putc(snk, ',');
+	sink_put_int(snk, type);
+	sink_putc(snk, ',');
+	sink_put_int(snk, nattachments);
+	sink_putc(snk, ',');
+	csv_print_quoted_string(snk, addr);
+	sink_putc(snk, ',');
+	csv_print_quoted_string(snk, name);
+	sink_putc(snk, ',');
+	csv_print_quoted_string(snk, text);
+	sink_putc(snk, '\n');
 }
 
 static int
-csv_write_message(FILE *fp, struct sbk_message *msg)
+csv_write_message(struct sink *snk, struct sbk_message *msg)
 {
 	struct sbk_attachment	*att;
 	struct sbk_reaction	*rct;
@@ -87,7 +321,7 @@ csv_write_message(FILE *fp, struct sbk_message *msg)
 		TAILQ_FOREACH(att, msg->attachments, entries)
 			nattachments++;
 
-	csv_write_record(fp,
+	csv_write_record(snk,
 	    msg->time_sent,
 	    msg->time_recv,
 	    msg->thread,
@@ -99,7 +333,7 @@ csv_write_message(FILE *fp, struct sbk_message *msg)
 
 	if (msg->reactions != NULL)
 		SIMPLEQ_FOREACH(rct, msg->reactions, entries)
-			csv_write_record(fp,
+			csv_write_record(snk,
 			    rct->time_sent,
 			    rct->time_recv,
 			    msg->thread,
@@ -112,44 +346,130 @@ csv_write_message(FILE *fp, struct sbk_message *msg)
 	return 0;
 }
 
-static int
-csv_write_messages(struct sbk_ctx *ctx, const char *outfile, int thread)
+static void
+jsonl_write_recipient(struct sink *snk, struct sbk_recipient *rcp)
 {
-	struct sbk_message_list	*lst;
-	struct sbk_message	*msg;
-	FILE			*fp;
-	int			 ret;
+	sink_put_json_key(snk, "address");
+	if (rcp->type == SBK_CONTACT)
+		sink_put_json_string(snk, rcp->contact->phone);
+	else
+		sink_put_json_string(snk, "group");
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "name");
+	sink_put_json_string(snk, sbk_get_recipient_display_name(rcp));
+}
 
-	if (outfile == NULL)
-		fp = stdout;
-	else if ((fp = fopen(outfile, "wx")) == NULL) {
-		warn("fopen: %s", outfile);
-		return -1;
-	}
+static void
+jsonl_write_attachments(struct sink *snk, struct sbk_attachment_list *lst)
+{
+	struct sbk_attachment *att;
+
+	sink_putc(snk, '[');
+
+	if (lst != NULL)
+		TAILQ_FOREACH(att, lst, entries) {
+			if (att != TAILQ_FIRST(lst))
+				sink_putc(snk, ',');
+			sink_putc(snk, '{');
+			sink_put_json_key(snk, "filename");
+			sink_put_json_string(snk, att->filename);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "content_type");
+			sink_put_json_string(snk, att->content_type);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "size");
+			sink_put_uint(snk, att->size, 0);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "rowid");
+			sink_put_int(snk, att->rowid);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "attachmentid");
+			sink_put_int(snk, att->attachmentid);
+			sink_putc(snk, '}');
+		}
 
-	if (thread == -1)
-		lst = sbk_get_all_messages(ctx);
-	else
-		lst = sbk_get_messages_for_thread(ctx, thread);
+	sink_putc(snk, ']');
+}
 
-	if (lst == NULL) {
-		warnx("Cannot get messages: %s", sbk_error(ctx));
-		fclose(fp);
-		return -1;
-	}
+static void
+jsonl_write_mentions(struct sink *snk, struct sbk_mention_list *lst)
+{
+	struct sbk_mention *mnt;
 
-	ret = 0;
+	sink_putc(snk, '[');
 
-	SIMPLEQ_FOREACH(msg, lst, entries)
-		if (csv_write_message(fp, msg) == -1)
-			ret = -1;
+	if (lst != NULL)
+		SIMPLEQ_FOREACH(mnt, lst, entries) {
+			if (mnt != SIMPLEQ_FIRST(lst))
+				sink_putc(snk, ',');
+			sink_putc(snk, '{');
+			jsonl_write_recipient(snk, mnt->recipient);
+			sink_putc(snk, '}');
+		}
 
-	sbk_free_message_list(lst);
+	sink_putc(snk, ']');
+}
 
-	if (fp != stdout)
-		fclose(fp);
+static void
+jsonl_write_reactions(struct sink *snk, struct sbk_reaction_list *lst)
+{
+	struct sbk_reaction *rct;
+
+	sink_putc(snk, '[');
+
+	if (lst != NULL)
+		SIMPLEQ_FOREACH(rct, lst, entries) {
+			if (rct != SIMPLEQ_FIRST(lst))
+				sink_putc(snk, ',');
+			sink_putc(snk, '{');
+			sink_put_json_key(snk, "time_sent");
+			sink_put_uint(snk, rct->time_sent, 0);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "time_recv");
+			sink_put_uint(snk, rct->time_recv, 0);
+			sink_putc(snk, ',');
+			jsonl_write_recipient(snk, rct->recipient);
+			sink_putc(snk, ',');
+			sink_put_json_key(snk, "emoji");
+			sink_put_json_string(snk, rct->emoji);
+			sink_putc(snk, '}');
+		}
 
-	return ret;
+	sink_putc(snk, ']');
+}
+
+/* Every message is a JSON object on a line of its own */
+static int
+jsonl_write_message(struct sink *snk, struct sbk_message *msg)
+{
+	sink_putc(snk, '{');
+	sink_put_json_key(snk, "time_sent");
+	sink_put_uint(snk, msg->time_sent, 0);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "time_recv");
+	sink_put_uint(snk, msg->time_recv, 0);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "thread");
+	sink_put_int(snk, msg->thread);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "type");
+	sink_put_int(snk, sbk_is_outgoing_message(msg));
+	sink_putc(snk, ',');
+	jsonl_write_recipient(snk, msg->recipient);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "text");
+	sink_put_json_string(snk, msg->text);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "attachments");
+	jsonl_write_attachments(snk, msg->attachments);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "mentions");
+	jsonl_write_mentions(snk, msg->mentions);
+	sink_putc(snk, ',');
+	sink_put_json_key(snk, "reactions");
+	jsonl_write_reactions(snk, msg->reactions);
+	sink_write(snk, "}\n", 2);
+	return 0;
 }
 
 static void
@@ -175,40 +495,51 @@ maildir_create(const char *path)
 	close(fd);
 }
 
-static FILE *
-maildir_open_file(const char *maildir, int64_t date_recv, int64_t date_sent)
+static int
+maildir_open_file(const char *maildir, int64_t date_recv, int64_t date_sent,
+    char **path)
 {
-	FILE	*fp;
-	char	*path;
+	int fd;
 
 	/* Intentionally create deterministic filenames */
 	/* XXX Shouldn't write directly into cur */
-	if (asprintf(&path, "%s/cur/%" PRId64 ".%" PRId64 ".localhost:2,S",
+	if (asprintf(path, "%s/cur/%" PRId64 ".%" PRId64 ".localhost:2,S",
 	    maildir, date_recv, date_sent) == -1) {
 		warnx("asprintf() failed");
-		return NULL;
+		return -1;
 	}
 
-	if ((fp = fopen(path, "wx")) == NULL)
-		warn("fopen: %s", path);
+	if ((fd = open(*path, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, 0666)) ==
+	    -1) {
+		warn("open: %s", *path);
+		free(*path);
+	}
 
-	free(path);
-	return fp;
+	return fd;
 }
 
 static void
-maildir_write_address_header(FILE *fp, const char *hdr, const char *addr,
-    const char *name)
+maildir_write_address_header(struct sink *snk, const char *hdr,
+    const char *addr, const char *name)
 {
-	if (name == NULL)
-		fprintf(fp, "%s: %s@invalid\n", hdr, addr);
-	else
+	sink_puts(snk, hdr);
+	sink_write(snk, ": ", 2);
+
+	if (name == NULL) {
+		sink_puts(snk, addr);
+		sink_puts(snk, "@invalid\n");
+	} else {
 		/* XXX Need to escape double quotes in name */
-		fprintf(fp, "%s: \"%s\" <%s@invalid>\n", hdr, name, addr);
+		sink_putc(snk, '"');
+		sink_puts(snk, name);
+		sink_write(snk, "\" <", 3);
+		sink_puts(snk, addr);
+		sink_puts(snk, "@invalid>\n");
+	}
 }
 
 static void
-maildir_write_date_header(FILE *fp, const char *hdr, int64_t date)
+maildir_write_date_header(struct sink *snk, const char *hdr, int64_t date)
 {
 	const char	*days[] = {
 	    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
@@ -217,98 +548,356 @@ maildir_write_date_header(FILE *fp, const char *hdr, int64_t date)
 	    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep",
 	    "Oct", "Nov", "Dec" };
 
-	struct tm	*tm;
-	time_t		 tt;
+	struct tm	tm;
+	time_t		tt;
+	long		off;
 
 	tt = date / 1000;
 
-	if ((tm = localtime(&tt)) == NULL) {
+	if (localtime_r(&tt, &tm) == NULL) {
 		warnx("localtime() failed");
 		return;
 	}
 
-	fprintf(fp, "%s: %s, %d %s %d %02d:%02d:%02d %c%02ld%02ld\n",
-	    hdr,
-	    days[tm->tm_wday],
-	    tm->tm_mday,
-	    months[tm->tm_mon],
-	    tm->tm_year + 1900,
-	    tm->tm_hour,
-	    tm->tm_min,
-	    tm->tm_sec,
-	    (tm->tm_gmtoff < 0) ? '-' : '+',
-	    labs(tm->tm_gmtoff) / 3600,
-	    labs(tm->tm_gmtoff) % 3600 / 60);
+	off = labs(tm.tm_gmtoff);
+
+	/* E.g. "Date: Sun, 13 Sep 2020 12:26:40 +0200" */
+	sink_puts(snk, hdr);
+	sink_write(snk, ": ", 2);
+	sink_write(snk, days[tm.tm_wday], 3);
+	sink_write(snk, ", ", 2);
+	sink_put_uint(snk, tm.tm_mday, 0);
+	sink_putc(snk, ' ');
+	sink_write(snk, months[tm.tm_mon], 3);
+	sink_putc(snk, ' ');
+	sink_put_int(snk, tm.tm_year + 1900);
+	sink_putc(snk, ' ');
+	sink_put_uint(snk, tm.tm_hour, 2);
+	sink_putc(snk, ':');
+	sink_put_uint(snk, tm.tm_min, 2);
+	sink_putc(snk, ':');
+	sink_put_uint(snk, tm.tm_sec, 2);
+	sink_putc(snk, ' ');
+	sink_putc(snk, (tm.tm_gmtoff < 0) ? '-' : '+');
+	sink_put_uint(snk, off / 3600, 2);
+	sink_put_uint(snk, off % 3600 / 60, 2);
+	sink_putc(snk, '\n');
 }
 
-static int
-maildir_write_message(const char *maildir, struct sbk_message *msg)
+/* Write the headers of a message in maildir or mbox format */
+static void
+maildir_write_headers(struct sink *snk, struct sbk_message *msg)
 {
-	FILE		*fp;
-	const char	*addr, *name;
-
-	if ((fp = maildir_open_file(maildir, msg->time_recv, msg->time_sent))
-	    == NULL)
-		return -1;
+	const char *addr, *name;
 
 	name = sbk_get_recipient_display_name(msg->recipient);
 	addr = (msg->recipient->type == SBK_CONTACT) ?
 	    msg->recipient->contact->phone : "group";
 
 	if (sbk_is_outgoing_message(msg)) {
-		maildir_write_address_header(fp, "From", "you", "You");
-		maildir_write_address_header(fp, "To", addr, name);
+		maildir_write_address_header(snk, "From", "you", "You");
+		maildir_write_address_header(snk, "To", addr, name);
 	} else {
-		maildir_write_address_header(fp, "From", addr, name);
-		maildir_write_address_header(fp, "To", "you", "You");
+		maildir_write_address_header(snk, "From", addr, name);
+		maildir_write_address_header(snk, "To", "you", "You");
 	}
 
-	maildir_write_date_header(fp, "Date", msg->time_sent);
+	maildir_write_date_header(snk, "Date", msg->time_sent);
 
 	if (!sbk_is_outgoing_message(msg))
-		maildir_write_date_header(fp, "X-Received", msg->time_recv);
+		maildir_write_date_header(snk, "X-Received", msg->time_recv);
+
+	sink_puts(snk, "X-Thread: ");
+	sink_put_int(snk, msg->thread);
+	sink_puts(snk, "\n"
+	    "MIME-Version: 1.0\n"
+	    "Content-Type: text/plain; charset=utf-8\n"
+	    "Content-Disposition: inline\n");
+}
+
+static int
+maildir_write_message(struct sink *snk, const char *maildir,
+    struct sbk_message *msg)
+{
+	char	*path;
+	int	 fd, ret;
 
-	fprintf(fp, "X-Thread: %d\n", msg->thread);
-	fputs("MIME-Version: 1.0\n", fp);
-	fputs("Content-Type: text/plain; charset=utf-8\n", fp);
-	fputs("Content-Disposition: inline\n", fp);
+	if ((fd = maildir_open_file(maildir, msg->time_recv, msg->time_sent,
+	    &path)) == -1)
+		return -1;
 
-	if (msg->text != NULL)
-		fprintf(fp, "\n%s\n", msg->text);
+	sink_set_fd(snk, fd);
+	maildir_write_headers(snk, msg);
 
-	fclose(fp);
-	return 0;
+	if (msg->text != NULL) {
+		sink_putc(snk, '\n');
+		sink_puts(snk, msg->text);
+		sink_putc(snk, '\n');
+	}
+
+	ret = close_output(snk, path, fd);
+	free(path);
+	return ret;
 }
 
+/* Every message is written to a file of its own */
+struct maildir_output {
+	struct sink	*snk;
+	const char	*maildir;
+};
+
 static int
-maildir_write_messages(struct sbk_ctx *ctx, const char *maildir, int thread)
+maildir_write_next_message(struct sbk_message *msg, void *arg)
 {
-	struct sbk_message_list	*lst;
-	struct sbk_message	*msg;
-	int			 ret;
+	struct maildir_output *out;
 
-	if (thread == -1)
-		lst = sbk_get_all_messages(ctx);
-	else
-		lst = sbk_get_messages_for_thread(ctx, thread);
+	out = arg;
+	return maildir_write_message(out->snk, out->maildir, msg);
+}
 
-	if (lst == NULL) {
-		warnx("Cannot get messages: %s", sbk_error(ctx));
+static int
+maildir_write_messages(struct sbk_ctx *ctx, const char *maildir, int thread,
+    struct manifest *mf)
+{
+	struct maildir_output	out;
+	int			ret;
+
+	/* The sink is reused for every message file */
+	if ((out.snk = sink_new(-1)) == NULL) {
+		warn(NULL);
 		return -1;
 	}
 
+	out.maildir = maildir;
+
+	ret = write_messages(ctx, thread, mf, maildir_write_next_message, NULL,
+	    &out);
+
+	sink_free(out.snk);
+	return ret;
+}
+
+/*
+ * Write the "From " line that starts a message in an mbox. The date is in
+ * asctime() format, in UTC, e.g. "From you@invalid Sun Sep 13 12:26:40 2020".
+ */
+static void
+mbox_write_from_line(struct sink *snk, struct sbk_message *msg)
+{
+	const char	*days[] = {
+	    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+	const char	*months[] = {
+	    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep",
+	    "Oct", "Nov", "Dec" };
+
+	struct tm	 tm;
+	time_t		 tt;
+	const char	*addr;
+
+	if (sbk_is_outgoing_message(msg))
+		addr = "you";
+	else if (msg->recipient->type == SBK_CONTACT)
+		addr = msg->recipient->contact->phone;
+	else
+		addr = "group";
+
+	sink_write(snk, "From ", 5);
+	sink_puts(snk, addr);
+	sink_puts(snk, "@invalid ");
+
+	tt = msg->time_sent / 1000;
+
+	if (gmtime_r(&tt, &tm) == NULL) {
+		warnx("gmtime() failed");
+		memset(&tm, 0, sizeof tm);
+		tm.tm_mday = 1;
+		tm.tm_year = 70;
+		tm.tm_wday = 4;
+	}
+
+	sink_write(snk, days[tm.tm_wday], 3);
+	sink_putc(snk, ' ');
+	sink_write(snk, months[tm.tm_mon], 3);
+	sink_putc(snk, ' ');
+	if (tm.tm_mday < 10)
+		sink_putc(snk, ' ');
+	sink_put_uint(snk, tm.tm_mday, 0);
+	sink_putc(snk, ' ');
+	sink_put_uint(snk, tm.tm_hour, 2);
+	sink_putc(snk, ':');
+	sink_put_uint(snk, tm.tm_min, 2);
+	sink_putc(snk, ':');
+	sink_put_uint(snk, tm.tm_sec, 2);
+	sink_putc(snk, ' ');
+	sink_put_int(snk, tm.tm_year + 1900);
+	sink_putc(snk, '\n');
+}
+
+/*
+ * Write the message text, quoting lines that start with "From " (preceded by
+ * any number of '>' characters) with an extra '>', as in the mboxrd format
+ */
+static void
+mbox_write_text(struct sink *snk, const char *text)
+{
+	const char	*line, *nl, *p;
+	size_t		 len;
+
+	for (line = text; *line != '\0'; line += len) {
+		if ((nl = strchr(line, '\n')) != NULL)
+			len = nl - line + 1;
+		else
+			len = strlen(line);
+
+		for (p = line; *p == '>'; p++)
+			continue;
+
+		if (strncmp(p, "From ", 5) == 0)
+			sink_putc(snk, '>');
+
+		sink_write(snk, line, len);
+	}
+}
+
+static void
+mbox_write_message(struct sink *snk, struct sbk_message *msg)
+{
+	mbox_write_from_line(snk, msg);
+	maildir_write_headers(snk, msg);
+
+	if (msg->text != NULL) {
+		sink_putc(snk, '\n');
+		mbox_write_text(snk, msg->text);
+		sink_putc(snk, '\n');
+	}
+
+	/* Messages are separated by an empty line */
+	sink_putc(snk, '\n');
+}
+
+/*
+ * The offset file has a line for every message in the mbox, with the offset
+ * and length of the message in bytes, the thread and the times the message
+ * was sent and received
+ */
+static void
+mbox_write_offset(struct sink *snk, uint64_t offset, uint64_t len,
+    struct sbk_message *msg)
+{
+	sink_put_uint(snk, offset, 0);
+	sink_putc(snk, ' ');
+	sink_put_uint(snk, len, 0);
+	sink_putc(snk, ' ');
+	sink_put_int(snk, msg->thread);
+	sink_putc(snk, ' ');
+	sink_put_uint(snk, msg->time_sent, 0);
+	sink_putc(snk, ' ');
+	sink_put_uint(snk, msg->time_recv, 0);
+	sink_putc(snk, '\n');
+}
+
+/* The mbox and, optionally, its offset file */
+struct mbox_output {
+	struct sink	*snk;
+	struct sink	*offsnk;
+	const char	*outfile;
+	const char	*offfile;
+	int		 fd;
+	int		 offfd;
+	off_t		 base;
+};
+
+static int
+mbox_write_next_message(struct sbk_message *msg, void *arg)
+{
+	struct mbox_output	*out;
+	uint64_t		 start;
+
+	out = arg;
+	start = sink_tell(out->snk);
+	mbox_write_message(out->snk, msg);
+
+	if (out->offsnk != NULL)
+		mbox_write_offset(out->offsnk, out->base + start,
+		    sink_tell(out->snk) - start, msg);
+
+	return 0;
+}
+
+static int
+mbox_close(void *arg)
+{
+	struct mbox_output	*out;
+	int			 ret;
+
+	out = arg;
 	ret = 0;
 
-	SIMPLEQ_FOREACH(msg, lst, entries)
-		if (maildir_write_message(maildir, msg) == -1)
+	if (out->snk != NULL) {
+		if (close_output(out->snk, out->outfile, out->fd) == -1)
+			ret = -1;
+	} else if (out->fd != STDOUT_FILENO)
+		close(out->fd);
+
+	if (out->offsnk != NULL) {
+		if (close_output(out->offsnk, out->offfile, out->offfd) == -1)
 			ret = -1;
+	} else if (out->offfd != -1)
+		close(out->offfd);
 
-	sbk_free_message_list(lst);
 	return ret;
 }
 
 static int
-text_write_message(FILE *fp, struct sbk_message *msg)
+mbox_write_messages(struct sbk_ctx *ctx, const char *outfile,
+    const char *offfile, int thread, struct manifest *mf)
+{
+	struct mbox_output	out;
+	int			ret;
+
+	out.snk = out.offsnk = NULL;
+	out.outfile = outfile;
+	out.offfile = offfile;
+	out.offfd = -1;
+
+	if ((out.fd = open_output(outfile, mf)) == -1)
+		return -1;
+
+	if ((out.snk = sink_new(out.fd)) == NULL) {
+		warn(NULL);
+		goto error;
+	}
+
+	if (offfile != NULL) {
+		if ((out.offfd = open_output(offfile, mf)) == -1)
+			goto error;
+		if ((out.offsnk = sink_new(out.offfd)) == NULL) {
+			warn(NULL);
+			goto error;
+		}
+	}
+
+	/* When appending to an mbox, the offsets start at its end */
+	if ((out.base = lseek(out.fd, 0, SEEK_END)) == -1)
+		out.base = 0;
+
+	ret = write_messages(ctx, thread, mf, mbox_write_next_message,
+	    mbox_close, &out);
+
+	sink_free(out.snk);
+	sink_free(out.offsnk);
+	return ret;
+
+error:
+	mbox_close(&out);
+	sink_free(out.snk);
+	sink_free(out.offsnk);
+	return -1;
+}
+
+int
+text_write_message(struct sink *snk, struct sbk_message *msg)
 {
 	struct sbk_attachment	*att;
 	struct sbk_reaction	*rct;
@@ -319,115 +908,327 @@ text_write_message(FILE *fp, struct sbk_message *msg)
 	    msg->recipient->contact->phone : "group";
 
 	if (sbk_is_outgoing_message(msg))
-		fputs("To: ", fp);
+		sink_write(snk, "To: ", 4);
 	else
-		fputs("From: ", fp);
+		sink_write(snk, "From: ", 6);
 
-	fprintf(fp, "%s (%s)\n", name, addr);
+	sink_puts(snk, name);
+	sink_write(snk, " (", 2);
+	sink_puts(snk, addr);
+	sink_write(snk, ")\n", 2);
 
-	maildir_write_date_header(fp, "Sent", msg->time_sent);
+	maildir_write_date_header(snk, "Sent", msg->time_sent);
 
 	if (!sbk_is_outgoing_message(msg))
-		maildir_write_date_header(fp, "Received", msg->time_recv);
+		maildir_write_date_header(snk, "Received", msg->time_recv);
 
-	fprintf(fp, "Thread: %d\n", msg->thread);
+	sink_puts(snk, "Thread: ");
+	sink_put_int(snk, msg->thread);
+	sink_putc(snk, '\n');
 
 	if (msg->attachments != NULL)
 		TAILQ_FOREACH(att, msg->attachments, entries) {
-			fputs("Attachment: ", fp);
+			sink_puts(snk, "Attachment: ");
 
 			if (att->filename == NULL)
-				fputs("no filename", fp);
-			else
-				fprintf(fp, "\"%s\"", att->filename);
-
-			fprintf(fp, " (%s, %" PRIu64 " bytes, id %" PRId64
-			    "-%" PRId64 ")\n",
-			    (att->content_type != NULL) ?
-			    att->content_type : "",
-			    att->size,
-			    att->rowid,
-			    att->attachmentid);
+				sink_puts(snk, "no filename");
+			else {
+				sink_putc(snk, '"');
+				sink_puts(snk, att->filename);
+				sink_putc(snk, '"');
+			}
+
+			sink_write(snk, " (", 2);
+			if (att->content_type != NULL)
+				sink_puts(snk, att->content_type);
+			sink_write(snk, ", ", 2);
+			sink_put_uint(snk, att->size, 0);
+			sink_puts(snk, " bytes, id ");
+			sink_put_int(snk, att->rowid);
+			sink_putc(snk, '-');
+			sink_put_int(snk, att->attachmentid);
+			sink_write(snk, ")\n", 2);
 		}
 
 	if (msg->reactions != NULL)
-		SIMPLEQ_FOREACH(rct, msg->reactions, entries)
-			fprintf(fp, "Reaction: %s from %s\n",
-			    rct->emoji,
+		SIMPLEQ_FOREACH(rct, msg->reactions, entries) {
+			sink_puts(snk, "Reaction: ");
+			sink_puts(snk, rct->emoji);
+			sink_puts(snk, " from ");
+			sink_puts(snk,
 			    sbk_get_recipient_display_name(rct->recipient));
+			sink_putc(snk, '\n');
+		}
 
-	if (msg->text != NULL)
-		fprintf(fp, "\n%s\n\n", msg->text);
-	else
-		fputs("\n", fp);
+	if (msg->text != NULL) {
+		sink_putc(snk, '\n');
+		sink_puts(snk, msg->text);
+		sink_write(snk, "\n\n", 2);
+	} else
+		sink_putc(snk, '\n');
 
 	return 0;
 }
 
+/*
+ * Export the messages of a thread to a separate file in the output directory,
+ * or to the maildir
+ */
 static int
-text_write_messages(struct sbk_ctx *ctx, const char *outfile, int thread)
+write_thread(struct sbk_ctx *ctx, struct message_state *st, int thread)
 {
-	struct sbk_message_list	*lst;
-	struct sbk_message	*msg;
-	FILE			*fp;
-	int			 ret;
+	const char	*ext;
+	char		*path;
+	int		 ret;
 
-	if (outfile == NULL)
-		fp = stdout;
-	else if ((fp = fopen(outfile, "wx")) == NULL) {
-		warn("fopen: %s", outfile);
+	switch (st->format) {
+	case FORMAT_CSV:
+		ext = "csv";
+		break;
+	case FORMAT_JSONL:
+		ext = "jsonl";
+		break;
+	case FORMAT_MAILDIR:
+		return maildir_write_messages(ctx, st->dest, thread, st->mf);
+	case FORMAT_MBOX:
+		ext = "mbox";
+		break;
+	default:
+		ext = "txt";
+		break;
+	}
+
+	if (asprintf(&path, "%s/%d.%s", st->dest, thread, ext) == -1) {
+		warnx("asprintf() failed");
 		return -1;
 	}
 
-	if (thread == -1)
-		lst = sbk_get_all_messages(ctx);
-	else
-		lst = sbk_get_messages_for_thread(ctx, thread);
+	switch (st->format) {
+	case FORMAT_CSV:
+		ret = stream_write_messages(ctx, path, thread, st->mf,
+		    csv_write_message);
+		break;
+	case FORMAT_JSONL:
+		ret = stream_write_messages(ctx, path, thread, st->mf,
+		    jsonl_write_message);
+		break;
+	case FORMAT_MBOX:
+		ret = mbox_write_messages(ctx, path, NULL, thread, st->mf);
+		break;
+	default:
+		ret = stream_write_messages(ctx, path, thread, st->mf,
+		    text_write_message);
+		break;
+	}
 
-	if (lst == NULL) {
-		warnx("Cannot get messages: %s", sbk_error(ctx));
-		fclose(fp);
+	free(path);
+	return ret;
+}
+
+static void *
+message_worker(void *arg)
+{
+	struct message_worker	*wrk;
+	struct message_state	*st;
+	struct sbk_thread	*thd;
+
+	wrk = arg;
+	st = wrk->state;
+
+	for (;;) {
+		pthread_mutex_lock(&st->mtx);
+		thd = (st->next < st->nthreads) ? st->threads[st->next++] :
+		    NULL;
+		pthread_mutex_unlock(&st->mtx);
+
+		if (thd == NULL)
+			break;
+
+		if (write_thread(wrk->ctx, st, thd->id) == -1) {
+			pthread_mutex_lock(&st->mtx);
+			st->ret = -1;
+			pthread_mutex_unlock(&st->mtx);
+		}
+	}
+
+	return NULL;
+}
+
+/* Start with the largest threads, so that the small ones fill the gaps */
+static int
+cmp_threads(const void *a, const void *b)
+{
+	const struct sbk_thread *x, *y;
+
+	x = *(struct sbk_thread * const *)a;
+	y = *(struct sbk_thread * const *)b;
+
+	return (x->nmessages > y->nmessages) ? -1 :
+	    (x->nmessages < y->nmessages);
+}
+
+/*
+ * Export the threads in parallel. Each worker has its own backup context with
+ * its own connection to the database, and takes the next thread.
+ */
+static int
+write_threads_parallel(struct sbk_ctx *ctx, const char *backup,
+    const char *dest, int format, int thread, int njobs, struct manifest *mf)
+{
+	struct message_worker	 workers[MESSAGES_MAX_JOBS];
+	struct message_state	 st;
+	struct sbk_thread_list	*lst;
+	struct sbk_thread	*thd;
+	size_t			 n;
+	int			 i, nthreads, nworkers;
+
+	if ((lst = sbk_get_threads(ctx)) == NULL) {
+		warnx("Cannot get threads: %s", sbk_error(ctx));
 		return -1;
 	}
 
-	ret = 0;
+	n = 0;
+	SIMPLEQ_FOREACH(thd, lst, entries)
+		n++;
 
-	SIMPLEQ_FOREACH(msg, lst, entries)
-		if (text_write_message(fp, msg) == -1)
-			ret = -1;
+	if ((st.threads = reallocarray(NULL, n, sizeof *st.threads)) ==
+	    NULL && n > 0) {
+		warn(NULL);
+		sbk_free_thread_list(lst);
+		return -1;
+	}
 
-	sbk_free_message_list(lst);
+	st.nthreads = 0;
+	SIMPLEQ_FOREACH(thd, lst, entries)
+		if (thread == -1 || thd->id == (uint64_t)thread)
+			st.threads[st.nthreads++] = thd;
 
-	if (fp != stdout)
-		fclose(fp);
+	qsort(st.threads, st.nthreads, sizeof *st.threads, cmp_threads);
 
-	return ret;
+	st.next = 0;
+	st.dest = dest;
+	st.format = format;
+	st.mf = mf;
+	st.ret = 0;
+
+	if ((size_t)njobs > st.nthreads)
+		njobs = (st.nthreads > 0) ? st.nthreads : 1;
+
+	for (nworkers = 0; nworkers < njobs; nworkers++) {
+		if ((workers[nworkers].ctx = clone_backup(ctx, backup)) ==
+		    NULL) {
+			st.ret = -1;
+			goto out;
+		}
+
+		workers[nworkers].state = &st;
+
+		if (sbk_share_database(workers[nworkers].ctx, ctx) == -1) {
+			warnx("%s", sbk_error(workers[nworkers].ctx));
+			nworkers++;
+			st.ret = -1;
+			goto out;
+		}
+
+		if (mf != NULL && manifest_set_message_marks(mf,
+		    workers[nworkers].ctx) == -1) {
+			nworkers++;
+			st.ret = -1;
+			goto out;
+		}
+	}
+
+	if (pthread_mutex_init(&st.mtx, NULL) != 0) {
+		warnx("Cannot initialise mutex");
+		st.ret = -1;
+		goto out;
+	}
+
+	for (nthreads = 0; nthreads < nworkers; nthreads++)
+		if (pthread_create(&workers[nthreads].thread, NULL,
+		    message_worker, &workers[nthreads]) != 0) {
+			warnx("Cannot create thread");
+			break;
+		}
+
+	/* If no thread could be created, do the work ourselves */
+	if (nthreads == 0)
+		message_worker(&workers[0]);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&st.mtx);
+
+out:
+	/* The workers share the database of ctx, so close them first */
+	for (i = 0; i < nworkers; i++) {
+		sbk_close(workers[i].ctx);
+		sbk_ctx_free(workers[i].ctx);
+	}
+
+	free(st.threads);
+	sbk_free_thread_list(lst);
+	return st.ret;
 }
 
 int
 cmd_messages(int argc, char **argv)
 {
 	struct sbk_ctx	*ctx;
-	char		*dest, *passfile, passphr[128];
-	const char	*errstr;
-	int		 c, format, ret, thread;
+	struct manifest	*mf;
+	char		*cache, *dest, *index, *keyfile, *manifest, *offsets;
+	char		*passfile;
+	const char	*errstr, *promises;
+	int		 c, dbfile, format, njobs, ret, thread;
 
+	cache = NULL;
 	format = FORMAT_TEXT;
+	index = NULL;
+	keyfile = NULL;
+	manifest = NULL;
+	njobs = 0;
+	offsets = NULL;
 	passfile = NULL;
 	thread = -1;
 
-	while ((c = getopt(argc, argv, "f:p:t:")) != -1)
+	while ((c = getopt(argc, argv, "c:f:i:j:k:m:o:p:t:")) != -1)
 		switch (c) {
+		case 'c':
+			cache = optarg;
+			break;
 		case 'f':
 			if (strcmp(optarg, "csv") == 0)
 				format = FORMAT_CSV;
+			else if (strcmp(optarg, "jsonl") == 0)
+				format = FORMAT_JSONL;
 			else if (strcmp(optarg, "maildir") == 0)
 				format = FORMAT_MAILDIR;
+			else if (strcmp(optarg, "mbox") == 0)
+				format = FORMAT_MBOX;
 			else if (strcmp(optarg, "text") == 0)
 				format = FORMAT_TEXT;
 			else
 				errx(1, "%s: invalid format", optarg);
 			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'j':
+			njobs = strtonum(optarg, 1, MESSAGES_MAX_JOBS, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: number of jobs is %s", optarg,
+				    errstr);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'o':
+			offsets = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -443,16 +1244,29 @@ cmd_messages(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (offsets != NULL && (format != FORMAT_MBOX || njobs > 0))
+		goto usage;
+
+	/* Load the time zone before unveil() hides it */
+	tzset();
+
 	switch (argc) {
 	case 1:
-		if (format == FORMAT_MAILDIR)
+		if (format == FORMAT_MAILDIR || njobs > 0)
 			goto usage;
 		dest = NULL;
 		break;
 	case 2:
 		dest = argv[1];
-		if (format == FORMAT_MAILDIR)
+		/* An incremental export adds to an existing maildir */
+		if (format == FORMAT_MAILDIR && (manifest == NULL ||
+		    access(dest, F_OK) == -1))
 			maildir_create(dest);
+		/* With jobs, every thread is written to its own file in dest */
+		else if (format != FORMAT_MAILDIR && njobs > 0 &&
+		    (manifest == NULL || access(dest, F_OK) == -1) &&
+		    mkdir(dest, 0777) == -1)
+			err(1, "mkdir: %s", dest);
 		if (unveil(dest, "wc") == -1)
 			err(1, "unveil");
 		break;
@@ -463,6 +1277,24 @@ cmd_messages(int argc, char **argv)
 	if (unveil(argv[0], "r") == -1)
 		err(1, "unveil");
 
+	/* The cache is replaced by a temporary file in the same directory */
+	if (cache != NULL && unveil_dirname(cache, "rwc") == -1)
+		return 1;
+
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	if (offsets != NULL && unveil(offsets, "wc") == -1)
+		err(1, "unveil");
+
+	/* The manifest is replaced through a temporary file */
+	if (manifest != NULL && unveil_dirname(manifest, "rwc") == -1)
+		return 1;
+
 	/* For SQLite */
 	if (unveil("/dev/urandom", "r") == -1)
 		err(1, "unveil");
@@ -471,51 +1303,101 @@ cmd_messages(int argc, char **argv)
 	if (unveil("/tmp", "rwc") == -1)
 		err(1, "unveil");
 
+	/* SQLite locks the cache and the temporary database used with -M */
+	dbfile = (cache != NULL || sbk_get_memory_budget() != 0);
+	promises = dbfile ? "stdio rpath wpath cpath flock" :
+	    "stdio rpath wpath cpath";
+
 	if (passfile == NULL) {
-		if (pledge("stdio rpath wpath cpath tty", NULL) == -1)
+		if (pledge(dbfile ? "stdio rpath wpath cpath flock tty" :
+		    "stdio rpath wpath cpath tty", NULL) == -1)
 			err(1, "pledge");
 	} else {
 		if (unveil(passfile, "r") == -1)
 			err(1, "unveil");
 
-		if (pledge("stdio rpath wpath cpath", NULL) == -1)
+		if (pledge(promises, NULL) == -1)
 			err(1, "pledge");
 	}
 
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1)
-		return -1;
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
+		sbk_ctx_free(ctx);
+		return 1;
+	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
+	if (cache != NULL && sbk_set_cache(ctx, cache) == -1) {
+		warnx("%s", sbk_error(ctx));
+		sbk_close(ctx);
+		sbk_ctx_free(ctx);
+		return 1;
+	}
 
-	if (passfile == NULL && pledge("stdio rpath wpath cpath", NULL) == -1)
+	if (passfile == NULL && pledge(promises, NULL) == -1)
 		err(1, "pledge");
 
-	switch (format) {
+	mf = NULL;
+	if (manifest != NULL) {
+		if ((mf = manifest_open(manifest)) == NULL ||
+		    manifest_set_message_marks(mf, ctx) == -1) {
+			manifest_free(mf);
+			sbk_close(ctx);
+			sbk_ctx_free(ctx);
+			return 1;
+		}
+	}
+
+	if (njobs > 0)
+		ret = write_threads_parallel(ctx, argv[0], dest, format,
+		    thread, njobs, mf);
+	else switch (format) {
 	case FORMAT_CSV:
-		ret = csv_write_messages(ctx, dest, thread);
+		ret = stream_write_messages(ctx, dest, thread, mf,
+		    csv_write_message);
+		break;
+	case FORMAT_JSONL:
+		ret = stream_write_messages(ctx, dest, thread, mf,
+		    jsonl_write_message);
 		break;
 	case FORMAT_MAILDIR:
-		ret = maildir_write_messages(ctx, dest, thread);
+		ret = maildir_write_messages(ctx, dest, thread, mf);
+		break;
+	case FORMAT_MBOX:
+		ret = mbox_write_messages(ctx, dest, offsets, thread, mf);
 		break;
 	case FORMAT_TEXT:
-		ret = text_write_messages(ctx, dest, thread);
+		ret = stream_write_messages(ctx, dest, thread, mf,
+		    text_write_message);
 		break;
 	}
 
+	/*
+	 * After an error, it is not known which messages have been written.
+	 * Keep the manifest as it was, so that they are exported again.
+	 */
+	if (mf != NULL) {
+		if (ret != 0)
+			warnx("%s: Not updated", manifest);
+		else if (manifest_write(mf) == -1)
+			ret = -1;
+		manifest_free(mf);
+	}
+
 	sbk_close(ctx);
 	sbk_ctx_free(ctx);
 	return (ret == 0) ? 0 : 1;
 
 usage:
-	usage("messages", "[-f format] [-p passfile] [-t thread] backup dest");
+	usage("messages", "[-c cache] [-f format] [-i index] [-j jobs] "
+	    "[-k keyfile] [-m manifest] [-o offsets] [-p passfile] "
+	    "[-t thread] backup dest");
 }
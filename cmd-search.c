@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sigbak.h"
+
+/*
+ * Parse a local date of the form "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS" and
+ * return it in ms since the epoch
+ */
+static int64_t
+parse_date(const char *str)
+{
+	struct tm	 tm;
+	time_t		 tt;
+	const char	*end;
+
+	memset(&tm, 0, sizeof tm);
+
+	if ((end = strptime(str, "%Y-%m-%d", &tm)) == NULL)
+		errx(1, "%s: invalid date", str);
+
+	if (*end != '\0' && ((end = strptime(end, " %H:%M:%S", &tm)) == NULL ||
+	    *end != '\0'))
+		errx(1, "%s: invalid date", str);
+
+	tm.tm_isdst = -1;
+
+	if ((tt = mktime(&tm)) == -1)
+		errx(1, "%s: invalid date", str);
+
+	return (int64_t)tt * 1000;
+}
+
+int
+cmd_search(int argc, char **argv)
+{
+	struct sbk_ctx		*ctx;
+	struct sbk_message_iter	*it;
+	struct sbk_message	*msg;
+	struct sink		*snk;
+	char			*cache, *index, *keyfile, *passfile;
+	const char		*errstr, *promises;
+	int64_t			 from, to;
+	int			 c, dbfile, n, ret, thread;
+
+	cache = NULL;
+	index = NULL;
+	keyfile = NULL;
+	passfile = NULL;
+	thread = -1;
+	from = 0;
+	to = INT64_MAX;
+
+	/* Load the time zone before unveil() hides it */
+	tzset();
+
+	while ((c = getopt(argc, argv, "a:b:c:i:k:p:t:")) != -1)
+		switch (c) {
+		case 'a':
+			from = parse_date(optarg);
+			break;
+		case 'b':
+			to = parse_date(optarg) - 1;
+			break;
+		case 'c':
+			cache = optarg;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'p':
+			passfile = optarg;
+			break;
+		case 't':
+			thread = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "%s: thread id is %s", optarg, errstr);
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		goto usage;
+
+	if (unveil(argv[0], "r") == -1)
+		err(1, "unveil");
+
+	/* For SQLite */
+	if (unveil("/dev/urandom", "r") == -1)
+		err(1, "unveil");
+
+	/* For SQLite */
+	if (unveil("/tmp", "rwc") == -1)
+		err(1, "unveil");
+
+	/* The cache is replaced by a temporary file in the same directory */
+	if (cache != NULL && unveil_dirname(cache, "rwc") == -1)
+		return 1;
+
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	/*
+	 * The cache, index and key file may have to be created. SQLite locks
+	 * the cache and the temporary database used with -M.
+	 */
+	dbfile = (cache != NULL || sbk_get_memory_budget() != 0);
+
+	if (dbfile)
+		promises = (passfile == NULL) ?
+		    "stdio rpath wpath cpath flock tty" :
+		    "stdio rpath wpath cpath flock";
+	else if (index != NULL || keyfile != NULL)
+		promises = (passfile == NULL) ? "stdio rpath wpath cpath tty" :
+		    "stdio rpath wpath cpath";
+	else
+		promises = (passfile == NULL) ? "stdio rpath tty" :
+		    "stdio rpath";
+
+	if (passfile != NULL && unveil(passfile, "r") == -1)
+		err(1, "unveil");
+
+	if (pledge(promises, NULL) == -1)
+		err(1, "pledge");
+
+	if ((snk = sink_new(STDOUT_FILENO)) == NULL)
+		err(1, NULL);
+
+	if ((ctx = sbk_ctx_new()) == NULL)
+		errx(1, "Cannot create backup context");
+
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
+		sbk_ctx_free(ctx);
+		sink_free(snk);
+		return 1;
+	}
+
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		goto error;
+	}
+
+	if (cache != NULL && sbk_set_cache(ctx, cache) == -1) {
+		warnx("%s", sbk_error(ctx));
+		goto error;
+	}
+
+	if (pledge(dbfile ? "stdio rpath wpath cpath flock" : "stdio rpath",
+	    NULL) == -1)
+		err(1, "pledge");
+
+	if ((it = sbk_search_messages(ctx, argv[1], thread, from, to)) ==
+	    NULL) {
+		warnx("Cannot search messages: %s", sbk_error(ctx));
+		goto error;
+	}
+
+	ret = 0;
+
+	while ((n = sbk_next_message(it, &msg)) == 1) {
+		if (text_write_message(snk, msg) == -1)
+			ret = -1;
+		sbk_free_message(msg);
+	}
+
+	/* An invalid query is only detected here */
+	if (n == -1) {
+		warnx("Cannot search messages: %s", sbk_error(ctx));
+		ret = -1;
+	}
+
+	sbk_close_messages(it);
+
+	if (sink_flush(snk) == -1) {
+		warn("write: stdout");
+		ret = -1;
+	}
+
+	sink_free(snk);
+	sbk_close(ctx);
+	sbk_ctx_free(ctx);
+	return (ret == 0) ? 0 : 1;
+
+error:
+	sink_free(snk);
+	sbk_close(ctx);
+	sbk_ctx_free(ctx);
+	return 1;
+
+usage:
+	usage("search", "[-a date] [-b date] [-c cache] [-i index] "
+	    "[-k keyfile] [-p passfile] [-t thread] backup query");
+}
@@ -25,13 +25,21 @@ int
 cmd_sqlite(int argc, char **argv)
 {
 	struct sbk_ctx	*ctx;
-	char		*passfile, passphr[128];
+	char		*index, *keyfile, *passfile;
 	int		 c, fd, ret;
 
+	index = NULL;
+	keyfile = NULL;
 	passfile = NULL;
 
-	while ((c = getopt(argc, argv, "p:")) != -1)
+	while ((c = getopt(argc, argv, "i:k:p:")) != -1)
 		switch (c) {
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -51,6 +59,13 @@ cmd_sqlite(int argc, char **argv)
 	if (unveil(argv[1], "rwc") == -1)
 		err(1, "unveil");
 
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
 	/* SQLite creates temporary files in the same dir as the database */
 	if (unveil_dirname(argv[1], "rwc") == -1)
 		return 1;
@@ -83,20 +98,18 @@ cmd_sqlite(int argc, char **argv)
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
-
 	if (passfile == NULL &&
 	    pledge("stdio rpath wpath cpath flock", NULL) == -1)
 		err(1, "pledge");
@@ -109,5 +122,6 @@ cmd_sqlite(int argc, char **argv)
 	return (ret == 0) ? 0 : 1;
 
 usage:
-	usage("sqlite", "[-p passfile] backup database");
+	usage("sqlite", "[-i index] [-k keyfile] [-p passfile] backup "
+	    "database");
 }
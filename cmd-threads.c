@@ -22,19 +22,41 @@
 
 #include "sigbak.h"
 
+/* The tables needed to list the threads */
+static const char *tables[] = {
+	"groups",
+	"recipient",
+	"recipient_preferences",
+	"thread",
+	NULL
+};
+
 int
 cmd_threads(int argc, char **argv)
 {
 	struct sbk_ctx		*ctx;
 	struct sbk_thread_list	*lst;
 	struct sbk_thread	*thd;
-	char			*passfile, passphr[128];
-	int			 c, ret;
+	char			*cache, *index, *keyfile, *passfile;
+	const char		*promises;
+	int			 c, dbfile, ret;
 
+	cache = NULL;
+	index = NULL;
+	keyfile = NULL;
 	passfile = NULL;
 
-	while ((c = getopt(argc, argv, "p:")) != -1)
+	while ((c = getopt(argc, argv, "c:i:k:p:")) != -1)
 		switch (c) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
 		case 'p':
 			passfile = optarg;
 			break;
@@ -59,35 +81,71 @@ cmd_threads(int argc, char **argv)
 	if (unveil("/tmp", "rwc") == -1)
 		err(1, "unveil");
 
-	if (passfile == NULL) {
-		if (pledge("stdio rpath tty", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (unveil(passfile, "r") == -1)
-			err(1, "unveil");
+	/* The cache is replaced by a temporary file in the same directory */
+	if (cache != NULL && unveil_dirname(cache, "rwc") == -1)
+		return 1;
 
-		if (pledge("stdio rpath", NULL) == -1)
-			err(1, "pledge");
-	}
+	/* The index is replaced by a temporary file in the same directory */
+	if (index != NULL && unveil_dirname(index, "rwc") == -1)
+		return 1;
+
+	if (keyfile != NULL && unveil(keyfile, "rwc") == -1)
+		err(1, "unveil");
+
+	/*
+	 * The cache, index and key file may have to be created. SQLite locks
+	 * the cache and the temporary database used with -M.
+	 */
+	dbfile = (cache != NULL || sbk_get_memory_budget() != 0);
+
+	if (dbfile)
+		promises = (passfile == NULL) ?
+		    "stdio rpath wpath cpath flock tty" :
+		    "stdio rpath wpath cpath flock";
+	else if (index != NULL || keyfile != NULL)
+		promises = (passfile == NULL) ? "stdio rpath wpath cpath tty" :
+		    "stdio rpath wpath cpath";
+	else
+		promises = (passfile == NULL) ? "stdio rpath tty" :
+		    "stdio rpath";
+
+	if (passfile != NULL && unveil(passfile, "r") == -1)
+		err(1, "unveil");
+
+	if (pledge(promises, NULL) == -1)
+		err(1, "pledge");
 
 	if ((ctx = sbk_ctx_new()) == NULL)
 		errx(1, "Cannot create backup context");
 
-	if (get_passphrase(passfile, passphr, sizeof passphr) == -1) {
+	if (open_backup(ctx, argv[0], passfile, keyfile) == -1) {
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	if (sbk_open(ctx, argv[0], passphr) == -1) {
-		warnx("%s: %s", argv[0], sbk_error(ctx));
-		explicit_bzero(passphr, sizeof passphr);
+	if (index != NULL && sbk_open_index(ctx, index) == -1) {
+		warnx("%s: %s", index, sbk_error(ctx));
+		sbk_close(ctx);
 		sbk_ctx_free(ctx);
 		return 1;
 	}
 
-	explicit_bzero(passphr, sizeof passphr);
+	if (cache != NULL && sbk_set_cache(ctx, cache) == -1) {
+		warnx("%s", sbk_error(ctx));
+		sbk_close(ctx);
+		sbk_ctx_free(ctx);
+		return 1;
+	}
+
+	if (sbk_set_tables(ctx, tables) == -1) {
+		warnx("%s", sbk_error(ctx));
+		sbk_close(ctx);
+		sbk_ctx_free(ctx);
+		return 1;
+	}
 
-	if (passfile == NULL && pledge("stdio rpath", NULL) == -1)
+	if (pledge(dbfile ? "stdio rpath wpath cpath flock" : "stdio rpath",
+	    NULL) == -1)
 		err(1, "pledge");
 
 	ret = -1;
@@ -110,5 +168,6 @@ out:
 	return (ret == 0) ? 0 : 1;
 
 usage:
-	usage("threads", "[-p passfile] backup");
+	usage("threads", "[-c cache] [-i index] [-k keyfile] [-p passfile] "
+	    "backup");
 }
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/tree.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sigbak.h"
+
+/*
+ * A manifest records what an earlier run has exported, so that a later run
+ * can export only what is new. It is a text file with a header line followed
+ * by one line per entry:
+ *
+ *	t thread date_received	Messages in thread up to date_received
+ *	a rowid attachmentid	Attachment
+ *
+ * The manifest itself is only replaced at the end of a run. So that an
+ * interrupted run need not start over, every attachment is also appended to a
+ * journal as soon as it has been written. The journal has the same entries,
+ * without a header. It is merged when the manifest is opened and removed once
+ * the manifest has been replaced.
+ */
+#define MANIFEST_HEADER	"sigbak manifest 1"
+#define MANIFEST_JOURNAL_SUFFIX	".journal"
+
+struct manifest_mark {
+	int		thread;
+	int64_t		date;
+	RB_ENTRY(manifest_mark) entries;
+};
+
+struct manifest_attachment {
+	int64_t		rowid;
+	int64_t		attachmentid;
+	RB_ENTRY(manifest_attachment) entries;
+};
+
+RB_HEAD(manifest_mark_tree, manifest_mark);
+RB_HEAD(manifest_attachment_tree, manifest_attachment);
+
+struct manifest {
+	char		*path;
+	char		*journal;	/* Path of the journal */
+	int		 journalfd;	/* Journal, if opened for appending */
+	pthread_mutex_t	 mtx;		/* For marks set by several threads */
+	struct manifest_mark_tree marks;
+	struct manifest_attachment_tree attachments;
+};
+
+static int
+manifest_cmp_marks(struct manifest_mark *a, struct manifest_mark *b)
+{
+	return (a->thread < b->thread) ? -1 : (a->thread > b->thread);
+}
+
+static int
+manifest_cmp_attachments(struct manifest_attachment *a,
+    struct manifest_attachment *b)
+{
+	if (a->rowid != b->rowid)
+		return (a->rowid < b->rowid) ? -1 : 1;
+
+	return (a->attachmentid < b->attachmentid) ? -1 :
+	    (a->attachmentid > b->attachmentid);
+}
+
+RB_GENERATE_STATIC(manifest_mark_tree, manifest_mark, entries,
+    manifest_cmp_marks)
+RB_GENERATE_STATIC(manifest_attachment_tree, manifest_attachment, entries,
+    manifest_cmp_attachments)
+
+/* Raise the mark of the thread to date */
+int
+manifest_set_mark(struct manifest *mf, int thread, int64_t date)
+{
+	struct manifest_mark	find, *mark;
+	int			ret;
+
+	ret = 0;
+	find.thread = thread;
+	pthread_mutex_lock(&mf->mtx);
+
+	if ((mark = RB_FIND(manifest_mark_tree, &mf->marks, &find)) != NULL) {
+		if (mark->date < date)
+			mark->date = date;
+	} else if ((mark = malloc(sizeof *mark)) == NULL) {
+		warn(NULL);
+		ret = -1;
+	} else {
+		mark->thread = thread;
+		mark->date = date;
+		RB_INSERT(manifest_mark_tree, &mf->marks, mark);
+	}
+
+	pthread_mutex_unlock(&mf->mtx);
+	return ret;
+}
+
+/* Tell the library to skip the messages up to the mark of their thread */
+int
+manifest_set_message_marks(struct manifest *mf, struct sbk_ctx *ctx)
+{
+	struct manifest_mark *mark;
+
+	RB_FOREACH(mark, manifest_mark_tree, &mf->marks)
+		if (sbk_set_message_mark(ctx, mark->thread, mark->date) ==
+		    -1) {
+			warnx("%s", sbk_error(ctx));
+			return -1;
+		}
+
+	return 0;
+}
+
+int
+manifest_has_attachment(struct manifest *mf, int64_t rowid,
+    int64_t attachmentid)
+{
+	struct manifest_attachment find;
+
+	find.rowid = rowid;
+	find.attachmentid = attachmentid;
+	return RB_FIND(manifest_attachment_tree, &mf->attachments, &find) !=
+	    NULL;
+}
+
+static int
+manifest_insert_attachment(struct manifest *mf, int64_t rowid,
+    int64_t attachmentid)
+{
+	struct manifest_attachment *att;
+
+	if (manifest_has_attachment(mf, rowid, attachmentid))
+		return 0;
+
+	if ((att = malloc(sizeof *att)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+
+	att->rowid = rowid;
+	att->attachmentid = attachmentid;
+	RB_INSERT(manifest_attachment_tree, &mf->attachments, att);
+	return 0;
+}
+
+/* Append an entry to the journal, opening the journal if needed */
+static int
+manifest_append_journal(struct manifest *mf, int64_t rowid,
+    int64_t attachmentid)
+{
+	char	buf[64];
+	int	len;
+
+	if (mf->journalfd == -1 && (mf->journalfd = open(mf->journal,
+	    O_WRONLY | O_CREAT | O_APPEND, 0666)) == -1) {
+		warn("%s", mf->journal);
+		return -1;
+	}
+
+	len = snprintf(buf, sizeof buf, "a %" PRId64 " %" PRId64 "\n", rowid,
+	    attachmentid);
+
+	/* A single short write is not interleaved with other entries */
+	if (write(mf->journalfd, buf, len) != len) {
+		warn("%s", mf->journal);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Record an exported attachment, in the journal as well */
+int
+manifest_add_attachment(struct manifest *mf, int64_t rowid,
+    int64_t attachmentid)
+{
+	if (manifest_has_attachment(mf, rowid, attachmentid))
+		return 0;
+
+	if (manifest_insert_attachment(mf, rowid, attachmentid) == -1)
+		return -1;
+
+	return manifest_append_journal(mf, rowid, attachmentid);
+}
+
+/*
+ * Read the entries of the manifest or, if journal is set, of the journal. The
+ * last line of the journal may be incomplete if a run was interrupted; it is
+ * ignored.
+ */
+static int
+manifest_read(struct manifest *mf, FILE *fp, const char *path, int journal)
+{
+	char		*line;
+	size_t		 size;
+	ssize_t		 len;
+	int64_t		 a, b;
+	int		 lineno, ret, thread;
+
+	line = NULL;
+	size = 0;
+	lineno = 0;
+	ret = -1;
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		lineno++;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		else if (journal)
+			break;
+
+		if (lineno == 1 && !journal) {
+			if (strcmp(line, MANIFEST_HEADER) != 0) {
+				warnx("%s: Invalid manifest", path);
+				goto out;
+			}
+			continue;
+		}
+
+		if (!journal && sscanf(line, "t %d %" SCNd64, &thread, &a) ==
+		    2) {
+			if (manifest_set_mark(mf, thread, a) == -1)
+				goto out;
+		} else if (sscanf(line, "a %" SCNd64 " %" SCNd64, &a, &b) ==
+		    2) {
+			if (manifest_insert_attachment(mf, a, b) == -1)
+				goto out;
+		} else {
+			warnx("%s:%d: Invalid manifest entry", path, lineno);
+			goto out;
+		}
+	}
+
+	if (ferror(fp)) {
+		warn("%s", path);
+		goto out;
+	}
+
+	if (lineno == 0 && !journal) {
+		warnx("%s: Invalid manifest", path);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(line);
+	return ret;
+}
+
+/*
+ * Open a manifest. If the file does not exist, the manifest is empty and
+ * everything is exported.
+ */
+struct manifest *
+manifest_open(const char *path)
+{
+	struct manifest	*mf;
+	FILE		*fp;
+	char		 cwd[PATH_MAX];
+
+	if ((mf = malloc(sizeof *mf)) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+
+	RB_INIT(&mf->marks);
+	RB_INIT(&mf->attachments);
+	mf->journal = NULL;
+	mf->journalfd = -1;
+
+	if (pthread_mutex_init(&mf->mtx, NULL) != 0) {
+		warnx("Cannot initialise mutex");
+		free(mf);
+		return NULL;
+	}
+
+	/* Commands may change the working directory before writing */
+	if (path[0] == '/') {
+		if ((mf->path = strdup(path)) == NULL) {
+			warn(NULL);
+			pthread_mutex_destroy(&mf->mtx);
+			free(mf);
+			return NULL;
+		}
+	} else {
+		if (getcwd(cwd, sizeof cwd) == NULL) {
+			warn("getcwd");
+			pthread_mutex_destroy(&mf->mtx);
+			free(mf);
+			return NULL;
+		}
+		if (asprintf(&mf->path, "%s/%s", cwd, path) == -1) {
+			warnx("asprintf() failed");
+			pthread_mutex_destroy(&mf->mtx);
+			free(mf);
+			return NULL;
+		}
+	}
+
+	if (asprintf(&mf->journal, "%s" MANIFEST_JOURNAL_SUFFIX, mf->path) ==
+	    -1) {
+		warnx("asprintf() failed");
+		mf->journal = NULL;
+		manifest_free(mf);
+		return NULL;
+	}
+
+	if ((fp = fopen(mf->path, "r")) == NULL) {
+		if (errno != ENOENT) {
+			warn("%s", mf->path);
+			manifest_free(mf);
+			return NULL;
+		}
+	} else {
+		if (manifest_read(mf, fp, mf->path, 0) == -1) {
+			fclose(fp);
+			manifest_free(mf);
+			return NULL;
+		}
+		fclose(fp);
+	}
+
+	/* Add the attachments of an interrupted run */
+	if ((fp = fopen(mf->journal, "r")) == NULL) {
+		if (errno != ENOENT) {
+			warn("%s", mf->journal);
+			manifest_free(mf);
+			return NULL;
+		}
+	} else {
+		if (manifest_read(mf, fp, mf->journal, 1) == -1) {
+			fclose(fp);
+			manifest_free(mf);
+			return NULL;
+		}
+		fclose(fp);
+	}
+
+	return mf;
+}
+
+/* Replace the manifest atomically, so that an interrupted run is harmless */
+int
+manifest_write(struct manifest *mf)
+{
+	struct manifest_mark		*mark;
+	struct manifest_attachment	*att;
+	FILE				*fp;
+	char				*tmp;
+	int				 fd;
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", mf->path) == -1) {
+		warnx("asprintf() failed");
+		return -1;
+	}
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("%s", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp);
+		close(fd);
+		goto error;
+	}
+
+	fputs(MANIFEST_HEADER "\n", fp);
+
+	RB_FOREACH(mark, manifest_mark_tree, &mf->marks)
+		fprintf(fp, "t %d %" PRId64 "\n", mark->thread, mark->date);
+
+	RB_FOREACH(att, manifest_attachment_tree, &mf->attachments)
+		fprintf(fp, "a %" PRId64 " %" PRId64 "\n", att->rowid,
+		    att->attachmentid);
+
+	if (fflush(fp) == EOF || ferror(fp)) {
+		warn("%s", tmp);
+		fclose(fp);
+		goto error;
+	}
+
+	if (fclose(fp) == EOF) {
+		warn("%s", tmp);
+		goto error;
+	}
+
+	if (rename(tmp, mf->path) == -1) {
+		warn("rename: %s", mf->path);
+		goto error;
+	}
+
+	/* The manifest now has every entry of the journal */
+	if (mf->journalfd != -1) {
+		close(mf->journalfd);
+		mf->journalfd = -1;
+	}
+
+	if (unlink(mf->journal) == -1 && errno != ENOENT)
+		warn("unlink: %s", mf->journal);
+
+	free(tmp);
+	return 0;
+
+error:
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+void
+manifest_free(struct manifest *mf)
+{
+	struct manifest_mark		*mark;
+	struct manifest_attachment	*att;
+
+	if (mf == NULL)
+		return;
+
+	while ((mark = RB_ROOT(&mf->marks)) != NULL) {
+		RB_REMOVE(manifest_mark_tree, &mf->marks, mark);
+		free(mark);
+	}
+
+	while ((att = RB_ROOT(&mf->attachments)) != NULL) {
+		RB_REMOVE(manifest_attachment_tree, &mf->attachments, att);
+		free(att);
+	}
+
+	if (mf->journalfd != -1)
+		close(mf->journalfd);
+
+	pthread_mutex_destroy(&mf->mtx);
+	free(mf->journal);
+	free(mf->path);
+	free(mf);
+}
@@ -14,16 +14,22 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/tree.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <openssl/evp.h>
 #include <openssl/hkdf.h>
@@ -42,6 +48,33 @@
 #define SBK_ROUNDS		250000
 #define SBK_HKDF_INFO		"Backup Export"
 
+#define SBK_INDEX_MAGIC		"SBKIDX01"
+#define SBK_INDEX_MAGIC_LEN	8
+#define SBK_INDEX_HEADER_LEN						\
+	(SBK_INDEX_MAGIC_LEN + SHA256_DIGEST_LENGTH + 16)
+#define SBK_INDEX_ENTRY_LEN	44
+#define SBK_INDEX_MAC_LEN	SHA256_DIGEST_LENGTH
+
+/* Index entry flags */
+#define SBK_INDEX_HAS_ROWID		0x1
+#define SBK_INDEX_HAS_ATTACHMENTID	0x2
+
+/* Number of decoded frames buffered between the reader and SQLite */
+#define SBK_PIPELINE_SIZE	256
+
+/* Size of the chunks in which attachments, avatars and stickers are read */
+#define SBK_FILE_CHUNK_SIZE	(1024 * 1024)
+
+#define SBK_ARENA_ALIGN		16
+#define SBK_ARENA_ROUND(n)	(((n) + SBK_ARENA_ALIGN - 1) &		\
+				    ~(size_t)(SBK_ARENA_ALIGN - 1))
+#define SBK_ARENA_HEADER_SIZE	SBK_ARENA_ROUND(sizeof (struct sbk_arena_chunk))
+#define SBK_ARENA_CHUNK_SIZE	1024
+
+/* Version of the cache layout; a cache with another version is rebuilt */
+#define SBK_CACHE_VERSION	4
+#define SBK_CACHE_MAC_LEN	SHA256_DIGEST_LENGTH
+
 #define SBK_MENTION_PLACEHOLDER	"\357\277\274"	/* U+FFFC */
 #define SBK_MENTION_PREFIX	"@"
 
@@ -66,6 +99,25 @@ struct sbk_attachment_entry {
 
 RB_HEAD(sbk_attachment_tree, sbk_attachment_entry);
 
+struct sbk_statement_entry {
+	char		*sql;
+	sqlite3_stmt	*stm;
+	RB_ENTRY(sbk_statement_entry) entries;
+};
+
+RB_HEAD(sbk_statement_tree, sbk_statement_entry);
+
+struct sbk_arena_chunk {
+	struct sbk_arena_chunk *next;
+	size_t		 size;		/* Size of the data */
+	size_t		 used;
+};
+
+/* Memory that is released all at once */
+struct sbk_arena {
+	struct sbk_arena_chunk *chunks;	/* Current chunk first */
+};
+
 struct sbk_recipient_id {
 	char		*old;	/* For older databases */
 	int		 new;	/* For newer databases */
@@ -73,24 +125,74 @@ struct sbk_recipient_id {
 
 struct sbk_recipient_entry {
 	struct sbk_recipient_id id;
+	uint32_t	 hash;
 	struct sbk_recipient recipient;
-	RB_ENTRY(sbk_recipient_entry) entries;
 };
 
-RB_HEAD(sbk_recipient_tree, sbk_recipient_entry);
+/*
+ * The recipients are stored contiguously and looked up through an
+ * open-addressing hash table of entry indexes
+ */
+struct sbk_recipient_table {
+	struct sbk_recipient_entry *entries;
+	size_t		 nentries;
+	uint32_t	*slots;		/* Index + 1, or 0 if empty */
+	size_t		 nslots;	/* Power of 2 */
+};
+
+struct sbk_index_entry {
+	off_t		 pos;		/* Offset of the frame */
+	uint32_t	 len;		/* Length of the frame */
+	uint32_t	 counter;
+	unsigned int	 type;
+	unsigned int	 flags;
+	uint32_t	 datalen;	/* Length of the file data, if any */
+	uint64_t	 rowid;
+	uint64_t	 attachmentid;
+};
+
+struct sbk_index {
+	enum {
+		SBK_INDEX_NONE,
+		SBK_INDEX_RECORD,
+		SBK_INDEX_LOADED
+	} state;
+	char		*path;
+	struct sbk_index_entry *entries;
+	size_t		 nentries;
+	size_t		 size;
+	size_t		 next;
+};
 
 struct sbk_ctx {
 	FILE		*fp;
+	off_t		 fpsize;
+	unsigned char	*map;		/* Mapping of the backup, if any */
+	size_t		 mappos;
 	sqlite3		*db;
 	unsigned int	 db_version;
+	int		 db_indexed;	/* Query indexes have been created */
+	int		 db_marked;	/* Message marks have been set */
+	int		 db_search;	/* A search index is needed */
+	int		 db_shared;	/* Database of another context */
+	char		*db_path;	/* Temporary database file, if any */
+	unsigned char	*db_image;	/* Serialised database, if shared */
+	sqlite3_int64	 db_imagesize;
 	struct sbk_attachment_tree attachments;
-	struct sbk_recipient_tree recipients;
+	struct sbk_recipient_table recipients;
+	struct sbk_statement_tree statements;
+	struct sbk_arena frame_arena;
+	struct sbk_arena *frames;	/* Arena for the current frame */
 	EVP_CIPHER_CTX	*cipher;
 	HMAC_CTX	*hmac;
 	unsigned char	 cipherkey[SBK_CIPHERKEY_LEN];
 	unsigned char	 mackey[SBK_MACKEY_LEN];
 	unsigned char	 iv[SBK_IV_LEN];
 	uint32_t	 counter;
+	unsigned char	 ident[SHA256_DIGEST_LENGTH];
+	struct sbk_index index;
+	char		*cache;		/* Path of the database cache, if any */
+	char		**tables;	/* Tables to fill, or NULL for all */
 	unsigned char	*ibuf;
 	size_t		 ibufsize;
 	unsigned char	*obuf;
@@ -98,18 +200,31 @@ struct sbk_ctx {
 	int		 firstframe;
 	int		 eof;
 	char		*error;
+	struct sbk_stats stats;
+	int		(*file_fn)(struct sbk_ctx *, Signal__BackupFrame *,
+			    struct sbk_file *, void *);
+	void		*file_arg;
 };
 
+/* Statistics are added to the totals when a context is freed */
+static int		sbk_stats_enabled;
+static struct sbk_stats	sbk_stats_total;
+static pthread_mutex_t	sbk_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* If not zero, databases are built on disk with a page cache of this size */
+static size_t		sbk_memory_budget;
+
 static int	sbk_cmp_attachment_entries(struct sbk_attachment_entry *,
 		    struct sbk_attachment_entry *);
-static int	sbk_cmp_recipient_entries(struct sbk_recipient_entry *,
-		    struct sbk_recipient_entry *);
+static int	sbk_cmp_statement_entries(struct sbk_statement_entry *,
+		    struct sbk_statement_entry *);
+static int	sbk_create_search_index(struct sbk_ctx *);
 
 RB_GENERATE_STATIC(sbk_attachment_tree, sbk_attachment_entry, entries,
     sbk_cmp_attachment_entries)
 
-RB_GENERATE_STATIC(sbk_recipient_tree, sbk_recipient_entry, entries,
-    sbk_cmp_recipient_entries)
+RB_GENERATE_STATIC(sbk_statement_tree, sbk_statement_entry, entries,
+    sbk_cmp_statement_entries)
 
 static void
 sbk_error_clear(struct sbk_ctx *ctx)
@@ -193,18 +308,256 @@ sbk_error_sqlite_set(struct sbk_ctx *ctx, const char *fmt, ...)
 	va_end(ap);
 }
 
+/* Allocate from an arena, or from the heap if there is no arena */
+static void *
+sbk_arena_alloc(struct sbk_ctx *ctx, struct sbk_arena *arena, size_t size)
+{
+	struct sbk_arena_chunk	*chunk;
+	size_t			 chunksize;
+	void			*ptr;
+
+	if (arena == NULL) {
+		if ((ptr = malloc(size)) == NULL)
+			sbk_error_set(ctx, NULL);
+		return ptr;
+	}
+
+	if (size > SIZE_MAX - SBK_ARENA_HEADER_SIZE - SBK_ARENA_ALIGN) {
+		errno = ENOMEM;
+		sbk_error_set(ctx, NULL);
+		return NULL;
+	}
+
+	size = SBK_ARENA_ROUND(size);
+	chunk = arena->chunks;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (chunk == NULL)
+			chunksize = SBK_ARENA_CHUNK_SIZE -
+			    SBK_ARENA_HEADER_SIZE;
+		else if (chunk->size > SIZE_MAX / 2 - SBK_ARENA_HEADER_SIZE)
+			chunksize = size;
+		else
+			chunksize = chunk->size * 2;
+
+		if (chunksize < size)
+			chunksize = size;
+
+		if ((chunk = malloc(SBK_ARENA_HEADER_SIZE + chunksize)) ==
+		    NULL) {
+			sbk_error_set(ctx, NULL);
+			return NULL;
+		}
+
+		chunk->size = chunksize;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = (char *)chunk + SBK_ARENA_HEADER_SIZE + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static void
+sbk_arena_init(struct sbk_arena *arena)
+{
+	arena->chunks = NULL;
+}
+
+static struct sbk_arena *
+sbk_arena_new(struct sbk_ctx *ctx)
+{
+	struct sbk_arena tmp, *arena;
+
+	sbk_arena_init(&tmp);
+
+	/* The arena itself is the first object in its first chunk */
+	if ((arena = sbk_arena_alloc(ctx, &tmp, sizeof *arena)) == NULL)
+		return NULL;
+
+	*arena = tmp;
+	return arena;
+}
+
+/* Release everything but the most recent, and largest, chunk */
+static void
+sbk_arena_reset(struct sbk_arena *arena)
+{
+	struct sbk_arena_chunk *chunk, *next;
+
+	if (arena->chunks == NULL)
+		return;
+
+	for (chunk = arena->chunks->next; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->chunks->next = NULL;
+	arena->chunks->used = 0;
+}
+
+static void
+sbk_arena_free(struct sbk_arena *arena)
+{
+	struct sbk_arena_chunk *chunk, *next;
+
+	if (arena != NULL)
+		for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+			next = chunk->next;
+			free(chunk);
+		}
+}
+
+static char *
+sbk_arena_strdup(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    const char *str)
+{
+	char	*dup;
+	size_t	 len;
+
+	len = strlen(str) + 1;
+	if ((dup = sbk_arena_alloc(ctx, arena, len)) != NULL)
+		memcpy(dup, str, len);
+
+	return dup;
+}
+
+static int
+sbk_arena_column_text(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    char **buf, sqlite3_stmt *stm, int idx)
+{
+	const unsigned char *txt;
+
+	*buf = NULL;
+
+	if (sqlite3_column_type(stm, idx) == SQLITE_NULL)
+		return 0;
+
+	if ((txt = sqlite3_column_text(stm, idx)) == NULL) {
+		sbk_error_sqlite_set(ctx, "Cannot get column text");
+		return -1;
+	}
+
+	if ((*buf = sbk_arena_strdup(ctx, arena, txt)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+/* Unpacked frames are allocated from the frame arena of the context */
+static void *
+sbk_frame_alloc(void *data, size_t size)
+{
+	struct sbk_ctx *ctx = data;
+
+	return sbk_arena_alloc(ctx, ctx->frames, size);
+}
+
+static void
+sbk_frame_free(void *data, void *ptr)
+{
+	/* The memory is reused when the next frame is unpacked */
+}
+
+void
+sbk_enable_stats(void)
+{
+	sbk_stats_enabled = 1;
+}
+
+/* Get the totals of the contexts freed so far */
+void
+sbk_get_stats(struct sbk_stats *st)
+{
+	pthread_mutex_lock(&sbk_stats_mtx);
+	*st = sbk_stats_total;
+	pthread_mutex_unlock(&sbk_stats_mtx);
+}
+
+static void
+sbk_sum_stats(struct sbk_stats *tot, const struct sbk_stats *st)
+{
+	tot->frames += st->frames;
+	tot->statements += st->statements;
+	tot->messages += st->messages;
+	tot->bytes_read += st->bytes_read;
+	tot->bytes_decrypted += st->bytes_decrypted;
+	tot->bytes_written += st->bytes_written;
+	if (tot->ibuf_size < st->ibuf_size)
+		tot->ibuf_size = st->ibuf_size;
+	if (tot->obuf_size < st->obuf_size)
+		tot->obuf_size = st->obuf_size;
+	tot->kdf_time += st->kdf_time;
+	tot->read_time += st->read_time;
+	tot->decrypt_time += st->decrypt_time;
+	tot->unpack_time += st->unpack_time;
+	tot->sql_time += st->sql_time;
+	tot->query_time += st->query_time;
+	tot->write_time += st->write_time;
+}
+
+static void
+sbk_add_stats(const struct sbk_stats *st)
+{
+	pthread_mutex_lock(&sbk_stats_mtx);
+	sbk_sum_stats(&sbk_stats_total, st);
+	pthread_mutex_unlock(&sbk_stats_mtx);
+}
+
+/* Returns the time in nanoseconds, or 0 if statistics are disabled */
+uint64_t
+sbk_stats_clock(void)
+{
+	struct timespec ts;
+
+	if (!sbk_stats_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sbk_stats_add_time(uint64_t *time, uint64_t start)
+{
+	if (sbk_stats_enabled)
+		*time += sbk_stats_clock() - start;
+}
+
+/* Count output that is written without a backup context, such as by a sink */
+void
+sbk_stats_add_write(uint64_t len, uint64_t start)
+{
+	uint64_t time;
+
+	if (!sbk_stats_enabled)
+		return;
+
+	time = sbk_stats_clock() - start;
+	pthread_mutex_lock(&sbk_stats_mtx);
+	sbk_stats_total.bytes_written += len;
+	sbk_stats_total.write_time += time;
+	pthread_mutex_unlock(&sbk_stats_mtx);
+}
+
 static int
 sbk_enlarge_buffers(struct sbk_ctx *ctx, size_t size)
 {
 	unsigned char *buf;
 
-	if (ctx->ibufsize < size) {
+	/* Mapped input is not copied into ibuf */
+	if (ctx->map == NULL && ctx->ibufsize < size) {
 		if ((buf = realloc(ctx->ibuf, size)) == NULL) {
 			sbk_error_set(ctx, NULL);
 			return -1;
 		}
 		ctx->ibuf = buf;
 		ctx->ibufsize = size;
+		if (ctx->stats.ibuf_size < size)
+			ctx->stats.ibuf_size = size;
 	}
 
 	if (size > SIZE_MAX - EVP_MAX_BLOCK_LENGTH) {
@@ -221,6 +574,8 @@ sbk_enlarge_buffers(struct sbk_ctx *ctx, size_t size)
 		}
 		ctx->obuf = buf;
 		ctx->obufsize = size;
+		if (ctx->stats.obuf_size < size)
+			ctx->stats.obuf_size = size;
 	}
 
 	return 0;
@@ -248,22 +603,28 @@ sbk_decrypt_init(struct sbk_ctx *ctx, uint32_t counter)
 	return 0;
 }
 
+/* The output buffer may be the same as the input buffer */
 static int
-sbk_decrypt_update(struct sbk_ctx *ctx, size_t ibuflen, size_t *obuflen)
+sbk_decrypt_update(struct sbk_ctx *ctx, const unsigned char *ibuf,
+    size_t ibuflen, unsigned char *obuf, size_t *obuflen)
 {
-	int len;
+	uint64_t	start;
+	int		len;
 
-	if (HMAC_Update(ctx->hmac, ctx->ibuf, ibuflen) == 0) {
+	start = sbk_stats_clock();
+
+	if (HMAC_Update(ctx->hmac, ibuf, ibuflen) == 0) {
 		sbk_error_setx(ctx, "Cannot compute HMAC");
 		return -1;
 	}
 
-	if (EVP_DecryptUpdate(ctx->cipher, ctx->obuf, &len, ctx->ibuf,
-	    ibuflen) == 0) {
+	if (EVP_DecryptUpdate(ctx->cipher, obuf, &len, ibuf, ibuflen) == 0) {
 		sbk_error_setx(ctx, "Cannot decrypt data");
 		return -1;
 	}
 
+	ctx->stats.bytes_decrypted += ibuflen;
+	sbk_stats_add_time(&ctx->stats.decrypt_time, start);
 	*obuflen = len;
 	return 0;
 }
@@ -297,31 +658,126 @@ sbk_decrypt_final(struct sbk_ctx *ctx, size_t *obuflen,
 	return 0;
 }
 
-static int
-sbk_read(struct sbk_ctx *ctx, void *ptr, size_t size)
+/*
+ * Read size bytes and return a pointer to them. If the backup is mapped, the
+ * pointer points into the mapping. Otherwise, the data is read into buf.
+ */
+static const unsigned char *
+sbk_read(struct sbk_ctx *ctx, unsigned char *buf, size_t size)
 {
-	if (fread(ptr, size, 1, ctx->fp) != 1) {
+	const unsigned char	*ptr;
+	uint64_t		 start;
+
+	ctx->stats.bytes_read += size;
+
+	if (ctx->map != NULL) {
+		if (ctx->mappos > (size_t)ctx->fpsize ||
+		    size > (size_t)ctx->fpsize - ctx->mappos) {
+			sbk_error_setx(ctx, "Unexpected end of file");
+			return NULL;
+		}
+		ptr = ctx->map + ctx->mappos;
+		ctx->mappos += size;
+		return ptr;
+	}
+
+	start = sbk_stats_clock();
+
+	if (fread(buf, size, 1, ctx->fp) != 1) {
 		if (ferror(ctx->fp))
 			sbk_error_set(ctx, NULL);
 		else
 			sbk_error_setx(ctx, "Unexpected end of file");
+		return NULL;
+	}
+
+	sbk_stats_add_time(&ctx->stats.read_time, start);
+	return buf;
+}
+
+static off_t
+sbk_tell(struct sbk_ctx *ctx)
+{
+	off_t pos;
+
+	if (ctx->map != NULL)
+		return ctx->mappos;
+
+	if ((pos = ftello(ctx->fp)) == -1)
+		sbk_error_set(ctx, NULL);
+
+	return pos;
+}
+
+static int
+sbk_seek(struct sbk_ctx *ctx, off_t pos)
+{
+	if (ctx->map != NULL) {
+		if (pos < 0 || pos > ctx->fpsize) {
+			sbk_error_setx(ctx, "Cannot seek");
+			return -1;
+		}
+		ctx->mappos = pos;
+		return 0;
+	}
+
+	if (fseeko(ctx->fp, pos, SEEK_SET) == -1) {
+		sbk_error_set(ctx, "Cannot seek");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+sbk_skip(struct sbk_ctx *ctx, size_t size)
+{
+	if (ctx->map != NULL) {
+		if (size > (size_t)ctx->fpsize - ctx->mappos) {
+			sbk_error_setx(ctx, "Unexpected end of file");
+			return -1;
+		}
+		ctx->mappos += size;
+		return 0;
+	}
+
+	if (fseeko(ctx->fp, size, SEEK_CUR) == -1) {
+		sbk_error_set(ctx, "Cannot seek");
 		return -1;
 	}
 
 	return 0;
 }
 
+/* Hint that the data at pos will be read soon */
+static void
+sbk_will_read(struct sbk_ctx *ctx, off_t pos, size_t size)
+{
+	size_t off, pagesize;
+
+	if (ctx->map == NULL || pos >= ctx->fpsize)
+		return;
+
+	if (size > (size_t)(ctx->fpsize - pos))
+		size = ctx->fpsize - pos;
+
+	pagesize = getpagesize();
+	off = pos % pagesize;
+	madvise(ctx->map + pos - off, size + off, MADV_WILLNEED);
+}
+
 static int
-sbk_read_frame(struct sbk_ctx *ctx, size_t *frmlen)
+sbk_read_frame(struct sbk_ctx *ctx, const unsigned char **frm,
+    size_t *frmlen)
 {
-	int32_t		len;
-	unsigned char	lenbuf[4];
+	int32_t			 len;
+	const unsigned char	*ptr;
+	unsigned char		 lenbuf[4];
 
-	if (sbk_read(ctx, lenbuf, sizeof lenbuf) == -1)
+	if ((ptr = sbk_read(ctx, lenbuf, sizeof lenbuf)) == NULL)
 		return -1;
 
-	len = (lenbuf[0] << 24) | (lenbuf[1] << 16) | (lenbuf[2] << 8) |
-	    lenbuf[3];
+	len = (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
 
 	if (len <= 0) {
 		sbk_error_setx(ctx, "Invalid frame size");
@@ -331,9 +787,10 @@ sbk_read_frame(struct sbk_ctx *ctx, size_t *frmlen)
 	if (sbk_enlarge_buffers(ctx, len) == -1)
 		return -1;
 
-	if (sbk_read(ctx, ctx->ibuf, len) == -1)
+	if ((*frm = sbk_read(ctx, ctx->ibuf, len)) == NULL)
 		return -1;
 
+	ctx->stats.frames++;
 	*frmlen = len;
 	return 0;
 }
@@ -361,23 +818,32 @@ sbk_skip_file_data(struct sbk_ctx *ctx, Signal__BackupFrame *frm)
 		return -1;
 	}
 
-	if (fseek(ctx->fp, len + SBK_MAC_LEN, SEEK_CUR) == -1) {
-		sbk_error_set(ctx, "Cannot seek");
+	if (sbk_skip(ctx, (size_t)len + SBK_MAC_LEN) == -1)
 		return -1;
-	}
 
 	ctx->counter++;
 	return 0;
 }
 
 static Signal__BackupFrame *
-sbk_unpack_frame(struct sbk_ctx *ctx, unsigned char *buf, size_t len)
+sbk_unpack_frame(struct sbk_ctx *ctx, const unsigned char *buf, size_t len)
 {
-	Signal__BackupFrame *frm;
+	ProtobufCAllocator	 alloc;
+	Signal__BackupFrame	*frm;
+	uint64_t		 start;
+
+	start = sbk_stats_clock();
+
+	/* A frame is valid until the next frame is unpacked */
+	sbk_arena_reset(ctx->frames);
+	alloc.alloc = sbk_frame_alloc;
+	alloc.free = sbk_frame_free;
+	alloc.allocator_data = ctx;
 
-	if ((frm = signal__backup_frame__unpack(NULL, len, buf)) == NULL)
+	if ((frm = signal__backup_frame__unpack(&alloc, len, buf)) == NULL)
 		sbk_error_setx(ctx, "Cannot unpack frame");
 
+	sbk_stats_add_time(&ctx->stats.unpack_time, start);
 	return frm;
 }
 
@@ -391,10 +857,8 @@ sbk_get_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm)
 		return NULL;
 	}
 
-	if ((file->pos = ftell(ctx->fp)) == -1) {
-		sbk_error_set(ctx, NULL);
+	if ((file->pos = sbk_tell(ctx)) == -1)
 		goto error;
-	}
 
 	if (frm->attachment != NULL) {
 		if (!frm->attachment->has_length) {
@@ -424,12 +888,99 @@ error:
 	return NULL;
 }
 
-Signal__BackupFrame *
-sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
+static unsigned int
+sbk_get_frame_type(Signal__BackupFrame *frm)
+{
+	unsigned int type;
+
+	type = 0;
+
+	if (frm->header != NULL)
+		type |= SBK_FRAME_HEADER;
+	if (frm->statement != NULL)
+		type |= SBK_FRAME_STATEMENT;
+	if (frm->preference != NULL)
+		type |= SBK_FRAME_PREFERENCE;
+	if (frm->attachment != NULL)
+		type |= SBK_FRAME_ATTACHMENT;
+	if (frm->version != NULL)
+		type |= SBK_FRAME_VERSION;
+	if (frm->has_end)
+		type |= SBK_FRAME_END;
+	if (frm->avatar != NULL)
+		type |= SBK_FRAME_AVATAR;
+	if (frm->sticker != NULL)
+		type |= SBK_FRAME_STICKER;
+	if (frm->keyvalue != NULL)
+		type |= SBK_FRAME_KEYVALUE;
+
+	return type;
+}
+
+static int
+sbk_add_index_entry(struct sbk_ctx *ctx, Signal__BackupFrame *frm, off_t pos,
+    size_t len, uint32_t counter)
+{
+	struct sbk_index	*idx;
+	struct sbk_index_entry	*ent;
+	size_t			 newsize;
+
+	idx = &ctx->index;
+
+	if (idx->nentries == idx->size) {
+		newsize = (idx->size == 0) ? 1024 : idx->size * 2;
+		ent = reallocarray(idx->entries, newsize, sizeof *ent);
+		if (ent == NULL) {
+			sbk_error_set(ctx, NULL);
+			return -1;
+		}
+		idx->entries = ent;
+		idx->size = newsize;
+	}
+
+	ent = &idx->entries[idx->nentries++];
+	ent->pos = pos;
+	ent->len = len;
+	ent->counter = counter;
+	ent->type = sbk_get_frame_type(frm);
+	ent->flags = 0;
+	ent->datalen = 0;
+	ent->rowid = 0;
+	ent->attachmentid = 0;
+
+	if (frm->attachment != NULL) {
+		ent->datalen = frm->attachment->length;
+		if (frm->attachment->has_rowid) {
+			ent->flags |= SBK_INDEX_HAS_ROWID;
+			ent->rowid = frm->attachment->rowid;
+		}
+		if (frm->attachment->has_attachmentid) {
+			ent->flags |= SBK_INDEX_HAS_ATTACHMENTID;
+			ent->attachmentid = frm->attachment->attachmentid;
+		}
+	} else if (frm->avatar != NULL)
+		ent->datalen = frm->avatar->length;
+	else if (frm->sticker != NULL) {
+		ent->datalen = frm->sticker->length;
+		if (frm->sticker->has_rowid) {
+			ent->flags |= SBK_INDEX_HAS_ROWID;
+			ent->rowid = frm->sticker->rowid;
+		}
+	}
+
+	return 0;
+}
+
+static int sbk_write_index(struct sbk_ctx *);
+
+static Signal__BackupFrame *
+sbk_read_next_frame(struct sbk_ctx *ctx, struct sbk_file **file)
 {
 	Signal__BackupFrame	*frm;
+	const unsigned char	*ibuf, *mac;
 	size_t			 ibuflen, obuflen;
-	unsigned char		*mac;
+	off_t			 pos;
+	uint32_t		 counter;
 
 	if (file != NULL)
 		*file = NULL;
@@ -437,13 +988,28 @@ sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
 	if (ctx->eof)
 		return NULL;
 
-	if (sbk_read_frame(ctx, &ibuflen) == -1)
+	pos = 0;
+	if (ctx->index.state == SBK_INDEX_RECORD &&
+	    (pos = sbk_tell(ctx)) == -1)
+		return NULL;
+
+	if (sbk_read_frame(ctx, &ibuf, &ibuflen) == -1)
 		return NULL;
 
 	/* The first frame is not encrypted */
 	if (ctx->firstframe) {
 		ctx->firstframe = 0;
-		return sbk_unpack_frame(ctx, ctx->ibuf, ibuflen);
+		if ((frm = sbk_unpack_frame(ctx, ibuf, ibuflen)) == NULL)
+			return NULL;
+		if (ctx->index.state == SBK_INDEX_RECORD) {
+			ctx->index.nentries = 0;
+			if (sbk_add_index_entry(ctx, frm, pos, ibuflen, 0) ==
+			    -1) {
+				sbk_free_frame(frm);
+				return NULL;
+			}
+		}
+		return frm;
 	}
 
 	if (ibuflen <= SBK_MAC_LEN) {
@@ -451,13 +1017,14 @@ sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
 		return NULL;
 	}
 
-	ibuflen -= SBK_MAC_LEN;
-	mac = ctx->ibuf + ibuflen;
+	counter = ctx->counter;
+	mac = ibuf + ibuflen - SBK_MAC_LEN;
 
 	if (sbk_decrypt_init(ctx, ctx->counter) == -1)
 		return NULL;
 
-	if (sbk_decrypt_update(ctx, ibuflen, &obuflen) == -1)
+	if (sbk_decrypt_update(ctx, ibuf, ibuflen - SBK_MAC_LEN, ctx->obuf,
+	    &obuflen) == -1)
 		return NULL;
 
 	if (sbk_decrypt_final(ctx, &obuflen, mac) == -1)
@@ -466,9 +1033,6 @@ sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
 	if ((frm = sbk_unpack_frame(ctx, ctx->obuf, obuflen)) == NULL)
 		return NULL;
 
-	if (frm->has_end)
-		ctx->eof = 1;
-
 	ctx->counter++;
 
 	if (sbk_has_file_data(frm)) {
@@ -485,41 +1049,515 @@ sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
 			if (sbk_skip_file_data(ctx, frm) == -1) {
 				sbk_free_frame(frm);
 				sbk_free_file(*file);
+				*file = NULL;
 				return NULL;
 			}
 		}
 	}
 
+	if (ctx->index.state == SBK_INDEX_RECORD &&
+	    sbk_add_index_entry(ctx, frm, pos, ibuflen, counter) == -1)
+		goto error;
+
+	if (frm->has_end) {
+		if (ctx->index.state == SBK_INDEX_RECORD &&
+		    sbk_write_index(ctx) == -1)
+			goto error;
+		ctx->eof = 1;
+	}
+
 	return frm;
-}
 
-void
-sbk_free_frame(Signal__BackupFrame *frm)
-{
-	if (frm != NULL)
-		signal__backup_frame__free_unpacked(frm, NULL);
+error:
+	sbk_free_frame(frm);
+	if (file != NULL) {
+		sbk_free_file(*file);
+		*file = NULL;
+	}
+	return NULL;
 }
 
-void
-sbk_free_file(struct sbk_file *file)
+static Signal__BackupFrame *
+sbk_read_indexed_frame(struct sbk_ctx *ctx, struct sbk_file **file,
+    unsigned int types)
 {
-	free(file);
-}
+	struct sbk_index_entry *ent;
 
-int
-sbk_write_file(struct sbk_ctx *ctx, struct sbk_file *file, FILE *fp)
-{
-	size_t		ibuflen, len, obuflen;
-	unsigned char	mac[SBK_MAC_LEN];
+	if (file != NULL)
+		*file = NULL;
+
+	if (ctx->eof)
+		return NULL;
+
+	while (ctx->index.next < ctx->index.nentries) {
+		ent = &ctx->index.entries[ctx->index.next++];
+
+		if (!(ent->type & types)) {
+			if (ent->type & SBK_FRAME_END) {
+				ctx->eof = 1;
+				return NULL;
+			}
+			continue;
+		}
+
+		if (sbk_seek(ctx, ent->pos) == -1)
+			return NULL;
+
+		ctx->firstframe = (ent->type & SBK_FRAME_HEADER) != 0;
+		ctx->counter = ent->counter;
+		return sbk_read_next_frame(ctx, file);
+	}
+
+	sbk_error_setx(ctx, "Unexpected end of index");
+	return NULL;
+}
+
+Signal__BackupFrame *
+sbk_get_filtered_frame(struct sbk_ctx *ctx, struct sbk_file **file,
+    unsigned int types)
+{
+	Signal__BackupFrame *frm;
+
+	/* Use the index to skip frames without decrypting them */
+	if (ctx->index.state == SBK_INDEX_LOADED)
+		return sbk_read_indexed_frame(ctx, file, types);
+
+	while ((frm = sbk_read_next_frame(ctx, file)) != NULL) {
+		if (sbk_get_frame_type(frm) & types)
+			break;
+
+		sbk_free_frame(frm);
+		if (file != NULL) {
+			sbk_free_file(*file);
+			*file = NULL;
+		}
+
+		if (ctx->eof)
+			return NULL;
+	}
+
+	return frm;
+}
+
+Signal__BackupFrame *
+sbk_get_frame(struct sbk_ctx *ctx, struct sbk_file **file)
+{
+	return sbk_get_filtered_frame(ctx, file, SBK_FRAME_ALL);
+}
+
+/* Frames belong to the frame arena, which is reset for every frame */
+void
+sbk_free_frame(Signal__BackupFrame *frm)
+{
+}
+
+void
+sbk_free_file(struct sbk_file *file)
+{
+	free(file);
+}
+
+static void
+sbk_put_uint32(unsigned char *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static void
+sbk_put_uint64(unsigned char *buf, uint64_t val)
+{
+	sbk_put_uint32(buf, val >> 32);
+	sbk_put_uint32(buf + 4, val);
+}
+
+static uint32_t
+sbk_get_uint32(const unsigned char *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+	    ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static uint64_t
+sbk_get_uint64(const unsigned char *buf)
+{
+	return ((uint64_t)sbk_get_uint32(buf) << 32) |
+	    sbk_get_uint32(buf + 4);
+}
+
+static int
+sbk_compute_index_mac(struct sbk_ctx *ctx, const unsigned char *buf,
+    size_t len, unsigned char *mac)
+{
+	unsigned int maclen;
 
-	if (sbk_enlarge_buffers(ctx, BUFSIZ) == -1)
+	if (HMAC_Init_ex(ctx->hmac, NULL, 0, NULL, NULL) == 0 ||
+	    HMAC_Update(ctx->hmac, buf, len) == 0 ||
+	    HMAC_Final(ctx->hmac, mac, &maclen) == 0) {
+		sbk_error_setx(ctx, "Cannot compute HMAC");
 		return -1;
+	}
 
-	if (fseek(ctx->fp, file->pos, SEEK_SET) == -1) {
-		sbk_error_set(ctx, "Cannot seek");
+	return 0;
+}
+
+/*
+ * Index file format (all integers big endian):
+ *
+ * magic (8 bytes), backup identifier (32 bytes), backup size (8 bytes),
+ * number of entries (8 bytes), entries, HMAC-SHA256 of the preceding data
+ *
+ * Each entry consists of the frame offset (8 bytes), frame length (4 bytes),
+ * counter (4 bytes), frame type (4 bytes), flags (4 bytes), file data length
+ * (4 bytes), row id (8 bytes) and attachment id (8 bytes).
+ */
+static int
+sbk_write_index(struct sbk_ctx *ctx)
+{
+	struct sbk_index	*idx;
+	struct sbk_index_entry	*ent;
+	unsigned char		*buf, *ptr;
+	char			*tmp;
+	size_t			 i, len;
+	ssize_t			 n;
+	int			 fd;
+
+	idx = &ctx->index;
+
+	if (idx->nentries > (SIZE_MAX - SBK_INDEX_HEADER_LEN -
+	    SBK_INDEX_MAC_LEN) / SBK_INDEX_ENTRY_LEN) {
+		sbk_error_setx(ctx, "Index too large");
+		return -1;
+	}
+
+	len = SBK_INDEX_HEADER_LEN + idx->nentries * SBK_INDEX_ENTRY_LEN +
+	    SBK_INDEX_MAC_LEN;
+
+	if ((buf = malloc(len)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	ptr = buf;
+	memcpy(ptr, SBK_INDEX_MAGIC, SBK_INDEX_MAGIC_LEN);
+	ptr += SBK_INDEX_MAGIC_LEN;
+	memcpy(ptr, ctx->ident, sizeof ctx->ident);
+	ptr += sizeof ctx->ident;
+	sbk_put_uint64(ptr, ctx->fpsize);
+	ptr += 8;
+	sbk_put_uint64(ptr, idx->nentries);
+	ptr += 8;
+
+	for (i = 0; i < idx->nentries; i++) {
+		ent = &idx->entries[i];
+		sbk_put_uint64(ptr, ent->pos);
+		sbk_put_uint32(ptr + 8, ent->len);
+		sbk_put_uint32(ptr + 12, ent->counter);
+		sbk_put_uint32(ptr + 16, ent->type);
+		sbk_put_uint32(ptr + 20, ent->flags);
+		sbk_put_uint32(ptr + 24, ent->datalen);
+		sbk_put_uint64(ptr + 28, ent->rowid);
+		sbk_put_uint64(ptr + 36, ent->attachmentid);
+		ptr += SBK_INDEX_ENTRY_LEN;
+	}
+
+	if (sbk_compute_index_mac(ctx, buf, ptr - buf, ptr) == -1) {
+		free(buf);
+		return -1;
+	}
+
+	/* Replace the index atomically */
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", idx->path) == -1) {
+		sbk_error_setx(ctx, "asprintf() failed");
+		free(buf);
+		return -1;
+	}
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		sbk_error_set(ctx, "%s", tmp);
+		free(tmp);
+		free(buf);
+		return -1;
+	}
+
+	for (ptr = buf; len > 0; ptr += n, len -= n)
+		if ((n = write(fd, ptr, len)) == -1) {
+			sbk_error_set(ctx, "Cannot write index");
+			close(fd);
+			goto error;
+		}
+
+	if (close(fd) == -1) {
+		sbk_error_set(ctx, "Cannot write index");
+		goto error;
+	}
+
+	if (rename(tmp, idx->path) == -1) {
+		sbk_error_set(ctx, "Cannot rename index");
+		goto error;
+	}
+
+	free(tmp);
+	free(buf);
+	idx->state = SBK_INDEX_LOADED;
+	idx->next = idx->nentries;
+	return 0;
+
+error:
+	unlink(tmp);
+	free(tmp);
+	free(buf);
+	return -1;
+}
+
+/*
+ * Returns 1 if the index was loaded, 0 if it is empty or stale, or -1 if it
+ * cannot be read or is not an index.
+ */
+static int
+sbk_read_index(struct sbk_ctx *ctx, int fd)
+{
+	struct sbk_index	*idx;
+	struct sbk_index_entry	*ent;
+	struct stat		 st;
+	unsigned char		 mac[SBK_INDEX_MAC_LEN];
+	unsigned char		*buf, *ptr;
+	uint64_t		 nentries;
+	size_t			 i, len;
+	ssize_t			 n;
+	off_t			 end;
+	int			 ret;
+
+	idx = &ctx->index;
+
+	if (fstat(fd, &st) == -1) {
+		sbk_error_set(ctx, "Cannot read index");
+		return -1;
+	}
+
+	if (st.st_size == 0)
+		return 0;
+
+	/* Never overwrite a file that is not an index */
+	if (!S_ISREG(st.st_mode) || st.st_size < SBK_INDEX_MAGIC_LEN ||
+	    (uintmax_t)st.st_size > SIZE_MAX) {
+		sbk_error_setx(ctx, "Invalid index");
+		return -1;
+	}
+
+	len = st.st_size;
+
+	if ((buf = malloc(len)) == NULL) {
+		sbk_error_set(ctx, NULL);
 		return -1;
 	}
 
+	for (ptr = buf, i = len; i > 0; ptr += n, i -= n)
+		if ((n = read(fd, ptr, i)) <= 0) {
+			if (n == -1)
+				sbk_error_set(ctx, "Cannot read index");
+			else
+				sbk_error_setx(ctx, "Cannot read index");
+			free(buf);
+			return -1;
+		}
+
+	ret = 0;
+	ptr = buf;
+
+	if (memcmp(ptr, SBK_INDEX_MAGIC, SBK_INDEX_MAGIC_LEN) != 0) {
+		sbk_error_setx(ctx, "Invalid index");
+		ret = -1;
+		goto out;
+	}
+	ptr += SBK_INDEX_MAGIC_LEN;
+
+	if (len < SBK_INDEX_HEADER_LEN + SBK_INDEX_MAC_LEN)
+		goto out;
+
+	if (memcmp(ptr, ctx->ident, sizeof ctx->ident) != 0)
+		goto out;
+	ptr += sizeof ctx->ident;
+
+	if (sbk_get_uint64(ptr) != (uint64_t)ctx->fpsize)
+		goto out;
+	ptr += 8;
+
+	nentries = sbk_get_uint64(ptr);
+	ptr += 8;
+
+	if (nentries < 2 || nentries > (len - SBK_INDEX_HEADER_LEN -
+	    SBK_INDEX_MAC_LEN) / SBK_INDEX_ENTRY_LEN ||
+	    len != SBK_INDEX_HEADER_LEN + nentries * SBK_INDEX_ENTRY_LEN +
+	    SBK_INDEX_MAC_LEN)
+		goto out;
+
+	if (sbk_compute_index_mac(ctx, buf, len - SBK_INDEX_MAC_LEN, mac) ==
+	    -1) {
+		ret = -1;
+		goto out;
+	}
+
+	if (memcmp(mac, buf + len - SBK_INDEX_MAC_LEN, sizeof mac) != 0)
+		goto out;
+
+	if ((ent = reallocarray(NULL, nentries, sizeof *ent)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		ret = -1;
+		goto out;
+	}
+
+	free(idx->entries);
+	idx->entries = ent;
+	idx->nentries = idx->size = nentries;
+
+	for (i = 0, end = 0; i < nentries; i++, ptr += SBK_INDEX_ENTRY_LEN) {
+		ent = &idx->entries[i];
+		ent->pos = sbk_get_uint64(ptr);
+		ent->len = sbk_get_uint32(ptr + 8);
+		ent->counter = sbk_get_uint32(ptr + 12);
+		ent->type = sbk_get_uint32(ptr + 16);
+		ent->flags = sbk_get_uint32(ptr + 20);
+		ent->datalen = sbk_get_uint32(ptr + 24);
+		ent->rowid = sbk_get_uint64(ptr + 28);
+		ent->attachmentid = sbk_get_uint64(ptr + 36);
+
+		/* Sanity check: frames must be consecutive */
+		if (ent->pos != end)
+			goto stale;
+		end = ent->pos + 4 + ent->len;
+		if (ent->datalen > 0)
+			end += ent->datalen + SBK_MAC_LEN;
+	}
+
+	if (idx->entries[0].type != SBK_FRAME_HEADER ||
+	    !(idx->entries[nentries - 1].type & SBK_FRAME_END) ||
+	    end > ctx->fpsize)
+		goto stale;
+
+	ret = 1;
+	goto out;
+
+stale:
+	idx->nentries = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+int
+sbk_open_index(struct sbk_ctx *ctx, const char *path)
+{
+	struct sbk_index	*idx;
+	int			 fd, ret;
+
+	idx = &ctx->index;
+
+	if (idx->state != SBK_INDEX_NONE) {
+		sbk_error_setx(ctx, "Index already open");
+		return -1;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK)) != -1) {
+		ret = sbk_read_index(ctx, fd);
+		close(fd);
+	} else if (errno == ENOENT)
+		ret = 0;
+	else {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	if (ret == -1)
+		return -1;
+
+	if ((idx->path = strdup(path)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	switch (ret) {
+	case 0:
+		/* Build a new index during the next full scan */
+		idx->state = SBK_INDEX_RECORD;
+		break;
+	default:
+		idx->state = SBK_INDEX_LOADED;
+		break;
+	}
+
+	idx->next = 0;
+	return sbk_rewind(ctx);
+}
+
+static void
+sbk_close_index(struct sbk_ctx *ctx)
+{
+	struct sbk_index *idx;
+
+	idx = &ctx->index;
+
+	free(idx->path);
+	free(idx->entries);
+	idx->state = SBK_INDEX_NONE;
+	idx->path = NULL;
+	idx->entries = NULL;
+	idx->nentries = idx->size = idx->next = 0;
+}
+
+static int
+sbk_write_fd(struct sbk_ctx *ctx, int fd, const unsigned char *buf,
+    size_t len)
+{
+	ssize_t		n;
+	uint64_t	start;
+
+	start = sbk_stats_clock();
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			sbk_error_set(ctx, "Cannot write file");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		ctx->stats.bytes_written += n;
+	}
+
+	sbk_stats_add_time(&ctx->stats.write_time, start);
+	return 0;
+}
+
+/*
+ * Decrypt the file, write it to fd and compute the SHA-256 digest of the
+ * plaintext. If fd is -1, the file is not written. If digest is NULL too, only
+ * the MAC is verified. Unmapped data is decrypted in place in ibuf; mapped data
+ * is decrypted straight from the map into obuf.
+ */
+static int
+sbk_read_file(struct sbk_ctx *ctx, struct sbk_file *file, int fd,
+    unsigned char *digest)
+{
+	SHA256_CTX		 sha;
+	const unsigned char	*ibuf, *mac;
+	unsigned char		*obuf;
+	size_t			 ibuflen, len, obuflen;
+	uint64_t		 start;
+	unsigned char		 macbuf[SBK_MAC_LEN];
+
+	if (sbk_enlarge_buffers(ctx, SBK_FILE_CHUNK_SIZE) == -1)
+		return -1;
+
+	if (sbk_seek(ctx, file->pos) == -1)
+		return -1;
+
+	sbk_will_read(ctx, file->pos, (size_t)file->len + SBK_MAC_LEN);
+
 	if (sbk_decrypt_init(ctx, file->counter) == -1)
 		return -1;
 
@@ -528,22 +1566,45 @@ sbk_write_file(struct sbk_ctx *ctx, struct sbk_file *file, FILE *fp)
 		return -1;
 	}
 
+	if (digest != NULL)
+		SHA256_Init(&sha);
+
 	for (len = file->len; len > 0; len -= ibuflen) {
-		ibuflen = (len < BUFSIZ) ? len : BUFSIZ;
+		ibuflen = (len < SBK_FILE_CHUNK_SIZE) ? len :
+		    SBK_FILE_CHUNK_SIZE;
 
-		if (sbk_read(ctx, ctx->ibuf, ibuflen) == -1)
+		if ((ibuf = sbk_read(ctx, ctx->ibuf, ibuflen)) == NULL)
 			return -1;
 
-		if (sbk_decrypt_update(ctx, ibuflen, &obuflen) == -1)
+		/*
+		 * The MAC covers the ciphertext, so there is no need to
+		 * decrypt data that is not written.
+		 */
+		if (fd == -1 && digest == NULL) {
+			start = sbk_stats_clock();
+			if (HMAC_Update(ctx->hmac, ibuf, ibuflen) == 0) {
+				sbk_error_setx(ctx, "Cannot compute HMAC");
+				return -1;
+			}
+			ctx->stats.bytes_decrypted += ibuflen;
+			sbk_stats_add_time(&ctx->stats.decrypt_time, start);
+			continue;
+		}
+
+		obuf = (ibuf == ctx->ibuf) ? ctx->ibuf : ctx->obuf;
+
+		if (sbk_decrypt_update(ctx, ibuf, ibuflen, obuf,
+		    &obuflen) == -1)
 			return -1;
 
-		if (fp != NULL && fwrite(ctx->obuf, obuflen, 1, fp) != 1) {
-			sbk_error_set(ctx, "Cannot write file");
+		if (digest != NULL)
+			SHA256_Update(&sha, obuf, obuflen);
+
+		if (fd != -1 && sbk_write_fd(ctx, fd, obuf, obuflen) == -1)
 			return -1;
-		}
 	}
 
-	if (sbk_read(ctx, mac, sizeof mac) == -1)
+	if ((mac = sbk_read(ctx, macbuf, sizeof macbuf)) == NULL)
 		return -1;
 
 	obuflen = 0;
@@ -551,29 +1612,59 @@ sbk_write_file(struct sbk_ctx *ctx, struct sbk_file *file, FILE *fp)
 	if (sbk_decrypt_final(ctx, &obuflen, mac) == -1)
 		return -1;
 
-	if (obuflen > 0 && fp != NULL && fwrite(ctx->obuf, obuflen, 1, fp) !=
-	    1) {
-		sbk_error_set(ctx, "Cannot write file");
+	if (obuflen > 0 && digest != NULL)
+		SHA256_Update(&sha, ctx->obuf, obuflen);
+
+	if (obuflen > 0 && fd != -1 &&
+	    sbk_write_fd(ctx, fd, ctx->obuf, obuflen) == -1)
 		return -1;
-	}
+
+	if (digest != NULL)
+		SHA256_Final(digest, &sha);
 
 	return 0;
 }
 
+int
+sbk_write_file(struct sbk_ctx *ctx, struct sbk_file *file, int fd)
+{
+	return sbk_read_file(ctx, file, fd, NULL);
+}
+
+/* Return the length of the plaintext of the file */
+size_t
+sbk_get_file_size(struct sbk_file *file)
+{
+	return file->len;
+}
+
+/*
+ * Write the plaintext of the file to fd and compute its SHA-256 digest, in a
+ * single pass
+ */
+int
+sbk_write_file_digest(struct sbk_ctx *ctx, struct sbk_file *file, int fd,
+    unsigned char *digest)
+{
+	return sbk_read_file(ctx, file, fd, digest);
+}
+
 char *
 sbk_get_file_as_string(struct sbk_ctx *ctx, struct sbk_file *file)
 {
-	size_t		 ibuflen, len, obuflen, obufsize;
-	unsigned char	 mac[SBK_MAC_LEN];
-	char		*obuf, *ptr;
+	const unsigned char	*ibuf, *mac;
+	size_t			 ibuflen, len, obuflen, obufsize;
+	unsigned char		 macbuf[SBK_MAC_LEN];
+	char			*obuf, *ptr;
 
-	if (sbk_enlarge_buffers(ctx, BUFSIZ) == -1)
+	/* The final decryption step still uses obuf */
+	if (sbk_enlarge_buffers(ctx, 0) == -1)
 		return NULL;
 
-	if (fseek(ctx->fp, file->pos, SEEK_SET) == -1) {
-		sbk_error_set(ctx, "Cannot seek");
+	if (sbk_seek(ctx, file->pos) == -1)
 		return NULL;
-	}
+
+	sbk_will_read(ctx, file->pos, (size_t)file->len + SBK_MAC_LEN);
 
 	if ((size_t)file->len > SIZE_MAX - EVP_MAX_BLOCK_LENGTH - 1) {
 		sbk_error_setx(ctx, "File too large");
@@ -597,20 +1688,23 @@ sbk_get_file_as_string(struct sbk_ctx *ctx, struct sbk_file *file)
 
 	ptr = obuf;
 
+	/* Read and decrypt in place in the result */
 	for (len = file->len; len > 0; len -= ibuflen) {
-		ibuflen = (len < BUFSIZ) ? len : BUFSIZ;
+		ibuflen = (len < SBK_FILE_CHUNK_SIZE) ? len :
+		    SBK_FILE_CHUNK_SIZE;
 
-		if (sbk_read(ctx, ctx->ibuf, ibuflen) == -1)
+		if ((ibuf = sbk_read(ctx, (unsigned char *)ptr, ibuflen)) ==
+		    NULL)
 			goto error;
 
-		if (sbk_decrypt_update(ctx, ibuflen, &obuflen) == -1)
+		if (sbk_decrypt_update(ctx, ibuf, ibuflen, (unsigned char *)ptr,
+		    &obuflen) == -1)
 			goto error;
 
-		memcpy(ptr, ctx->obuf, obuflen);
 		ptr += obuflen;
 	}
 
-	if (sbk_read(ctx, mac, sizeof mac) == -1)
+	if ((mac = sbk_read(ctx, macbuf, sizeof macbuf)) == NULL)
 		goto error;
 
 	obuflen = 0;
@@ -855,24 +1949,68 @@ sbk_get_attachment_file(struct sbk_ctx *ctx, int64_t rowid,
 	return (result != NULL) ? result->file : NULL;
 }
 
-static void
-sbk_free_attachment_tree(struct sbk_ctx *ctx)
+static int
+sbk_insert_indexed_attachment_entries(struct sbk_ctx *ctx)
 {
-	struct sbk_attachment_entry *entry;
+	struct sbk_attachment_entry	*entry;
+	struct sbk_index_entry		*ent;
+	struct sbk_file			*file;
+	size_t				 i;
 
-	while ((entry = RB_ROOT(&ctx->attachments)) != NULL) {
-		RB_REMOVE(sbk_attachment_tree, &ctx->attachments, entry);
-		sbk_free_file(entry->file);
-		free(entry);
-	}
-}
+	for (i = 0; i < ctx->index.nentries; i++) {
+		ent = &ctx->index.entries[i];
 
-static int
-sbk_bind_param(struct sbk_ctx *ctx, sqlite3_stmt *stm, int idx,
-    Signal__SqlStatement__SqlParameter *par)
-{
-	if (par->stringparamter != NULL)
-		return sbk_sqlite_bind_text(ctx, stm, idx,
+		if (!(ent->type & SBK_FRAME_ATTACHMENT))
+			continue;
+
+		if (!(ent->flags & SBK_INDEX_HAS_ROWID) ||
+		    !(ent->flags & SBK_INDEX_HAS_ATTACHMENTID)) {
+			sbk_error_setx(ctx, "Invalid attachment frame");
+			return -1;
+		}
+
+		if ((file = malloc(sizeof *file)) == NULL) {
+			sbk_error_set(ctx, NULL);
+			return -1;
+		}
+
+		file->pos = ent->pos + 4 + ent->len;
+		file->len = ent->datalen;
+		file->counter = ent->counter + 1;
+
+		if ((entry = malloc(sizeof *entry)) == NULL) {
+			sbk_error_set(ctx, NULL);
+			sbk_free_file(file);
+			return -1;
+		}
+
+		entry->rowid = ent->rowid;
+		entry->attachmentid = ent->attachmentid;
+		entry->file = file;
+		RB_INSERT(sbk_attachment_tree, &ctx->attachments, entry);
+	}
+
+	return 0;
+}
+
+static void
+sbk_free_attachment_tree(struct sbk_ctx *ctx)
+{
+	struct sbk_attachment_entry *entry;
+
+	while ((entry = RB_ROOT(&ctx->attachments)) != NULL) {
+		RB_REMOVE(sbk_attachment_tree, &ctx->attachments, entry);
+		sbk_free_file(entry->file);
+		free(entry);
+	}
+}
+
+static int
+sbk_bind_param(struct sbk_ctx *ctx, sqlite3_stmt *stm, int idx,
+    Signal__SqlStatement__SqlParameter *par)
+{
+	if (par->stringparamter != NULL)
+		return sbk_sqlite_bind_text(ctx, stm, idx,
 		    par->stringparamter);
 
 	if (par->has_integerparameter)
@@ -894,11 +2032,110 @@ sbk_bind_param(struct sbk_ctx *ctx, sqlite3_stmt *stm, int idx,
 	return -1;
 }
 
+static int
+sbk_cmp_statement_entries(struct sbk_statement_entry *a,
+    struct sbk_statement_entry *b)
+{
+	return strcmp(a->sql, b->sql);
+}
+
+static void
+sbk_free_statement_tree(struct sbk_ctx *ctx)
+{
+	struct sbk_statement_entry *entry;
+
+	while ((entry = RB_ROOT(&ctx->statements)) != NULL) {
+		RB_REMOVE(sbk_statement_tree, &ctx->statements, entry);
+		sqlite3_finalize(entry->stm);
+		free(entry->sql);
+		free(entry);
+	}
+}
+
+/* Return a prepared statement from the cache, preparing it if necessary */
+static sqlite3_stmt *
+sbk_get_cached_statement(struct sbk_ctx *ctx, const char *sql)
+{
+	struct sbk_statement_entry *entry, find;
+
+	find.sql = (char *)sql;
+	entry = RB_FIND(sbk_statement_tree, &ctx->statements, &find);
+	if (entry != NULL)
+		return entry->stm;
+
+	if ((entry = malloc(sizeof *entry)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return NULL;
+	}
+
+	if ((entry->sql = strdup(sql)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		free(entry);
+		return NULL;
+	}
+
+	if (sbk_sqlite_prepare(ctx, &entry->stm, sql) == -1) {
+		free(entry->sql);
+		free(entry);
+		return NULL;
+	}
+
+	RB_INSERT(sbk_statement_tree, &ctx->statements, entry);
+	return entry->stm;
+}
+
+/*
+ * Reset a cached statement and clear its bindings, so that it is ready for its
+ * next user. This must be done on every path after the statement is obtained,
+ * including when binding a parameter fails.
+ */
+static void
+sbk_reset_cached_statement(sqlite3_stmt *stm)
+{
+	sqlite3_reset(stm);
+	sqlite3_clear_bindings(stm);
+}
+
+static int
+sbk_is_needed_table(struct sbk_ctx *ctx, const char *name, size_t len)
+{
+	size_t i;
+
+	/* A cache always holds the complete database */
+	if (ctx->tables == NULL || ctx->cache != NULL)
+		return 1;
+
+	for (i = 0; ctx->tables[i] != NULL; i++)
+		if (strncasecmp(ctx->tables[i], name, len) == 0 &&
+		    ctx->tables[i][len] == '\0')
+			return 1;
+
+	return 0;
+}
+
+/* Only inserts are skipped; the schema is always created */
+static int
+sbk_is_needed_statement(struct sbk_ctx *ctx, const char *sql)
+{
+	const char *name;
+
+	if (strncasecmp(sql, "INSERT INTO ", 12) != 0)
+		return 1;
+
+	name = sql + 12;
+	if (*name == '"' || *name == '`' || *name == '[')
+		name++;
+
+	return sbk_is_needed_table(ctx, name, strcspn(name, "\"`] ("));
+}
+
 static int
 sbk_exec_statement(struct sbk_ctx *ctx, Signal__SqlStatement *sql)
 {
 	sqlite3_stmt	*stm;
 	size_t		 i;
+	uint64_t	 start;
+	int		 ret;
 
 	if (sql->statement == NULL) {
 		sbk_error_setx(ctx, "Invalid SQL frame");
@@ -909,22 +2146,40 @@ sbk_exec_statement(struct sbk_ctx *ctx, Signal__SqlStatement *sql)
 	if (strncasecmp(sql->statement, "create table sqlite_", 20) == 0)
 		return 0;
 
-	if (sbk_sqlite_prepare(ctx, &stm, sql->statement) == -1)
+	if (!sbk_is_needed_statement(ctx, sql->statement))
+		return 0;
+
+	start = sbk_stats_clock();
+	ctx->stats.statements++;
+
+	/*
+	 * Statements with parameters are mostly inserts that are repeated
+	 * many times, so keep them prepared
+	 */
+	if (sql->n_parameters > 0) {
+		if ((stm = sbk_get_cached_statement(ctx, sql->statement)) ==
+		    NULL)
+			return -1;
+	} else if (sbk_sqlite_prepare(ctx, &stm, sql->statement) == -1)
 		return -1;
 
+	ret = -1;
+
 	for (i = 0; i < sql->n_parameters; i++)
 		if (sbk_bind_param(ctx, stm, i + 1, sql->parameters[i]) == -1)
-			goto error;
+			goto out;
 
-	if (sbk_sqlite_step(ctx, stm) != SQLITE_DONE)
-		goto error;
+	if (sbk_sqlite_step(ctx, stm) == SQLITE_DONE)
+		ret = 0;
 
-	sqlite3_finalize(stm);
-	return 0;
+out:
+	if (sql->n_parameters > 0)
+		sbk_reset_cached_statement(stm);
+	else
+		sqlite3_finalize(stm);
 
-error:
-	sqlite3_finalize(stm);
-	return -1;
+	sbk_stats_add_time(&ctx->stats.sql_time, start);
+	return ret;
 }
 
 static int
@@ -951,161 +2206,1125 @@ sbk_set_database_version(struct sbk_ctx *ctx, Signal__DatabaseVersion *ver)
 	return ret;
 }
 
-static int
-sbk_create_database(struct sbk_ctx *ctx)
-{
+/*
+ * While the database is being built, a reader thread reads, decrypts and
+ * unpacks the frames, and the calling thread executes them in SQLite. The
+ * reader works on a copy of the context, so that both threads have their own
+ * error message. Only the reading state is used by the reader, and it is
+ * copied back when the reader has finished.
+ */
+
+struct sbk_pipeline_item {
 	Signal__BackupFrame	*frm;
 	struct sbk_file		*file;
-	int			 ret;
-
-	if (ctx->db != NULL)
-		return 0;
+};
 
-	if (sbk_sqlite_open(ctx, &ctx->db, ":memory:") == -1)
-		goto error;
+struct sbk_pipeline {
+	pthread_t		 thread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 nonempty;
+	pthread_cond_t		 nonfull;
+	struct sbk_pipeline_item items[SBK_PIPELINE_SIZE];
+	struct sbk_arena	 arenas[SBK_PIPELINE_SIZE];
+	size_t			 head;
+	size_t			 count;
+	int			 held;	/* The consumer still uses the head */
+	int			 done;	/* Set by the reader */
+	int			 stop;	/* Set by the consumer */
+	unsigned int		 types;
+	struct sbk_ctx		 reader;
+};
 
-	if (sbk_rewind(ctx) == -1)
-		goto error;
+/*
+ * Pass a file to the handler set by sbk_extract(), if any. The handler reads
+ * the file data just skipped, and possibly only part of it if it fails, so
+ * return to the next frame afterwards.
+ */
+static int
+sbk_pass_file(struct sbk_ctx *ctx, Signal__BackupFrame *frm,
+    struct sbk_file *file)
+{
+	off_t pos;
 
-	if (sbk_sqlite_exec(ctx, "BEGIN TRANSACTION") == -1)
-		goto error;
+	if (file == NULL || ctx->file_fn == NULL)
+		return 0;
 
-	ret = 0;
+	if ((pos = sbk_tell(ctx)) == -1)
+		return -1;
 
-	while ((frm = sbk_get_frame(ctx, &file)) != NULL) {
-		if (frm->version != NULL)
-			ret = sbk_set_database_version(ctx, frm->version);
-		else if (frm->statement != NULL)
-			ret = sbk_exec_statement(ctx, frm->statement);
-		else if (frm->attachment != NULL)
-			ret = sbk_insert_attachment_entry(ctx, frm, file);
-		else
-			sbk_free_file(file);
+	if (ctx->file_fn(ctx, frm, file, ctx->file_arg) == -1) {
+		sbk_error_setx(ctx, "Cannot extract file");
+		return -1;
+	}
 
-		sbk_free_frame(frm);
+	return sbk_seek(ctx, pos);
+}
 
-		if (ret == -1)
-			goto error;
-	}
+static void *
+sbk_pipeline_read(void *arg)
+{
+	struct sbk_pipeline	*pl;
+	struct sbk_file		*file;
+	Signal__BackupFrame	*frm;
+	size_t			 i;
 
-	if (sbk_sqlite_exec(ctx, "END TRANSACTION") == -1)
-		goto error;
+	pl = arg;
+
+	for (;;) {
+		/* Wait for a free item; its arena receives the next frame */
+		pthread_mutex_lock(&pl->mtx);
+
+		while (pl->count == SBK_PIPELINE_SIZE && !pl->stop)
+			pthread_cond_wait(&pl->nonfull, &pl->mtx);
+
+		i = (pl->head + pl->count) % SBK_PIPELINE_SIZE;
+		frm = NULL;
+		file = NULL;
+
+		if (!pl->stop) {
+			pthread_mutex_unlock(&pl->mtx);
+			pl->reader.frames = &pl->arenas[i];
+			frm = sbk_get_filtered_frame(&pl->reader, &file,
+			    pl->types);
+			if (frm != NULL &&
+			    sbk_pass_file(&pl->reader, frm, file) == -1) {
+				sbk_free_file(file);
+				file = NULL;
+				frm = NULL;
+			}
+			pthread_mutex_lock(&pl->mtx);
+		}
 
-	if (!ctx->eof)
-		goto error;
+		if (frm == NULL || pl->stop) {
+			pl->done = 1;
+			pthread_cond_signal(&pl->nonempty);
+			pthread_mutex_unlock(&pl->mtx);
+			sbk_free_file(file);
+			break;
+		}
 
-	return 0;
+		pl->items[i].frm = frm;
+		pl->items[i].file = file;
+		pl->count++;
+		pthread_cond_signal(&pl->nonempty);
+		pthread_mutex_unlock(&pl->mtx);
+	}
 
-error:
-	sbk_free_attachment_tree(ctx);
-	sqlite3_close(ctx->db);
-	ctx->db = NULL;
-	return -1;
+	return NULL;
 }
 
-int
-sbk_write_database(struct sbk_ctx *ctx, const char *path)
+static int
+sbk_pipeline_start(struct sbk_ctx *ctx, struct sbk_pipeline *pl,
+    unsigned int types)
 {
-	sqlite3		*db;
-	sqlite3_backup	*bak;
+	size_t i;
 
-	if (sbk_create_database(ctx) == -1)
-		return -1;
+	pl->head = pl->count = 0;
+	pl->held = pl->done = pl->stop = 0;
+	pl->types = types;
+	pl->reader = *ctx;
+	pl->reader.error = NULL;
+	memset(&pl->reader.stats, 0, sizeof pl->reader.stats);
 
-	if (sbk_sqlite_open(ctx, &db, path) == -1)
-		goto error;
+	for (i = 0; i < SBK_PIPELINE_SIZE; i++)
+		sbk_arena_init(&pl->arenas[i]);
 
-	if ((bak = sqlite3_backup_init(db, "main", ctx->db, "main")) == NULL) {
-		sbk_error_sqlite_setd(ctx, db, "Cannot write database");
-		goto error;
+	if (pthread_mutex_init(&pl->mtx, NULL) != 0) {
+		sbk_error_setx(ctx, "Cannot initialise mutex");
+		return -1;
 	}
 
-	if (sqlite3_backup_step(bak, -1) != SQLITE_DONE) {
-		sbk_error_sqlite_setd(ctx, db, "Cannot write database");
-		sqlite3_backup_finish(bak);
-		goto error;
+	if (pthread_cond_init(&pl->nonempty, NULL) != 0) {
+		sbk_error_setx(ctx, "Cannot initialise condition variable");
+		goto error1;
 	}
 
-	sqlite3_backup_finish(bak);
+	if (pthread_cond_init(&pl->nonfull, NULL) != 0) {
+		sbk_error_setx(ctx, "Cannot initialise condition variable");
+		goto error2;
+	}
 
-	if (sqlite3_close(db) != SQLITE_OK) {
-		sbk_error_sqlite_setd(ctx, db, "Cannot close database");
-		return -1;
+	if (pthread_create(&pl->thread, NULL, sbk_pipeline_read, pl) != 0) {
+		sbk_error_setx(ctx, "Cannot create thread");
+		goto error3;
 	}
 
 	return 0;
 
-error:
-	sqlite3_close(db);
+error3:
+	pthread_cond_destroy(&pl->nonfull);
+error2:
+	pthread_cond_destroy(&pl->nonempty);
+error1:
+	pthread_mutex_destroy(&pl->mtx);
 	return -1;
 }
 
+/*
+ * Returns 1 if a frame was returned, or 0 if the reader has finished. The
+ * frame remains valid until the next call.
+ */
 static int
-sbk_cmp_recipient_entries(struct sbk_recipient_entry *e,
-    struct sbk_recipient_entry *f)
+sbk_pipeline_get(struct sbk_pipeline *pl, Signal__BackupFrame **frm,
+    struct sbk_file **file)
 {
-	if (e->id.old != NULL)
-		return strcmp(e->id.old, f->id.old);
-	else
-		return (e->id.new < f->id.new) ? -1 : (e->id.new > f->id.new);
-}
+	pthread_mutex_lock(&pl->mtx);
+
+	/* Release the previous frame */
+	if (pl->held) {
+		pl->head = (pl->head + 1) % SBK_PIPELINE_SIZE;
+		pl->count--;
+		pl->held = 0;
+		pthread_cond_signal(&pl->nonfull);
+	}
 
-static int
-sbk_get_recipient_id_from_column(struct sbk_ctx *ctx,
-    struct sbk_recipient_id *id, sqlite3_stmt *stm, int idx)
-{
-	if (ctx->db_version < SBK_DB_VERSION_RECIPIENT_IDS) {
-		id->new = -1;
-		if (sbk_sqlite_column_text_copy(ctx, &id->old, stm, idx) == -1)
-			return -1;
-		if (id->old == NULL) {
-			sbk_error_setx(ctx, "Invalid recipient id");
-			return -1;
-		}
-	} else {
-		id->new = sqlite3_column_int(stm, idx);
-		id->old = NULL;
+	while (pl->count == 0 && !pl->done)
+		pthread_cond_wait(&pl->nonempty, &pl->mtx);
+
+	if (pl->count == 0) {
+		pthread_mutex_unlock(&pl->mtx);
+		return 0;
 	}
 
-	return 0;
+	*frm = pl->items[pl->head].frm;
+	*file = pl->items[pl->head].file;
+	pl->held = 1;
+	pthread_mutex_unlock(&pl->mtx);
+	return 1;
 }
 
+/*
+ * Stop the reader and copy its state back. If the consumer has not failed,
+ * an error of the reader becomes the error of the context.
+ */
 static void
-sbk_free_recipient_entry(struct sbk_recipient_entry *ent)
+sbk_pipeline_finish(struct sbk_ctx *ctx, struct sbk_pipeline *pl, int failed)
 {
-	if (ent == NULL)
-		return;
+	struct sbk_ctx	*rd;
+	size_t		 i;
 
-	switch (ent->recipient.type) {
-	case SBK_CONTACT:
-		free(ent->recipient.contact->phone);
-		free(ent->recipient.contact->email);
-		free(ent->recipient.contact->system_display_name);
-		free(ent->recipient.contact->system_phone_label);
-		free(ent->recipient.contact->profile_name);
-		free(ent->recipient.contact->profile_family_name);
-		free(ent->recipient.contact->profile_joined_name);
-		free(ent->recipient.contact);
-		break;
-	case SBK_GROUP:
-		free(ent->recipient.group->name);
-		free(ent->recipient.group);
-		break;
+	pthread_mutex_lock(&pl->mtx);
+	pl->stop = 1;
+	pthread_cond_signal(&pl->nonfull);
+	pthread_mutex_unlock(&pl->mtx);
+
+	pthread_join(pl->thread, NULL);
+
+	/* The file of a held frame has been passed to the consumer */
+	if (pl->held) {
+		pl->head = (pl->head + 1) % SBK_PIPELINE_SIZE;
+		pl->count--;
 	}
 
-	free(ent->id.old);
-	free(ent);
+	for (; pl->count > 0; pl->count--) {
+		sbk_free_file(pl->items[pl->head].file);
+		pl->head = (pl->head + 1) % SBK_PIPELINE_SIZE;
+	}
+
+	for (i = 0; i < SBK_PIPELINE_SIZE; i++)
+		sbk_arena_free(&pl->arenas[i]);
+
+	rd = &pl->reader;
+	ctx->mappos = rd->mappos;
+	ctx->counter = rd->counter;
+	memcpy(ctx->iv, rd->iv, SBK_IV_LEN);
+	ctx->index = rd->index;
+	ctx->ibuf = rd->ibuf;
+	ctx->ibufsize = rd->ibufsize;
+	ctx->obuf = rd->obuf;
+	ctx->obufsize = rd->obufsize;
+	ctx->firstframe = rd->firstframe;
+	ctx->eof = rd->eof;
+	sbk_sum_stats(&ctx->stats, &rd->stats);
+
+	if (!failed && rd->error != NULL) {
+		sbk_error_clear(ctx);
+		ctx->error = rd->error;
+	} else
+		free(rd->error);
+
+	pthread_cond_destroy(&pl->nonfull);
+	pthread_cond_destroy(&pl->nonempty);
+	pthread_mutex_destroy(&pl->mtx);
 }
 
-static void
-sbk_free_recipient_tree(struct sbk_ctx *ctx)
+/* Indexes for the queries that are run once per message */
+#define SBK_QUERY_INDEXES_PART						\
+	"CREATE INDEX IF NOT EXISTS sigbak_part_mid "			\
+	"ON part (mid, unique_id)"
+
+#define SBK_QUERY_INDEXES_MENTION					\
+	"CREATE INDEX IF NOT EXISTS sigbak_mention_message_id "	\
+	"ON mention (message_id, range_start)"
+
+static int
+sbk_create_query_indexes(struct sbk_ctx *ctx)
 {
-	struct sbk_recipient_entry *ent;
+	if (ctx->db_indexed)
+		return 0;
 
-	while ((ent = RB_ROOT(&ctx->recipients)) != NULL) {
-		RB_REMOVE(sbk_recipient_tree, &ctx->recipients, ent);
-		sbk_free_recipient_entry(ent);
-	}
+	if (sbk_sqlite_exec(ctx, SBK_QUERY_INDEXES_PART) == -1)
+		return -1;
+
+	if (ctx->db_version >= SBK_DB_VERSION_MENTIONS &&
+	    sbk_sqlite_exec(ctx, SBK_QUERY_INDEXES_MENTION) == -1)
+		return -1;
+
+	ctx->db_indexed = 1;
+	return 0;
+}
+
+/* Indexes for exporting the messages one thread at a time */
+#define SBK_THREAD_INDEXES						\
+	"CREATE INDEX IF NOT EXISTS sigbak_sms_thread_id "		\
+	"ON sms (thread_id); "						\
+	"CREATE INDEX IF NOT EXISTS sigbak_mms_thread_id "		\
+	"ON mms (thread_id)"
+
+static int
+sbk_create_thread_indexes(struct sbk_ctx *ctx)
+{
+	return sbk_sqlite_exec(ctx, SBK_THREAD_INDEXES);
+}
+
+/*
+ * The search index holds the text of the messages as they are exported, that
+ * is, with the long messages and mentions filled in. It has no content of its
+ * own: the rowid is the sms or mms _id, doubled and plus one for mms.
+ */
+#define SBK_SEARCH_SCHEMA						\
+	"CREATE VIRTUAL TABLE sigbak_search USING fts5 ("		\
+	"text, "							\
+	"content = '')"
+
+#define SBK_SEARCH_EXISTS						\
+	"SELECT 1 FROM sqlite_master "					\
+	"WHERE type = 'table' AND name = 'sigbak_search'"
+
+#define SBK_SEARCH_INSERT						\
+	"INSERT INTO sigbak_search (rowid, text) VALUES (?, ?)"
+
+#define SBK_CACHE_SCHEMA						\
+	"CREATE TABLE sigbak_attachment ("				\
+	"row_id INTEGER, "						\
+	"attachment_id INTEGER, "					\
+	"pos INTEGER, "							\
+	"len INTEGER, "							\
+	"counter INTEGER); "						\
+	"CREATE TABLE sigbak_cache ("					\
+	"format INTEGER, "						\
+	"ident BLOB, "							\
+	"size INTEGER, "						\
+	"db_version INTEGER, "						\
+	"mac BLOB)"
+
+#define SBK_CACHE_EXISTS						\
+	"SELECT 1 FROM sqlite_master "					\
+	"WHERE type = 'table' AND name = 'sigbak_cache'"
+
+#define SBK_CACHE_QUERY							\
+	"SELECT format, ident, size, db_version, mac FROM sigbak_cache"
+
+/* In the order in which they are covered by the MAC */
+#define SBK_CACHE_ATTACHMENTS_QUERY					\
+	"SELECT row_id, attachment_id, pos, len, counter "		\
+	"FROM sigbak_attachment "					\
+	"ORDER BY row_id, attachment_id"
+
+#define SBK_CACHE_INSERT_ATTACHMENT					\
+	"INSERT INTO sigbak_attachment VALUES (?, ?, ?, ?, ?)"
+
+#define SBK_CACHE_INSERT_IDENT						\
+	"INSERT INTO sigbak_cache VALUES (?, ?, ?, ?, ?)"
+
+/*
+ * The cache MAC is an HMAC-SHA256, keyed with the MAC key of the backup, of
+ * the backup identifier, the backup size, the database version and the
+ * location of every attachment. So the locations that are passed to the
+ * decryption cannot come from a cache for another backup or passphrase, or
+ * from a cache that has been modified.
+ */
+static int
+sbk_cache_mac_init(struct sbk_ctx *ctx, unsigned int version)
+{
+	unsigned char buf[sizeof ctx->ident + 16];
+
+	memcpy(buf, ctx->ident, sizeof ctx->ident);
+	sbk_put_uint64(buf + sizeof ctx->ident, ctx->fpsize);
+	sbk_put_uint64(buf + sizeof ctx->ident + 8, version);
+
+	if (HMAC_Init_ex(ctx->hmac, NULL, 0, NULL, NULL) == 0 ||
+	    HMAC_Update(ctx->hmac, buf, sizeof buf) == 0) {
+		sbk_error_setx(ctx, "Cannot compute HMAC");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+sbk_cache_mac_update(struct sbk_ctx *ctx, struct sbk_attachment_entry *entry)
+{
+	unsigned char buf[32];
+
+	sbk_put_uint64(buf, entry->rowid);
+	sbk_put_uint64(buf + 8, entry->attachmentid);
+	sbk_put_uint64(buf + 16, entry->file->pos);
+	sbk_put_uint32(buf + 24, entry->file->len);
+	sbk_put_uint32(buf + 28, entry->file->counter);
+
+	if (HMAC_Update(ctx->hmac, buf, sizeof buf) == 0) {
+		sbk_error_setx(ctx, "Cannot compute HMAC");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+sbk_cache_mac_final(struct sbk_ctx *ctx, unsigned char *mac)
+{
+	unsigned int maclen;
+
+	if (HMAC_Final(ctx->hmac, mac, &maclen) == 0) {
+		sbk_error_setx(ctx, "Cannot compute HMAC");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the database was loaded from the cache, 0 if the cache is
+ * missing, empty or stale and -1 on error. A file that is not a cache is an
+ * error, so that it is never overwritten.
+ */
+static int
+sbk_read_cache(struct sbk_ctx *ctx)
+{
+	struct sbk_attachment_entry	*entry;
+	struct sbk_file			*file;
+	struct stat			 st;
+	sqlite3				*db;
+	sqlite3_stmt			*stm;
+	const void			*ident, *theirmac;
+	unsigned int			 version;
+	int				 ret;
+	unsigned char			 mac[SBK_CACHE_MAC_LEN];
+	unsigned char			 ourmac[SBK_CACHE_MAC_LEN];
+
+	if (stat(ctx->cache, &st) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		sbk_error_set(ctx, "Cannot open cache");
+		return -1;
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size == 0)
+		return 0;
+
+	db = NULL;
+	stm = NULL;
+
+	if (!S_ISREG(st.st_mode) ||
+	    sqlite3_open_v2(ctx->cache, &db, SQLITE_OPEN_READONLY, NULL) !=
+	    SQLITE_OK)
+		goto invalid;
+
+	if (sqlite3_prepare_v2(db, SBK_CACHE_EXISTS, -1, &stm, NULL) !=
+	    SQLITE_OK || sqlite3_step(stm) != SQLITE_ROW)
+		goto invalid;
+
+	sqlite3_finalize(stm);
+
+	if (sqlite3_prepare_v2(db, SBK_CACHE_QUERY, -1, &stm, NULL) !=
+	    SQLITE_OK)
+		goto stale;
+
+	if (sqlite3_step(stm) != SQLITE_ROW)
+		goto stale;
+
+	if (sqlite3_column_int(stm, 0) != SBK_CACHE_VERSION)
+		goto stale;
+
+	ident = sqlite3_column_blob(stm, 1);
+	if (ident == NULL ||
+	    sqlite3_column_bytes(stm, 1) != sizeof ctx->ident ||
+	    memcmp(ident, ctx->ident, sizeof ctx->ident) != 0)
+		goto stale;
+
+	if (sqlite3_column_int64(stm, 2) != ctx->fpsize)
+		goto stale;
+
+	version = sqlite3_column_int(stm, 3);
+
+	theirmac = sqlite3_column_blob(stm, 4);
+	if (theirmac == NULL || sqlite3_column_bytes(stm, 4) != sizeof mac)
+		goto stale;
+
+	memcpy(mac, theirmac, sizeof mac);
+	sqlite3_finalize(stm);
+
+	if (ctx->db_search) {
+		if (sqlite3_prepare_v2(db, SBK_SEARCH_EXISTS, -1, &stm, NULL) !=
+		    SQLITE_OK)
+			goto stale;
+
+		if (sqlite3_step(stm) != SQLITE_ROW)
+			goto stale;
+
+		sqlite3_finalize(stm);
+	}
+
+	if (sqlite3_prepare_v2(db, SBK_CACHE_ATTACHMENTS_QUERY, -1, &stm,
+	    NULL) != SQLITE_OK)
+		goto stale;
+
+	if (sbk_cache_mac_init(ctx, version) == -1)
+		goto error;
+
+	while ((ret = sqlite3_step(stm)) == SQLITE_ROW) {
+		if ((file = malloc(sizeof *file)) == NULL) {
+			sbk_error_set(ctx, NULL);
+			goto error;
+		}
+
+		file->pos = sqlite3_column_int64(stm, 2);
+		file->len = sqlite3_column_int64(stm, 3);
+		file->counter = sqlite3_column_int64(stm, 4);
+
+		if ((entry = malloc(sizeof *entry)) == NULL) {
+			sbk_error_set(ctx, NULL);
+			sbk_free_file(file);
+			goto error;
+		}
+
+		entry->rowid = sqlite3_column_int64(stm, 0);
+		entry->attachmentid = sqlite3_column_int64(stm, 1);
+		entry->file = file;
+
+		if (RB_INSERT(sbk_attachment_tree, &ctx->attachments, entry) !=
+		    NULL) {
+			sbk_free_file(file);
+			free(entry);
+			goto stale;
+		}
+
+		if (sbk_cache_mac_update(ctx, entry) == -1)
+			goto error;
+
+		if (file->pos < 0 || file->pos > ctx->fpsize ||
+		    (uint64_t)file->len + SBK_MAC_LEN >
+		    (uint64_t)(ctx->fpsize - file->pos))
+			goto stale;
+	}
+
+	if (ret != SQLITE_DONE)
+		goto stale;
+
+	if (sbk_cache_mac_final(ctx, ourmac) == -1)
+		goto error;
+
+	if (memcmp(ourmac, mac, sizeof mac) != 0)
+		goto stale;
+
+	sqlite3_finalize(stm);
+	ctx->db = db;
+	ctx->db_version = version;
+	/* The cache is read-only and already has the indexes */
+	ctx->db_indexed = 1;
+	return 1;
+
+stale:
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+	sbk_free_attachment_tree(ctx);
+	return 0;
+
+invalid:
+	sbk_error_setx(ctx, "%s: Invalid cache", ctx->cache);
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+	return -1;
+
+error:
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+	sbk_free_attachment_tree(ctx);
+	return -1;
+}
+
+static int
+sbk_write_cache(struct sbk_ctx *ctx)
+{
+	struct sbk_attachment_entry	*entry;
+	sqlite3				*db;
+	sqlite3_backup			*bak;
+	sqlite3_stmt			*stm;
+	char				*tmp;
+	int				 fd;
+	unsigned char			 mac[SBK_CACHE_MAC_LEN];
+
+	/*
+	 * The cache contains the decrypted database, so it is created with
+	 * mode 0600 by mkstemp(). It is renamed over the old cache once it has
+	 * been written completely.
+	 */
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", ctx->cache) == -1) {
+		sbk_error_setx(ctx, "asprintf() failed");
+		return -1;
+	}
+
+	if ((fd = mkstemp(tmp)) == -1) {
+		sbk_error_set(ctx, "Cannot create cache");
+		free(tmp);
+		return -1;
+	}
+
+	close(fd);
+	db = NULL;
+	stm = NULL;
+
+	if (sbk_sqlite_open(ctx, &db, tmp) == -1)
+		goto error;
+
+	/* A cache that is not written completely lacks its identity */
+	if (sqlite3_exec(db, "PRAGMA journal_mode = OFF", NULL, NULL, NULL) !=
+	    SQLITE_OK)
+		goto sqlite_error;
+
+	if ((bak = sqlite3_backup_init(db, "main", ctx->db, "main")) == NULL)
+		goto sqlite_error;
+
+	if (sqlite3_backup_step(bak, -1) != SQLITE_DONE) {
+		sqlite3_backup_finish(bak);
+		goto sqlite_error;
+	}
+
+	sqlite3_backup_finish(bak);
+
+	if (sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) !=
+	    SQLITE_OK)
+		goto sqlite_error;
+
+	if (sqlite3_exec(db, SBK_CACHE_SCHEMA, NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_error;
+
+	if (sqlite3_prepare_v2(db, SBK_CACHE_INSERT_ATTACHMENT, -1, &stm,
+	    NULL) != SQLITE_OK)
+		goto sqlite_error;
+
+	if (sbk_cache_mac_init(ctx, ctx->db_version) == -1)
+		goto error;
+
+	RB_FOREACH(entry, sbk_attachment_tree, &ctx->attachments) {
+		if (sbk_cache_mac_update(ctx, entry) == -1)
+			goto error;
+
+		sqlite3_bind_int64(stm, 1, entry->rowid);
+		sqlite3_bind_int64(stm, 2, entry->attachmentid);
+		sqlite3_bind_int64(stm, 3, entry->file->pos);
+		sqlite3_bind_int64(stm, 4, entry->file->len);
+		sqlite3_bind_int64(stm, 5, entry->file->counter);
+
+		if (sqlite3_step(stm) != SQLITE_DONE)
+			goto sqlite_error;
+
+		sqlite3_reset(stm);
+	}
+
+	sqlite3_finalize(stm);
+	stm = NULL;
+
+	if (sbk_cache_mac_final(ctx, mac) == -1)
+		goto error;
+
+	if (sqlite3_prepare_v2(db, SBK_CACHE_INSERT_IDENT, -1, &stm, NULL) !=
+	    SQLITE_OK)
+		goto sqlite_error;
+
+	sqlite3_bind_int(stm, 1, SBK_CACHE_VERSION);
+	sqlite3_bind_blob(stm, 2, ctx->ident, sizeof ctx->ident,
+	    SQLITE_STATIC);
+	sqlite3_bind_int64(stm, 3, ctx->fpsize);
+	sqlite3_bind_int64(stm, 4, ctx->db_version);
+	sqlite3_bind_blob(stm, 5, mac, sizeof mac, SQLITE_STATIC);
+
+	if (sqlite3_step(stm) != SQLITE_DONE)
+		goto sqlite_error;
+
+	sqlite3_finalize(stm);
+	stm = NULL;
+
+	if (sqlite3_exec(db, "END TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		goto sqlite_error;
+
+	if (sqlite3_close(db) != SQLITE_OK) {
+		sbk_error_sqlite_setd(ctx, db, "Cannot close cache");
+		db = NULL;
+		goto error;
+	}
+
+	if (rename(tmp, ctx->cache) == -1) {
+		sbk_error_set(ctx, "Cannot rename cache");
+		db = NULL;
+		goto error;
+	}
+
+	free(tmp);
+	return 0;
+
+sqlite_error:
+	sbk_error_sqlite_setd(ctx, db, "Cannot write cache");
+error:
+	sqlite3_finalize(stm);
+	sqlite3_close(db);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+static void
+sbk_free_tables(struct sbk_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx->tables != NULL) {
+		for (i = 0; ctx->tables[i] != NULL; i++)
+			free(ctx->tables[i]);
+		free(ctx->tables);
+		ctx->tables = NULL;
+	}
+}
+
+/*
+ * Restrict the database to the tables in the NULL-terminated array tables.
+ * Rows for other tables are not inserted. Must be called before the first
+ * query.
+ */
+int
+sbk_set_tables(struct sbk_ctx *ctx, const char * const *tables)
+{
+	size_t i, n;
+
+	sbk_free_tables(ctx);
+
+	if (tables == NULL)
+		return 0;
+
+	for (n = 0; tables[n] != NULL; n++)
+		continue;
+
+	if ((ctx->tables = calloc(n + 1, sizeof *ctx->tables)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		if ((ctx->tables[i] = strdup(tables[i])) == NULL) {
+			sbk_error_set(ctx, NULL);
+			sbk_free_tables(ctx);
+			return -1;
+		}
+
+	return 0;
+}
+
+/*
+ * Build the databases of the contexts opened afterwards in a temporary file
+ * rather than in memory, so that they can be larger than the available
+ * memory. The page cache of every database is limited to about size bytes.
+ * The file is removed when the context is closed.
+ */
+void
+sbk_set_memory_budget(size_t size)
+{
+	sbk_memory_budget = size;
+}
+
+/* Return the memory budget, or 0 if databases are built in memory */
+size_t
+sbk_get_memory_budget(void)
+{
+	return sbk_memory_budget;
+}
+
+#define SBK_DISK_DATABASE_TEMPLATE	"/tmp/sigbak-XXXXXXXXXX"
+
+/*
+ * Larger pages mean fewer pages per row and B-tree level. Nothing is written
+ * to the journal or synced, since the file is discarded after a failure
+ * anyway.
+ */
+#define SBK_DISK_DATABASE_PRAGMAS					\
+	"PRAGMA page_size = 16384; "					\
+	"PRAGMA journal_mode = OFF; "					\
+	"PRAGMA synchronous = OFF"
+
+/* Limit the page cache and let reads go through a mapping of the file */
+static int
+sbk_limit_database_memory(struct sbk_ctx *ctx, sqlite3 *db)
+{
+	char	*sql;
+	int	 ret;
+
+	sql = sqlite3_mprintf("PRAGMA cache_size = -%llu; "
+	    "PRAGMA mmap_size = %llu",
+	    (unsigned long long)sbk_memory_budget / 1024,
+	    (unsigned long long)sbk_memory_budget);
+	if (sql == NULL) {
+		sbk_error_setx(ctx, "Cannot allocate memory");
+		return -1;
+	}
+
+	ret = 0;
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		sbk_error_sqlite_setd(ctx, db, "Cannot execute SQL statement");
+		ret = -1;
+	}
+
+	sqlite3_free(sql);
+	return ret;
+}
+
+static int
+sbk_open_disk_database(struct sbk_ctx *ctx)
+{
+	int fd;
+
+	if ((ctx->db_path = strdup(SBK_DISK_DATABASE_TEMPLATE)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	/* The file contains the decrypted database, so create it safely */
+	if ((fd = mkstemp(ctx->db_path)) == -1) {
+		sbk_error_set(ctx, "Cannot create temporary database");
+		free(ctx->db_path);
+		ctx->db_path = NULL;
+		return -1;
+	}
+
+	close(fd);
+
+	if (sbk_sqlite_open(ctx, &ctx->db, ctx->db_path) == -1)
+		return -1;
+
+	if (sbk_sqlite_exec(ctx, SBK_DISK_DATABASE_PRAGMAS) == -1)
+		return -1;
+
+	return sbk_limit_database_memory(ctx, ctx->db);
+}
+
+static void
+sbk_remove_disk_database(struct sbk_ctx *ctx)
+{
+	if (ctx->db_path != NULL) {
+		unlink(ctx->db_path);
+		free(ctx->db_path);
+		ctx->db_path = NULL;
+	}
+}
+
+int
+sbk_set_cache(struct sbk_ctx *ctx, const char *path)
+{
+	free(ctx->cache);
+
+	if ((ctx->cache = strdup(path)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+sbk_create_database(struct sbk_ctx *ctx)
+{
+	struct sbk_pipeline	*pl;
+	Signal__BackupFrame	*frm;
+	struct sbk_file		*file;
+	unsigned int		 types;
+	int			 ret;
+
+	if (ctx->db != NULL)
+		return 0;
+
+	pl = NULL;
+
+	if (ctx->cache != NULL)
+		switch (sbk_read_cache(ctx)) {
+		case -1:
+			return -1;
+		case 1:
+			return 0;
+		}
+
+	if (sbk_memory_budget > 0) {
+		if (sbk_open_disk_database(ctx) == -1)
+			goto error;
+	} else if (sbk_sqlite_open(ctx, &ctx->db, ":memory:") == -1)
+		goto error;
+
+	if (sbk_rewind(ctx) == -1)
+		goto error;
+
+	types = SBK_FRAME_VERSION | SBK_FRAME_STATEMENT;
+
+	/* Attachment frames belong to the rows of the part table */
+	if (sbk_is_needed_table(ctx, "part", 4)) {
+		/* With an index, attachment frames need not be decrypted */
+		if (ctx->index.state == SBK_INDEX_LOADED &&
+		    ctx->file_fn == NULL) {
+			if (sbk_insert_indexed_attachment_entries(ctx) == -1)
+				goto error;
+		} else
+			types |= SBK_FRAME_ATTACHMENT;
+	}
+
+	if (ctx->file_fn != NULL)
+		types |= SBK_FRAME_ATTACHMENT | SBK_FRAME_AVATAR |
+		    SBK_FRAME_STICKER;
+
+	if (sbk_sqlite_exec(ctx, "BEGIN TRANSACTION") == -1)
+		goto error;
+
+	/* Only use a reader thread if it can run in parallel */
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		if ((pl = malloc(sizeof *pl)) == NULL) {
+			sbk_error_set(ctx, NULL);
+			goto error;
+		}
+		if (sbk_pipeline_start(ctx, pl, types) == -1)
+			goto error;
+	}
+
+	ret = 0;
+
+	for (;;) {
+		if (pl != NULL) {
+			if (!sbk_pipeline_get(pl, &frm, &file))
+				break;
+		} else {
+			if ((frm = sbk_get_filtered_frame(ctx, &file, types)) ==
+			    NULL)
+				break;
+			if (sbk_pass_file(ctx, frm, file) == -1) {
+				sbk_free_file(file);
+				ret = -1;
+				break;
+			}
+		}
+
+		if (frm->version != NULL)
+			ret = sbk_set_database_version(ctx, frm->version);
+		else if (frm->statement != NULL)
+			ret = sbk_exec_statement(ctx, frm->statement);
+		else if (frm->attachment != NULL)
+			ret = sbk_insert_attachment_entry(ctx, frm, file);
+		else
+			sbk_free_file(file);
+
+		sbk_free_frame(frm);
+
+		if (ret == -1)
+			break;
+	}
+
+	if (pl != NULL) {
+		sbk_pipeline_finish(ctx, pl, ret == -1);
+		free(pl);
+		pl = NULL;
+	}
+
+	if (ret == -1 || !ctx->eof)
+		goto error;
+
+	if (sbk_sqlite_exec(ctx, "END TRANSACTION") == -1)
+		goto error;
+
+	if (ctx->cache != NULL) {
+		if (sbk_create_query_indexes(ctx) == -1)
+			goto error;
+		if (sbk_create_thread_indexes(ctx) == -1)
+			goto error;
+		if (ctx->db_search && sbk_create_search_index(ctx) == -1)
+			goto error;
+		if (sbk_write_cache(ctx) == -1)
+			goto error;
+	}
+
+	sbk_free_statement_tree(ctx);
+	return 0;
+
+error:
+	free(pl);
+	sbk_free_statement_tree(ctx);
+	sbk_free_attachment_tree(ctx);
+	sqlite3_close(ctx->db);
+	ctx->db = NULL;
+	sbk_remove_disk_database(ctx);
+	ctx->db_indexed = 0;
+	ctx->db_marked = 0;
+	return -1;
+}
+
+/*
+ * Create the database in a single pass over the backup and pass every
+ * attachment, avatar and sticker to fn as soon as its frame has been read, so
+ * that fn can write the file data while it is still near the read position.
+ * The file remains owned by the caller of fn. If a reader thread is used, fn
+ * is called from that thread with a private copy of ctx. If fn returns -1,
+ * the database is not created.
+ */
+int
+sbk_extract(struct sbk_ctx *ctx, int (*fn)(struct sbk_ctx *,
+    Signal__BackupFrame *, struct sbk_file *, void *), void *arg)
+{
+	int ret;
+
+	if (ctx->db != NULL) {
+		sbk_error_setx(ctx, "Database already created");
+		return -1;
+	}
+
+	/* A cache holds the database, but not the files */
+	if (ctx->cache != NULL) {
+		sbk_error_setx(ctx, "Cannot extract files with a cache");
+		return -1;
+	}
+
+	ctx->file_fn = fn;
+	ctx->file_arg = arg;
+	ret = sbk_create_database(ctx);
+	ctx->file_fn = NULL;
+	ctx->file_arg = NULL;
+	return ret;
+}
+
+int
+sbk_write_database(struct sbk_ctx *ctx, const char *path)
+{
+	sqlite3		*db;
+	sqlite3_backup	*bak;
+
+	if (sbk_create_database(ctx) == -1)
+		return -1;
+
+	if (sbk_sqlite_open(ctx, &db, path) == -1)
+		goto error;
+
+	if ((bak = sqlite3_backup_init(db, "main", ctx->db, "main")) == NULL) {
+		sbk_error_sqlite_setd(ctx, db, "Cannot write database");
+		goto error;
+	}
+
+	if (sqlite3_backup_step(bak, -1) != SQLITE_DONE) {
+		sbk_error_sqlite_setd(ctx, db, "Cannot write database");
+		sqlite3_backup_finish(bak);
+		goto error;
+	}
+
+	sqlite3_backup_finish(bak);
+
+	if (sqlite3_close(db) != SQLITE_OK) {
+		sbk_error_sqlite_setd(ctx, db, "Cannot close database");
+		return -1;
+	}
+
+	return 0;
+
+error:
+	sqlite3_close(db);
+	return -1;
+}
+
+/* FNV-1a for string ids, a multiplicative hash for integer ids */
+static uint32_t
+sbk_hash_recipient_id(const char *old, int new)
+{
+	uint32_t h;
+
+	if (old != NULL) {
+		h = 2166136261U;
+		while (*old != '\0')
+			h = (h ^ (unsigned char)*old++) * 16777619U;
+	} else {
+		h = (uint32_t)new * 2654435761U;
+		h ^= h >> 16;
+	}
+
+	return h;
+}
+
+static int
+sbk_recipient_id_equal(const struct sbk_recipient_entry *ent,
+    const char *old, int new)
+{
+	if (old != NULL)
+		return ent->id.old != NULL && strcmp(ent->id.old, old) == 0;
+	else
+		return ent->id.old == NULL && ent->id.new == new;
+}
+
+static int
+sbk_get_recipient_id_from_column(struct sbk_ctx *ctx,
+    struct sbk_recipient_id *id, sqlite3_stmt *stm, int idx)
+{
+	if (ctx->db_version < SBK_DB_VERSION_RECIPIENT_IDS) {
+		id->new = -1;
+		if (sbk_sqlite_column_text_copy(ctx, &id->old, stm, idx) == -1)
+			return -1;
+		if (id->old == NULL) {
+			sbk_error_setx(ctx, "Invalid recipient id");
+			return -1;
+		}
+	} else {
+		id->new = sqlite3_column_int(stm, idx);
+		id->old = NULL;
+	}
+
+	return 0;
+}
+
+static void
+sbk_free_recipient_entry(struct sbk_recipient_entry *ent)
+{
+	switch (ent->recipient.type) {
+	case SBK_CONTACT:
+		free(ent->recipient.contact->phone);
+		free(ent->recipient.contact->email);
+		free(ent->recipient.contact->system_display_name);
+		free(ent->recipient.contact->system_phone_label);
+		free(ent->recipient.contact->profile_name);
+		free(ent->recipient.contact->profile_family_name);
+		free(ent->recipient.contact->profile_joined_name);
+		free(ent->recipient.contact);
+		break;
+	case SBK_GROUP:
+		free(ent->recipient.group->name);
+		free(ent->recipient.group);
+		break;
+	}
+
+	free(ent->id.old);
+}
+
+static void
+sbk_free_recipient_table(struct sbk_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->recipients.nentries; i++)
+		sbk_free_recipient_entry(&ctx->recipients.entries[i]);
+
+	free(ctx->recipients.entries);
+	free(ctx->recipients.slots);
+	ctx->recipients.entries = NULL;
+	ctx->recipients.nentries = 0;
+	ctx->recipients.slots = NULL;
+	ctx->recipients.nslots = 0;
 }
 
 /* For database versions < SBK_DB_VERSION_RECIPIENT_IDS */
@@ -1159,21 +3378,45 @@ sbk_free_recipient_tree(struct sbk_ctx *ctx)
 	"LEFT JOIN groups AS g "					\
 	"ON r._id = g.recipient_id"
 
-static struct sbk_recipient_entry *
-sbk_get_recipient_entry(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+static const char *
+sbk_resolve_display_name(const struct sbk_recipient *rcp)
+{
+	switch (rcp->type) {
+	case SBK_CONTACT:
+		if (rcp->contact->system_display_name != NULL)
+			return rcp->contact->system_display_name;
+		if (rcp->contact->profile_joined_name != NULL)
+			return rcp->contact->profile_joined_name;
+		if (rcp->contact->profile_name != NULL)
+			return rcp->contact->profile_name;
+		if (rcp->contact->phone != NULL)
+			return rcp->contact->phone;
+		if (rcp->contact->email != NULL)
+			return rcp->contact->email;
+		break;
+	case SBK_GROUP:
+		if (rcp->group->name != NULL)
+			return rcp->group->name;
+		break;
+	}
+
+	return "Unknown";
+}
+
+static int
+sbk_get_recipient_entry(struct sbk_ctx *ctx, sqlite3_stmt *stm,
+    struct sbk_recipient_entry *ent)
 {
-	struct sbk_recipient_entry	*ent;
 	struct sbk_contact		*con;
 	struct sbk_group		*grp;
 
-	if ((ent = calloc(1, sizeof *ent)) == NULL) {
-		sbk_error_set(ctx, NULL);
-		return NULL;
-	}
+	memset(ent, 0, sizeof *ent);
 
 	if (sbk_get_recipient_id_from_column(ctx, &ent->id, stm, 0) == -1)
 		goto error;
 
+	ent->hash = sbk_hash_recipient_id(ent->id.old, ent->id.new);
+
 	if (sqlite3_column_type(stm, 8) == SQLITE_NULL)
 		ent->recipient.type = SBK_CONTACT;
 	else
@@ -1246,22 +3489,90 @@ sbk_get_recipient_entry(struct sbk_ctx *ctx, sqlite3_stmt *stm)
 		break;
 	}
 
-	return ent;
+	ent->recipient.display_name =
+	    sbk_resolve_display_name(&ent->recipient);
+	ent->recipient.display_namelen = strlen(ent->recipient.display_name);
+	return 0;
 
 error:
 	sbk_free_recipient_entry(ent);
+	return -1;
+}
+
+static struct sbk_recipient_entry *
+sbk_find_recipient_entry(struct sbk_recipient_table *tab, const char *old,
+    int new)
+{
+	struct sbk_recipient_entry	*ent;
+	size_t				 i, mask;
+	uint32_t			 hash;
+
+	if (tab->nslots == 0)
+		return NULL;
+
+	hash = sbk_hash_recipient_id(old, new);
+	mask = tab->nslots - 1;
+
+	for (i = hash & mask; tab->slots[i] != 0; i = (i + 1) & mask) {
+		ent = &tab->entries[tab->slots[i] - 1];
+		if (ent->hash == hash && sbk_recipient_id_equal(ent, old, new))
+			return ent;
+	}
+
 	return NULL;
 }
 
+/* Index the entries; if an id occurs more than once, the first one is used */
 static int
-sbk_build_recipient_tree(struct sbk_ctx *ctx)
+sbk_index_recipient_table(struct sbk_ctx *ctx,
+    struct sbk_recipient_table *tab)
 {
 	struct sbk_recipient_entry	*ent;
+	size_t				 i, j, mask;
+
+	if (tab->nentries >= UINT32_MAX / 2) {
+		sbk_error_setx(ctx, "Too many recipients");
+		return -1;
+	}
+
+	for (tab->nslots = 16; tab->nslots < 2 * tab->nentries; )
+		tab->nslots *= 2;
+
+	if ((tab->slots = calloc(tab->nslots, sizeof *tab->slots)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		tab->nslots = 0;
+		return -1;
+	}
+
+	mask = tab->nslots - 1;
+
+	for (i = 0; i < tab->nentries; i++) {
+		ent = &tab->entries[i];
+		if (sbk_find_recipient_entry(tab, ent->id.old, ent->id.new) !=
+		    NULL)
+			continue;
+		for (j = ent->hash & mask; tab->slots[j] != 0;
+		    j = (j + 1) & mask)
+			continue;
+		tab->slots[j] = i + 1;
+	}
+
+	return 0;
+}
+
+static int
+sbk_build_recipient_table(struct sbk_ctx *ctx)
+{
+	struct sbk_recipient_table	*tab;
+	struct sbk_recipient_entry	*newentries;
 	sqlite3_stmt			*stm;
 	const char			*query;
+	size_t				 size;
 	int				 ret;
 
-	if (!RB_EMPTY(&ctx->recipients))
+	tab = &ctx->recipients;
+
+	if (tab->slots != NULL)
 		return 0;
 
 	if (sbk_create_database(ctx) == -1)
@@ -1277,34 +3588,155 @@ sbk_build_recipient_tree(struct sbk_ctx *ctx)
 	if (sbk_sqlite_prepare(ctx, &stm, query) == -1)
 		return -1;
 
+	size = 0;
+
 	while ((ret = sbk_sqlite_step(ctx, stm)) == SQLITE_ROW) {
-		if ((ent = sbk_get_recipient_entry(ctx, stm)) == NULL)
+		if (tab->nentries == size) {
+			newentries = reallocarray(tab->entries,
+			    (size > 0) ? 2 * size : 64, sizeof *tab->entries);
+			if (newentries == NULL) {
+				sbk_error_set(ctx, NULL);
+				goto error;
+			}
+			tab->entries = newentries;
+			size = (size > 0) ? 2 * size : 64;
+		}
+
+		if (sbk_get_recipient_entry(ctx, stm,
+		    &tab->entries[tab->nentries]) == -1)
 			goto error;
-		RB_INSERT(sbk_recipient_tree, &ctx->recipients, ent);
+
+		tab->nentries++;
 	}
 
 	if (ret != SQLITE_DONE)
 		goto error;
 
+	if (sbk_index_recipient_table(ctx, tab) == -1)
+		goto error;
+
 	sqlite3_finalize(stm);
 	return 0;
 
 error:
-	sbk_free_recipient_tree(ctx);
+	sbk_free_recipient_table(ctx);
 	sqlite3_finalize(stm);
 	return -1;
 }
 
+/* Open the database file of ctx again, read-only */
+static int
+sbk_reopen_database(struct sbk_ctx *clone, const char *path)
+{
+	if (sqlite3_open_v2(path, &clone->db, SQLITE_OPEN_READONLY, NULL) !=
+	    SQLITE_OK) {
+		sbk_error_sqlite_setd(clone, clone->db, "Cannot open database");
+		goto error;
+	}
+
+	if (sbk_memory_budget != 0 &&
+	    sbk_limit_database_memory(clone, clone->db) == -1)
+		goto error;
+
+	return 0;
+
+error:
+	sqlite3_close(clone->db);
+	clone->db = NULL;
+	return -1;
+}
+
+/* Deserialise the in-memory database of ctx, serialising it first if needed */
+static int
+sbk_deserialise_database(struct sbk_ctx *clone, struct sbk_ctx *ctx)
+{
+	if (ctx->db_image == NULL) {
+		ctx->db_image = sqlite3_serialize(ctx->db, "main",
+		    &ctx->db_imagesize, 0);
+		if (ctx->db_image == NULL) {
+			sbk_error_setx(clone, "Cannot serialise database");
+			return -1;
+		}
+	}
+
+	if (sbk_sqlite_open(clone, &clone->db, ":memory:") == -1)
+		return -1;
+
+	if (sqlite3_deserialize(clone->db, "main", ctx->db_image,
+	    ctx->db_imagesize, ctx->db_imagesize,
+	    SQLITE_DESERIALIZE_READONLY) != SQLITE_OK) {
+		sbk_error_sqlite_setd(clone, clone->db,
+		    "Cannot deserialise database");
+		sqlite3_close(clone->db);
+		clone->db = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Give clone, a context for the same backup, its own read-only connection to
+ * the database of ctx, so that both can be queried in parallel. A database in
+ * a temporary file or a cache is opened again; otherwise the database is
+ * serialised once and every clone reads from the same copy. The recipient
+ * table and attachment tree of ctx are completed first and then shared with
+ * clone; they are not modified afterwards. Since clones usually query one
+ * thread at a time, the sms and mms tables are indexed by thread first; a
+ * cache has these indexes already. The clone must be closed before ctx. On
+ * error, the error is set in clone.
+ */
+int
+sbk_share_database(struct sbk_ctx *clone, struct sbk_ctx *ctx)
+{
+	int cached, ret;
+
+	if (clone->db != NULL) {
+		sbk_error_setx(clone, "Database already created");
+		return -1;
+	}
+
+	if (sbk_build_recipient_table(ctx) == -1) {
+		sbk_error_setx(clone, "%s", sbk_error(ctx));
+		return -1;
+	}
+
+	/* A database read from a cache is the read-only cache itself */
+	cached = (sqlite3_db_readonly(ctx->db, "main") == 1);
+
+	if (!cached && (sbk_create_query_indexes(ctx) == -1 ||
+	    (ctx->db_image == NULL && sbk_create_thread_indexes(ctx) == -1))) {
+		sbk_error_setx(clone, "%s", sbk_error(ctx));
+		return -1;
+	}
+
+	if (ctx->db_path != NULL)
+		ret = sbk_reopen_database(clone, ctx->db_path);
+	else if (cached)
+		ret = sbk_reopen_database(clone, ctx->cache);
+	else
+		ret = sbk_deserialise_database(clone, ctx);
+
+	if (ret == -1)
+		return -1;
+
+	clone->db_version = ctx->db_version;
+	clone->db_indexed = 1;
+	clone->db_shared = 1;
+	clone->recipients = ctx->recipients;
+	clone->attachments = ctx->attachments;
+	return 0;
+}
+
 static struct sbk_recipient *
 sbk_get_recipient(struct sbk_ctx *ctx, struct sbk_recipient_id *id)
 {
-	struct sbk_recipient_entry find, *result;
+	struct sbk_recipient_entry *result;
 
-	if (sbk_build_recipient_tree(ctx) == -1)
+	if (sbk_build_recipient_table(ctx) == -1)
 		return NULL;
 
-	find.id = *id;
-	result = RB_FIND(sbk_recipient_tree, &ctx->recipients, &find);
+	result = sbk_find_recipient_entry(&ctx->recipients, id->old, id->new);
 
 	if (result == NULL) {
 		sbk_error_setx(ctx, "Cannot find recipient");
@@ -1318,40 +3750,31 @@ static struct sbk_recipient *
 sbk_get_recipient_from_column(struct sbk_ctx *ctx, sqlite3_stmt *stm,
     int idx)
 {
-	struct sbk_recipient	*rcp;
-	struct sbk_recipient_id	 id;
+	struct sbk_recipient_id id;
 
-	if (sbk_get_recipient_id_from_column(ctx, &id, stm, idx) == -1)
-		return NULL;
+	/* Look up string ids in place rather than copy them */
+	if (ctx->db_version < SBK_DB_VERSION_RECIPIENT_IDS) {
+		if (sqlite3_column_type(stm, idx) == SQLITE_NULL) {
+			sbk_error_setx(ctx, "Invalid recipient id");
+			return NULL;
+		}
+		if ((id.old = (char *)sqlite3_column_text(stm, idx)) == NULL) {
+			sbk_error_sqlite_set(ctx, "Cannot get column text");
+			return NULL;
+		}
+		id.new = -1;
+	} else {
+		id.new = sqlite3_column_int(stm, idx);
+		id.old = NULL;
+	}
 
-	rcp = sbk_get_recipient(ctx, &id);
-	free(id.old);
-	return rcp;
+	return sbk_get_recipient(ctx, &id);
 }
 
 const char *
 sbk_get_recipient_display_name(const struct sbk_recipient *rcp)
 {
-	switch (rcp->type) {
-	case SBK_CONTACT:
-		if (rcp->contact->system_display_name != NULL)
-			return rcp->contact->system_display_name;
-		if (rcp->contact->profile_joined_name != NULL)
-			return rcp->contact->profile_joined_name;
-		if (rcp->contact->profile_name != NULL)
-			return rcp->contact->profile_name;
-		if (rcp->contact->phone != NULL)
-			return rcp->contact->phone;
-		if (rcp->contact->email != NULL)
-			return rcp->contact->email;
-		break;
-	case SBK_GROUP:
-		if (rcp->group->name != NULL)
-			return rcp->group->name;
-		break;
-	}
-
-	return "Unknown";
+	return rcp->display_name;
 }
 
 static void
@@ -1410,23 +3833,23 @@ sbk_free_attachment_list(struct sbk_attachment_list *lst)
 	SBK_ATTACHMENTS_ORDER
 
 static struct sbk_attachment *
-sbk_get_attachment(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+sbk_get_attachment(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    sqlite3_stmt *stm)
 {
 	struct sbk_attachment *att;
 
-	if ((att = malloc(sizeof *att)) == NULL) {
-		sbk_error_set(ctx, NULL);
+	if ((att = sbk_arena_alloc(ctx, arena, sizeof *att)) == NULL)
 		return NULL;
-	}
 
 	att->filename = NULL;
 	att->content_type = NULL;
 	att->file = NULL;
 
-	if (sbk_sqlite_column_text_copy(ctx, &att->filename, stm, 0) == -1)
+	if (sbk_arena_column_text(ctx, arena, &att->filename, stm, 0) == -1)
 		goto error;
 
-	if (sbk_sqlite_column_text_copy(ctx, &att->content_type, stm, 1) == -1)
+	if (sbk_arena_column_text(ctx, arena, &att->content_type, stm, 1) ==
+	    -1)
 		goto error;
 
 	att->rowid = sqlite3_column_int64(stm, 2);
@@ -1450,26 +3873,31 @@ sbk_get_attachment(struct sbk_ctx *ctx, sqlite3_stmt *stm)
 	return att;
 
 error:
-	sbk_free_attachment(att);
+	if (arena == NULL)
+		sbk_free_attachment(att);
 	return NULL;
 }
 
+/* Without an arena, the list must be freed with sbk_free_attachment_list() */
 static struct sbk_attachment_list *
-sbk_get_attachments(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+sbk_get_attachments(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    sqlite3_stmt *stm)
 {
 	struct sbk_attachment_list	*lst;
 	struct sbk_attachment		*att;
+	uint64_t			 start;
 	int				 ret;
 
-	if ((lst = malloc(sizeof *lst)) == NULL) {
-		sbk_error_set(ctx, NULL);
-		goto error;
-	}
+	if ((lst = sbk_arena_alloc(ctx, arena, sizeof *lst)) == NULL)
+		return NULL;
 
 	TAILQ_INIT(lst);
 
+	/* Messages account for the attachments they contain themselves */
+	start = (arena == NULL) ? sbk_stats_clock() : 0;
+
 	while ((ret = sbk_sqlite_step(ctx, stm)) == SQLITE_ROW) {
-		if ((att = sbk_get_attachment(ctx, stm)) == NULL)
+		if ((att = sbk_get_attachment(ctx, arena, stm)) == NULL)
 			goto error;
 		TAILQ_INSERT_TAIL(lst, att, entries);
 	}
@@ -1477,19 +3905,22 @@ sbk_get_attachments(struct sbk_ctx *ctx, sqlite3_stmt *stm)
 	if (ret != SQLITE_DONE)
 		goto error;
 
-	sqlite3_finalize(stm);
+	if (arena == NULL)
+		sbk_stats_add_time(&ctx->stats.query_time, start);
+
 	return lst;
 
 error:
-	sbk_free_attachment_list(lst);
-	sqlite3_finalize(stm);
+	if (arena == NULL)
+		sbk_free_attachment_list(lst);
 	return NULL;
 }
 
 struct sbk_attachment_list *
 sbk_get_all_attachments(struct sbk_ctx *ctx)
 {
-	sqlite3_stmt *stm;
+	struct sbk_attachment_list	*lst;
+	sqlite3_stmt			*stm;
 
 	if (sbk_create_database(ctx) == -1)
 		return NULL;
@@ -1497,13 +3928,16 @@ sbk_get_all_attachments(struct sbk_ctx *ctx)
 	if (sbk_sqlite_prepare(ctx, &stm, SBK_ATTACHMENTS_QUERY_ALL) == -1)
 		return NULL;
 
-	return sbk_get_attachments(ctx, stm);
+	lst = sbk_get_attachments(ctx, NULL, stm);
+	sqlite3_finalize(stm);
+	return lst;
 }
 
 struct sbk_attachment_list *
 sbk_get_attachments_for_thread(struct sbk_ctx *ctx, int thread_id)
 {
-	sqlite3_stmt *stm;
+	struct sbk_attachment_list	*lst;
+	sqlite3_stmt			*stm;
 
 	if (sbk_create_database(ctx) == -1)
 		return NULL;
@@ -1516,41 +3950,81 @@ sbk_get_attachments_for_thread(struct sbk_ctx *ctx, int thread_id)
 		return NULL;
 	}
 
-	return sbk_get_attachments(ctx, stm);
+	lst = sbk_get_attachments(ctx, NULL, stm);
+	sqlite3_finalize(stm);
+	return lst;
 }
 
 static int
-sbk_get_attachments_for_message(struct sbk_ctx *ctx, struct sbk_message *msg,
-    int mms_id)
+sbk_cmp_attachment_positions(const void *a, const void *b)
 {
-	sqlite3_stmt *stm;
+	const struct sbk_attachment *x, *y;
 
-	if (sbk_sqlite_prepare(ctx, &stm, SBK_ATTACHMENTS_QUERY_MESSAGE) == -1)
-		return -1;
+	x = *(struct sbk_attachment * const *)a;
+	y = *(struct sbk_attachment * const *)b;
 
-	if (sbk_sqlite_bind_int(ctx, stm, 1, mms_id) == -1) {
-		sqlite3_finalize(stm);
+	/* Attachments without a file go last */
+	if (x->file == NULL || y->file == NULL)
+		return (x->file == NULL) - (y->file == NULL);
+
+	return (x->file->pos < y->file->pos) ? -1 :
+	    (x->file->pos > y->file->pos);
+}
+
+/* Sort the attachments by their position in the backup */
+int
+sbk_sort_attachments(struct sbk_ctx *ctx, struct sbk_attachment_list *lst)
+{
+	struct sbk_attachment	**atts, *att;
+	size_t			  i, n;
+
+	n = 0;
+	TAILQ_FOREACH(att, lst, entries)
+		n++;
+
+	if (n < 2)
+		return 0;
+
+	if ((atts = reallocarray(NULL, n, sizeof *atts)) == NULL) {
+		sbk_error_set(ctx, NULL);
 		return -1;
 	}
 
-	if ((msg->attachments = sbk_get_attachments(ctx, stm)) == NULL)
-		return -1;
+	i = 0;
+	while ((att = TAILQ_FIRST(lst)) != NULL) {
+		TAILQ_REMOVE(lst, att, entries);
+		atts[i++] = att;
+	}
 
+	qsort(atts, n, sizeof *atts, sbk_cmp_attachment_positions);
+
+	for (i = 0; i < n; i++)
+		TAILQ_INSERT_TAIL(lst, atts[i], entries);
+
+	free(atts);
 	return 0;
 }
 
-static void
-sbk_free_mention_list(struct sbk_mention_list *lst)
+static int
+sbk_get_attachments_for_message(struct sbk_ctx *ctx, struct sbk_message *msg,
+    int mms_id)
 {
-	struct sbk_mention *mnt;
+	sqlite3_stmt *stm;
 
-	if (lst != NULL) {
-		while ((mnt = SIMPLEQ_FIRST(lst)) != NULL) {
-			SIMPLEQ_REMOVE_HEAD(lst, entries);
-			free(mnt);
-		}
-		free(lst);
+	/* This query is run for every message, so keep it prepared */
+	if ((stm = sbk_get_cached_statement(ctx,
+	    SBK_ATTACHMENTS_QUERY_MESSAGE)) == NULL)
+		return -1;
+
+	if (sbk_sqlite_bind_int(ctx, stm, 1, mms_id) == -1) {
+		sbk_reset_cached_statement(stm);
+		return -1;
 	}
+
+	msg->attachments = sbk_get_attachments(ctx, msg->arena, stm);
+	sbk_reset_cached_statement(stm);
+
+	return (msg->attachments != NULL) ? 0 : -1;
 }
 
 #define SBK_MENTIONS_QUERY						\
@@ -1561,54 +4035,44 @@ sbk_free_mention_list(struct sbk_mention_list *lst)
 	"ORDER BY range_start"
 
 static struct sbk_mention *
-sbk_get_mention(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+sbk_get_mention(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    sqlite3_stmt *stm)
 {
 	struct sbk_mention *mnt;
 
-	if ((mnt = malloc(sizeof *mnt)) == NULL) {
-		sbk_error_set(ctx, NULL);
+	if ((mnt = sbk_arena_alloc(ctx, arena, sizeof *mnt)) == NULL)
 		return NULL;
-	}
 
 	mnt->recipient = sbk_get_recipient_from_column(ctx, stm, 0);
-	if (mnt->recipient == NULL) {
-		free(mnt);
+	if (mnt->recipient == NULL)
 		return NULL;
-	}
 
 	return mnt;
 }
 
 static struct sbk_mention_list *
-sbk_get_mentions(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+sbk_get_mentions(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    sqlite3_stmt *stm)
 {
 	struct sbk_mention_list	*lst;
 	struct sbk_mention	*mnt;
 	int			 ret;
 
-	if ((lst = malloc(sizeof *lst)) == NULL) {
-		sbk_error_set(ctx, NULL);
-		goto error;
-	}
+	if ((lst = sbk_arena_alloc(ctx, arena, sizeof *lst)) == NULL)
+		return NULL;
 
 	SIMPLEQ_INIT(lst);
 
 	while ((ret = sbk_sqlite_step(ctx, stm)) == SQLITE_ROW) {
-		if ((mnt = sbk_get_mention(ctx, stm)) == NULL)
-			goto error;
+		if ((mnt = sbk_get_mention(ctx, arena, stm)) == NULL)
+			return NULL;
 		SIMPLEQ_INSERT_TAIL(lst, mnt, entries);
 	}
 
 	if (ret != SQLITE_DONE)
-		goto error;
+		return NULL;
 
-	sqlite3_finalize(stm);
 	return lst;
-
-error:
-	sbk_free_mention_list(lst);
-	sqlite3_finalize(stm);
-	return NULL;
 }
 
 static int
@@ -1620,18 +4084,18 @@ sbk_get_mentions_for_message(struct sbk_ctx *ctx, struct sbk_message *msg,
 	if (ctx->db_version < SBK_DB_VERSION_MENTIONS)
 		return 0;
 
-	if (sbk_sqlite_prepare(ctx, &stm, SBK_MENTIONS_QUERY) == -1)
+	if ((stm = sbk_get_cached_statement(ctx, SBK_MENTIONS_QUERY)) == NULL)
 		return -1;
 
 	if (sbk_sqlite_bind_int(ctx, stm, 1, mms_id) == -1) {
-		sqlite3_finalize(stm);
+		sbk_reset_cached_statement(stm);
 		return -1;
 	}
 
-	if ((msg->mentions = sbk_get_mentions(ctx, stm)) == NULL)
-		return -1;
+	msg->mentions = sbk_get_mentions(ctx, msg->arena, stm);
+	sbk_reset_cached_statement(stm);
 
-	return 0;
+	return (msg->mentions != NULL) ? 0 : -1;
 }
 
 static int
@@ -1639,7 +4103,6 @@ sbk_insert_mentions(struct sbk_ctx *ctx, struct sbk_message *msg, int mms_id)
 {
 	struct sbk_mention *mnt;
 	char		*newtext, *newtextpos, *placeholderpos, *textpos;
-	const char	*name;
 	size_t		 copylen, newtextlen, placeholderlen, prefixlen;
 
 	if (sbk_get_mentions_for_message(ctx, msg, mms_id) == -1)
@@ -1648,7 +4111,6 @@ sbk_insert_mentions(struct sbk_ctx *ctx, struct sbk_message *msg, int mms_id)
 	if (msg->mentions == NULL || SIMPLEQ_EMPTY(msg->mentions))
 		return 0;
 
-	newtext = NULL;
 	placeholderlen = strlen(SBK_MENTION_PLACEHOLDER);
 	prefixlen = strlen(SBK_MENTION_PREFIX);
 
@@ -1657,16 +4119,14 @@ sbk_insert_mentions(struct sbk_ctx *ctx, struct sbk_message *msg, int mms_id)
 	SIMPLEQ_FOREACH(mnt, msg->mentions, entries) {
 		if (newtextlen < placeholderlen)
 			goto error;
-		name = sbk_get_recipient_display_name(mnt->recipient);
 		/* Subtract placeholder, add mention */
 		newtextlen = newtextlen - placeholderlen + prefixlen +
-		    strlen(name);
+		    mnt->recipient->display_namelen;
 	}
 
-	if ((newtext = malloc(newtextlen + 1)) == NULL) {
-		sbk_error_set(ctx, NULL);
+	if ((newtext = sbk_arena_alloc(ctx, msg->arena, newtextlen + 1)) ==
+	    NULL)
 		return -1;
-	}
 
 	textpos = msg->text;
 	newtextpos = newtext;
@@ -1685,9 +4145,8 @@ sbk_insert_mentions(struct sbk_ctx *ctx, struct sbk_message *msg, int mms_id)
 		memcpy(newtextpos, SBK_MENTION_PREFIX, prefixlen);
 		newtextpos += prefixlen;
 
-		name = sbk_get_recipient_display_name(mnt->recipient);
-		copylen = strlen(name);
-		memcpy(newtextpos, name, copylen);
+		copylen = mnt->recipient->display_namelen;
+		memcpy(newtextpos, mnt->recipient->display_name, copylen);
 		newtextpos += copylen;
 	}
 
@@ -1700,14 +4159,11 @@ sbk_insert_mentions(struct sbk_ctx *ctx, struct sbk_message *msg, int mms_id)
 	newtextpos += copylen;
 	*newtextpos = '\0';
 
-	free(msg->text);
 	msg->text = newtext;
-
 	return 0;
 
 error:
 	sbk_error_setx(ctx, "Invalid mention in message");
-	free(newtext);
 	return -1;
 }
 
@@ -1748,24 +4204,9 @@ sbk_free_reaction_list_message(Signal__ReactionList *msg)
 		signal__reaction_list__free_unpacked(msg, NULL);
 }
 
-static void
-sbk_free_reaction_list(struct sbk_reaction_list *lst)
-{
-	struct sbk_reaction *rct;
-
-	if (lst != NULL) {
-		while ((rct = SIMPLEQ_FIRST(lst)) != NULL) {
-			SIMPLEQ_REMOVE_HEAD(lst, entries);
-			free(rct->emoji);
-			free(rct);
-		}
-		free(lst);
-	}
-}
-
 static int
-sbk_get_reactions(struct sbk_ctx *ctx, struct sbk_reaction_list **lst,
-    sqlite3_stmt *stm, int idx)
+sbk_get_reactions(struct sbk_ctx *ctx, struct sbk_arena *arena,
+    struct sbk_reaction_list **lst, sqlite3_stmt *stm, int idx)
 {
 	struct sbk_reaction	*rct;
 	struct sbk_recipient_id	 id;
@@ -1794,29 +4235,24 @@ sbk_get_reactions(struct sbk_ctx *ctx, struct sbk_reaction_list **lst,
 	if ((msg = sbk_unpack_reaction_list_message(ctx, blob, len)) == NULL)
 		return -1;
 
-	if ((*lst = malloc(sizeof **lst)) == NULL) {
-		sbk_error_set(ctx, NULL);
-		goto error1;
-	}
+	if ((*lst = sbk_arena_alloc(ctx, arena, sizeof **lst)) == NULL)
+		goto error;
 
 	SIMPLEQ_INIT(*lst);
 
 	for (i = 0; i < msg->n_reactions; i++) {
-		if ((rct = malloc(sizeof *rct)) == NULL) {
-			sbk_error_set(ctx, NULL);
-			goto error1;
-		}
+		if ((rct = sbk_arena_alloc(ctx, arena, sizeof *rct)) == NULL)
+			goto error;
 
 		id.new = msg->reactions[i]->author;
 		id.old = NULL;
 
 		if ((rct->recipient = sbk_get_recipient(ctx, &id)) == NULL)
-			goto error2;
+			goto error;
 
-		if ((rct->emoji = strdup(msg->reactions[i]->emoji)) == NULL) {
-			sbk_error_set(ctx, NULL);
-			goto error2;
-		}
+		if ((rct->emoji = sbk_arena_strdup(ctx, arena,
+		    msg->reactions[i]->emoji)) == NULL)
+			goto error;
 
 		rct->time_sent = msg->reactions[i]->senttime;
 		rct->time_recv = msg->reactions[i]->receivedtime;
@@ -1826,20 +4262,17 @@ sbk_get_reactions(struct sbk_ctx *ctx, struct sbk_reaction_list **lst,
 	sbk_free_reaction_list_message(msg);
 	return 0;
 
-error2:
-	free(rct);
-
-error1:
-	sbk_free_reaction_list(*lst);
+error:
 	sbk_free_reaction_list_message(msg);
 	*lst = NULL;
 	return -1;
 }
 
 static int
-sbk_get_body(struct sbk_message *msg)
+sbk_get_body(struct sbk_ctx *ctx, struct sbk_message *msg)
 {
-	const char *fmt;
+	const char	*fmt, *name;
+	int		 len;
 
 	fmt = NULL;
 
@@ -1928,14 +4361,17 @@ sbk_get_body(struct sbk_message *msg)
 	if (fmt == NULL)
 		return 0;
 
-	free(msg->text);
+	name = sbk_get_recipient_display_name(msg->recipient);
+
+	if ((len = snprintf(NULL, 0, fmt, name)) < 0) {
+		sbk_error_setx(ctx, "snprintf() failed");
+		return -1;
+	}
 
-	if (asprintf(&msg->text, fmt,
-	    sbk_get_recipient_display_name(msg->recipient)) == -1) {
-		msg->text = NULL;
+	if ((msg->text = sbk_arena_alloc(ctx, msg->arena, len + 1)) == NULL)
 		return -1;
-	}
 
+	snprintf(msg->text, len + 1, fmt, name);
 	return 0;
 }
 
@@ -1969,24 +4405,23 @@ sbk_get_long_message(struct sbk_ctx *ctx, struct sbk_message *msg)
 	if ((longmsg = sbk_get_file_as_string(ctx, att->file)) == NULL)
 		return -1;
 
-	free(msg->text);
-	msg->text = longmsg;
+	msg->text = sbk_arena_strdup(ctx, msg->arena, longmsg);
+	free(longmsg);
+
+	if (msg->text == NULL)
+		return -1;
 
 	/* Do not expose the long-message attachment */
 	TAILQ_REMOVE(msg->attachments, att, entries);
-	sbk_free_attachment(att);
 
 	return 0;
 }
 
-static void
+void
 sbk_free_message(struct sbk_message *msg)
 {
-	free(msg->text);
-	sbk_free_attachment_list(msg->attachments);
-	sbk_free_mention_list(msg->mentions);
-	sbk_free_reaction_list(msg->reactions);
-	free(msg);
+	if (msg != NULL)
+		sbk_arena_free(msg->arena);
 }
 
 void
@@ -2014,7 +4449,8 @@ sbk_free_message_list(struct sbk_message_list *lst)
 	"thread_id, "							\
 	"0, "				/* part_count */		\
 	"-1, "				/* mms _id */			\
-	"NULL "				/* reactions */			\
+	"NULL, "			/* reactions */			\
+	"_id "				/* search index id */		\
 	"FROM sms "
 
 /* For database versions >= SBK_DB_VERSION_REACTIONS */
@@ -2028,140 +4464,628 @@ sbk_free_message_list(struct sbk_message_list *lst)
 	"thread_id, "							\
 	"0, "				/* part_count */		\
 	"-1, "				/* mms _id */			\
-	"reactions "							\
+	"reactions, "							\
+	"_id "				/* search index id */		\
 	"FROM sms "
 
-/* For database versions < SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_SELECT_MMS_1					\
-	"SELECT "							\
-	"address, "							\
-	"body, "							\
-	"date, "			/* date_sent */			\
-	"date_received, "						\
-	"msg_box, "			/* type */			\
-	"thread_id, "							\
-	"part_count, "							\
-	"_id, "								\
-	"NULL "				/* reactions */			\
-	"FROM mms "
+/* For database versions < SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_SELECT_MMS_1					\
+	"SELECT "							\
+	"address, "							\
+	"body, "							\
+	"date, "			/* date_sent */			\
+	"date_received, "						\
+	"msg_box, "			/* type */			\
+	"thread_id, "							\
+	"part_count, "							\
+	"_id, "								\
+	"NULL, "			/* reactions */			\
+	"_id "				/* search index id */		\
+	"FROM mms "
+
+/* For database versions >= SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_SELECT_MMS_2					\
+	"SELECT "							\
+	"address, "							\
+	"body, "							\
+	"date, "			/* date_sent */			\
+	"date_received, "						\
+	"msg_box, "			/* type */			\
+	"thread_id, "							\
+	"part_count, "							\
+	"_id, "								\
+	"reactions, "							\
+	"_id "				/* search index id */		\
+	"FROM mms "
+
+#define SBK_MESSAGES_WHERE_THREAD					\
+	"WHERE thread_id = ? "
+
+/* Skip the messages up to the mark of their thread */
+#define SBK_MESSAGES_NEW_SMS						\
+	"NOT EXISTS (SELECT 1 FROM sigbak_mark AS m "			\
+	"WHERE m.thread_id = sms.thread_id "				\
+	"AND m.date_received >= sms.date) "
+
+#define SBK_MESSAGES_NEW_MMS						\
+	"NOT EXISTS (SELECT 1 FROM sigbak_mark AS m "			\
+	"WHERE m.thread_id = mms.thread_id "				\
+	"AND m.date_received >= mms.date_received) "
+
+#define SBK_MESSAGES_ORDER						\
+	"ORDER BY date_received"
+
+/* For database versions < SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_ALL_1					\
+	SBK_MESSAGES_SELECT_SMS_1					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_1					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions >= SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_ALL_2					\
+	SBK_MESSAGES_SELECT_SMS_2					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_2					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions < SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_THREAD_1					\
+	SBK_MESSAGES_SELECT_SMS_1					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_1					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions >= SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_THREAD_2					\
+	SBK_MESSAGES_SELECT_SMS_2					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_2					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions < SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_NEW_ALL_1					\
+	SBK_MESSAGES_SELECT_SMS_1					\
+	"WHERE " SBK_MESSAGES_NEW_SMS					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_1					\
+	"WHERE " SBK_MESSAGES_NEW_MMS					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions >= SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_NEW_ALL_2					\
+	SBK_MESSAGES_SELECT_SMS_2					\
+	"WHERE " SBK_MESSAGES_NEW_SMS					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_2					\
+	"WHERE " SBK_MESSAGES_NEW_MMS					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions < SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_NEW_THREAD_1					\
+	SBK_MESSAGES_SELECT_SMS_1					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"AND " SBK_MESSAGES_NEW_SMS					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_1					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"AND " SBK_MESSAGES_NEW_MMS					\
+	SBK_MESSAGES_ORDER
+
+/* For database versions >= SBK_DB_VERSION_REACTIONS */
+#define SBK_MESSAGES_QUERY_NEW_THREAD_2					\
+	SBK_MESSAGES_SELECT_SMS_2					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"AND " SBK_MESSAGES_NEW_SMS					\
+	"UNION ALL "							\
+	SBK_MESSAGES_SELECT_MMS_2					\
+	SBK_MESSAGES_WHERE_THREAD					\
+	"AND " SBK_MESSAGES_NEW_MMS					\
+	SBK_MESSAGES_ORDER
+
+/* The marks are kept in a temporary table, so cache files remain read-only */
+#define SBK_MARKS_SCHEMA						\
+	"CREATE TEMP TABLE IF NOT EXISTS sigbak_mark ("			\
+	"thread_id INTEGER PRIMARY KEY, "				\
+	"date_received INTEGER NOT NULL)"
+
+#define SBK_MARKS_INSERT						\
+	"INSERT OR REPLACE INTO sigbak_mark VALUES (?, ?)"
+
+/*
+ * Skip the messages in a thread that were received at or before date. This
+ * applies to the message iterators opened afterwards.
+ */
+int
+sbk_set_message_mark(struct sbk_ctx *ctx, int thread_id, int64_t date)
+{
+	sqlite3_stmt *stm;
+
+	if (sbk_create_database(ctx) == -1)
+		return -1;
+
+	if (sbk_sqlite_exec(ctx, SBK_MARKS_SCHEMA) == -1)
+		return -1;
+
+	if (sbk_sqlite_prepare(ctx, &stm, SBK_MARKS_INSERT) == -1)
+		return -1;
+
+	if (sbk_sqlite_bind_int(ctx, stm, 1, thread_id) == -1)
+		goto error;
+
+	if (sbk_sqlite_bind_int64(ctx, stm, 2, date) == -1)
+		goto error;
+
+	if (sbk_sqlite_step(ctx, stm) != SQLITE_DONE)
+		goto error;
+
+	sqlite3_finalize(stm);
+	ctx->db_marked = 1;
+	return 0;
+
+error:
+	sqlite3_finalize(stm);
+	return -1;
+}
+
+static struct sbk_message *
+sbk_get_message(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+{
+	struct sbk_arena	*arena;
+	struct sbk_message	*msg;
+	int			 mms_id, nattachments;
+
+	if ((arena = sbk_arena_new(ctx)) == NULL)
+		return NULL;
+
+	if ((msg = sbk_arena_alloc(ctx, arena, sizeof *msg)) == NULL) {
+		sbk_arena_free(arena);
+		return NULL;
+	}
+
+	msg->arena = arena;
+	msg->recipient = NULL;
+	msg->text = NULL;
+	msg->attachments = NULL;
+	msg->mentions = NULL;
+	msg->reactions = NULL;
+
+	msg->recipient = sbk_get_recipient_from_column(ctx, stm, 0);
+	if (msg->recipient == NULL)
+		goto error;
+
+	if (sbk_arena_column_text(ctx, arena, &msg->text, stm, 1) == -1)
+		goto error;
+
+	msg->time_sent = sqlite3_column_int64(stm, 2);
+	msg->time_recv = sqlite3_column_int64(stm, 3);
+	msg->type = sqlite3_column_int(stm, 4);
+	msg->thread = sqlite3_column_int(stm, 5);
+
+	if (sbk_get_body(ctx, msg) == -1)
+		goto error;
+
+	nattachments = sqlite3_column_int(stm, 6);
+	mms_id = sqlite3_column_int(stm, 7);
+
+	if (nattachments > 0) {
+		if (sbk_get_attachments_for_message(ctx, msg, mms_id) == -1)
+			goto error;
+
+		if (sbk_get_long_message(ctx, msg) == -1)
+			goto error;
+	}
+
+	if (mms_id != -1) {
+		if (sbk_insert_mentions(ctx, msg, mms_id) == -1)
+			goto error;
+	}
+
+	if (sbk_get_reactions(ctx, arena, &msg->reactions, stm, 8) == -1)
+		goto error;
+
+	return msg;
+
+error:
+	sbk_free_message(msg);
+	return NULL;
+}
+
+#define SBK_LONG_MESSAGES_SELECT					\
+	"SELECT "							\
+	"_id, "								\
+	"unique_id "							\
+	"FROM part "							\
+	"WHERE ct = '" SBK_LONG_TEXT_TYPE "' "				\
+	"AND pending_push = 0 "
+
+#define SBK_LONG_MESSAGES_QUERY_ALL					\
+	SBK_LONG_MESSAGES_SELECT
+
+#define SBK_LONG_MESSAGES_QUERY_THREAD					\
+	SBK_LONG_MESSAGES_SELECT					\
+	"AND mid IN (SELECT _id FROM mms WHERE thread_id = ?)"
+
+static int
+sbk_cmp_file_positions(const void *a, const void *b)
+{
+	const struct sbk_file *x, *y;
+
+	x = *(struct sbk_file * const *)a;
+	y = *(struct sbk_file * const *)b;
+	return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+/*
+ * Long-message bodies are read in message order. Ask for them in offset
+ * order beforehand, so that the backup is read in a single pass. This is
+ * only advisory, so errors are ignored.
+ */
+static void
+sbk_prefetch_long_messages(struct sbk_ctx *ctx, int thread_id)
+{
+	struct sbk_file	**files, **newfiles, *file;
+	sqlite3_stmt	 *stm;
+	size_t		  i, n, size;
+
+	if (ctx->map == NULL)
+		return;
+
+	if (sqlite3_prepare_v2(ctx->db, (thread_id == -1) ?
+	    SBK_LONG_MESSAGES_QUERY_ALL : SBK_LONG_MESSAGES_QUERY_THREAD, -1,
+	    &stm, NULL) != SQLITE_OK)
+		return;
+
+	if (thread_id != -1)
+		sqlite3_bind_int(stm, 1, thread_id);
+
+	files = NULL;
+	n = size = 0;
+
+	while (sqlite3_step(stm) == SQLITE_ROW) {
+		file = sbk_get_attachment_file(ctx,
+		    sqlite3_column_int64(stm, 0),
+		    sqlite3_column_int64(stm, 1));
+		if (file == NULL)
+			continue;
+
+		if (n == size) {
+			newfiles = reallocarray(files, size + 64,
+			    sizeof *files);
+			if (newfiles == NULL)
+				break;
+			files = newfiles;
+			size += 64;
+		}
+
+		files[n++] = file;
+	}
+
+	sqlite3_finalize(stm);
+
+	/* Without long messages, files is a null pointer */
+	if (n > 1)
+		qsort(files, n, sizeof *files, sbk_cmp_file_positions);
+
+	for (i = 0; i < n; i++)
+		sbk_will_read(ctx, files[i]->pos,
+		    (size_t)files[i]->len + SBK_MAC_LEN);
+
+	free(files);
+}
+
+struct sbk_message_iter {
+	struct sbk_ctx	*ctx;
+	sqlite3_stmt	*stm;
+};
+
+static struct sbk_message_iter *
+sbk_open_messages(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+{
+	struct sbk_message_iter *it;
+
+	if ((it = malloc(sizeof *it)) == NULL) {
+		sbk_error_set(ctx, NULL);
+		sqlite3_finalize(stm);
+		return NULL;
+	}
+
+	it->ctx = ctx;
+	it->stm = stm;
+	return it;
+}
+
+struct sbk_message_iter *
+sbk_open_all_messages(struct sbk_ctx *ctx)
+{
+	sqlite3_stmt	*stm;
+	const char	*query;
+
+	if (sbk_create_database(ctx) == -1)
+		return NULL;
+
+	if (sbk_create_query_indexes(ctx) == -1)
+		return NULL;
+
+	if (ctx->db_marked) {
+		if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
+			query = SBK_MESSAGES_QUERY_NEW_ALL_1;
+		else
+			query = SBK_MESSAGES_QUERY_NEW_ALL_2;
+	} else {
+		if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
+			query = SBK_MESSAGES_QUERY_ALL_1;
+		else
+			query = SBK_MESSAGES_QUERY_ALL_2;
+	}
+
+	if (sbk_sqlite_prepare(ctx, &stm, query) == -1)
+		return NULL;
+
+	/* With marks, most long messages are likely to be skipped */
+	if (!ctx->db_marked)
+		sbk_prefetch_long_messages(ctx, -1);
+
+	return sbk_open_messages(ctx, stm);
+}
+
+struct sbk_message_iter *
+sbk_open_messages_for_thread(struct sbk_ctx *ctx, int thread_id)
+{
+	sqlite3_stmt	*stm;
+	const char	*query;
+
+	if (sbk_create_database(ctx) == -1)
+		return NULL;
+
+	if (sbk_create_query_indexes(ctx) == -1)
+		return NULL;
+
+	if (ctx->db_marked) {
+		if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
+			query = SBK_MESSAGES_QUERY_NEW_THREAD_1;
+		else
+			query = SBK_MESSAGES_QUERY_NEW_THREAD_2;
+	} else {
+		if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
+			query = SBK_MESSAGES_QUERY_THREAD_1;
+		else
+			query = SBK_MESSAGES_QUERY_THREAD_2;
+	}
+
+	if (sbk_sqlite_prepare(ctx, &stm, query) == -1)
+		return NULL;
 
-/* For database versions >= SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_SELECT_MMS_2					\
-	"SELECT "							\
-	"address, "							\
-	"body, "							\
-	"date, "			/* date_sent */			\
-	"date_received, "						\
-	"msg_box, "			/* type */			\
-	"thread_id, "							\
-	"part_count, "							\
-	"_id, "								\
-	"reactions "							\
-	"FROM mms "
+	if (sbk_sqlite_bind_int(ctx, stm, 1, thread_id) == -1) {
+		sqlite3_finalize(stm);
+		return NULL;
+	}
 
-#define SBK_MESSAGES_WHERE_THREAD					\
-	"WHERE thread_id = ? "
+	if (sbk_sqlite_bind_int(ctx, stm, 2, thread_id) == -1) {
+		sqlite3_finalize(stm);
+		return NULL;
+	}
 
-#define SBK_MESSAGES_ORDER						\
-	"ORDER BY date_received"
+	if (!ctx->db_marked)
+		sbk_prefetch_long_messages(ctx, thread_id);
 
-/* For database versions < SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_QUERY_ALL_1					\
-	SBK_MESSAGES_SELECT_SMS_1					\
-	"UNION ALL "							\
-	SBK_MESSAGES_SELECT_MMS_1					\
-	SBK_MESSAGES_ORDER
+	return sbk_open_messages(ctx, stm);
+}
 
-/* For database versions >= SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_QUERY_ALL_2					\
-	SBK_MESSAGES_SELECT_SMS_2					\
-	"UNION ALL "							\
-	SBK_MESSAGES_SELECT_MMS_2					\
-	SBK_MESSAGES_ORDER
+#define SBK_SEARCH_WHERE_SMS						\
+	"WHERE _id IN (SELECT rowid / 2 FROM sigbak_search "		\
+	"WHERE sigbak_search MATCH ?1 AND rowid % 2 = 0) "		\
+	"AND (?2 = -1 OR thread_id = ?2) "				\
+	"AND date BETWEEN ?3 AND ?4 "
+
+#define SBK_SEARCH_WHERE_MMS						\
+	"WHERE _id IN (SELECT rowid / 2 FROM sigbak_search "		\
+	"WHERE sigbak_search MATCH ?1 AND rowid % 2 = 1) "		\
+	"AND (?2 = -1 OR thread_id = ?2) "				\
+	"AND date_received BETWEEN ?3 AND ?4 "
 
 /* For database versions < SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_QUERY_THREAD_1					\
+#define SBK_SEARCH_QUERY_1						\
 	SBK_MESSAGES_SELECT_SMS_1					\
-	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_SEARCH_WHERE_SMS						\
 	"UNION ALL "							\
 	SBK_MESSAGES_SELECT_MMS_1					\
-	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_SEARCH_WHERE_MMS						\
 	SBK_MESSAGES_ORDER
 
 /* For database versions >= SBK_DB_VERSION_REACTIONS */
-#define SBK_MESSAGES_QUERY_THREAD_2					\
+#define SBK_SEARCH_QUERY_2						\
 	SBK_MESSAGES_SELECT_SMS_2					\
-	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_SEARCH_WHERE_SMS						\
 	"UNION ALL "							\
 	SBK_MESSAGES_SELECT_MMS_2					\
-	SBK_MESSAGES_WHERE_THREAD					\
+	SBK_SEARCH_WHERE_MMS						\
 	SBK_MESSAGES_ORDER
 
-static struct sbk_message *
-sbk_get_message(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+static int
+sbk_insert_search_text(struct sbk_ctx *ctx, sqlite3_stmt *ins,
+    sqlite3_stmt *stm)
 {
 	struct sbk_message	*msg;
-	int			 mms_id, nattachments;
+	int64_t			 rowid;
+	int			 ret;
 
-	if ((msg = malloc(sizeof *msg)) == NULL) {
-		sbk_error_set(ctx, NULL);
-		return NULL;
+	if ((msg = sbk_get_message(ctx, stm)) == NULL)
+		return -1;
+
+	ret = 0;
+
+	if (msg->text != NULL) {
+		rowid = sqlite3_column_int64(stm, 9) * 2;
+		/* Only mms rows have a valid mms _id */
+		if (sqlite3_column_int(stm, 7) != -1)
+			rowid++;
+
+		if (sbk_sqlite_bind_int64(ctx, ins, 1, rowid) == -1 ||
+		    sbk_sqlite_bind_text(ctx, ins, 2, msg->text) == -1 ||
+		    sbk_sqlite_step(ctx, ins) != SQLITE_DONE)
+			ret = -1;
+
+		sqlite3_reset(ins);
 	}
 
-	msg->recipient = NULL;
-	msg->text = NULL;
-	msg->attachments = NULL;
-	msg->mentions = NULL;
-	msg->reactions = NULL;
+	sbk_free_message(msg);
+	return ret;
+}
 
-	msg->recipient = sbk_get_recipient_from_column(ctx, stm, 0);
-	if (msg->recipient == NULL)
-		goto error;
+static int
+sbk_create_search_index(struct sbk_ctx *ctx)
+{
+	sqlite3_stmt	*ins, *stm;
+	int		 ret;
+
+	if (sbk_sqlite_prepare(ctx, &stm, SBK_SEARCH_EXISTS) == -1)
+		return -1;
+
+	ret = sbk_sqlite_step(ctx, stm);
+	sqlite3_finalize(stm);
+
+	if (ret == SQLITE_ROW)
+		return 0;
+	if (ret != SQLITE_DONE)
+		return -1;
 
-	if (sbk_sqlite_column_text_copy(ctx, &msg->text, stm, 1) == -1)
+	if (sbk_create_query_indexes(ctx) == -1)
+		return -1;
+
+	if (sbk_sqlite_exec(ctx, "BEGIN TRANSACTION") == -1)
+		return -1;
+
+	if (sbk_sqlite_exec(ctx, SBK_SEARCH_SCHEMA) == -1)
 		goto error;
 
-	msg->time_sent = sqlite3_column_int64(stm, 2);
-	msg->time_recv = sqlite3_column_int64(stm, 3);
-	msg->type = sqlite3_column_int(stm, 4);
-	msg->thread = sqlite3_column_int(stm, 5);
+	if (sbk_sqlite_prepare(ctx, &ins, SBK_SEARCH_INSERT) == -1)
+		goto error;
 
-	if (sbk_get_body(msg) == -1)
+	if (sbk_sqlite_prepare(ctx, &stm,
+	    (ctx->db_version < SBK_DB_VERSION_REACTIONS) ?
+	    SBK_MESSAGES_QUERY_ALL_1 : SBK_MESSAGES_QUERY_ALL_2) == -1) {
+		sqlite3_finalize(ins);
 		goto error;
+	}
 
-	nattachments = sqlite3_column_int(stm, 6);
-	mms_id = sqlite3_column_int(stm, 7);
+	sbk_prefetch_long_messages(ctx, -1);
 
-	if (nattachments > 0) {
-		if (sbk_get_attachments_for_message(ctx, msg, mms_id) == -1)
-			goto error;
+	while ((ret = sbk_sqlite_step(ctx, stm)) == SQLITE_ROW)
+		if (sbk_insert_search_text(ctx, ins, stm) == -1)
+			break;
 
-		if (sbk_get_long_message(ctx, msg) == -1)
-			goto error;
-	}
+	sqlite3_finalize(ins);
+	sqlite3_finalize(stm);
 
-	if (mms_id != -1) {
-		if (sbk_insert_mentions(ctx, msg, mms_id) == -1)
-			goto error;
-	}
+	if (ret != SQLITE_DONE)
+		goto error;
 
-	if (sbk_get_reactions(ctx, &msg->reactions, stm, 8) == -1)
+	if (sbk_sqlite_exec(ctx, "END TRANSACTION") == -1)
 		goto error;
 
-	return msg;
+	return 0;
 
 error:
-	sbk_free_message(msg);
-	return NULL;
+	sqlite3_exec(ctx->db, "ROLLBACK", NULL, NULL, NULL);
+	return -1;
+}
+
+/*
+ * Open an iterator over the messages that match query, an FTS5 query
+ * expression. If thread_id is not -1, only messages in that thread are
+ * matched. Only messages received in the range [from, to] (in ms since the
+ * epoch) are matched. The query string must remain valid until the
+ * iterator is closed. The search index is created if necessary; with a cache,
+ * it is stored in the cache.
+ */
+struct sbk_message_iter *
+sbk_search_messages(struct sbk_ctx *ctx, const char *query, int thread_id,
+    int64_t from, int64_t to)
+{
+	sqlite3_stmt *stm;
+
+	/* A cache without a search index is rebuilt with one */
+	ctx->db_search = 1;
+
+	if (sbk_create_database(ctx) == -1)
+		return NULL;
+
+	if (sbk_create_search_index(ctx) == -1)
+		return NULL;
+
+	if (sbk_sqlite_prepare(ctx, &stm,
+	    (ctx->db_version < SBK_DB_VERSION_REACTIONS) ?
+	    SBK_SEARCH_QUERY_1 : SBK_SEARCH_QUERY_2) == -1)
+		return NULL;
+
+	if (sbk_sqlite_bind_text(ctx, stm, 1, query) == -1 ||
+	    sbk_sqlite_bind_int(ctx, stm, 2, thread_id) == -1 ||
+	    sbk_sqlite_bind_int64(ctx, stm, 3, from) == -1 ||
+	    sbk_sqlite_bind_int64(ctx, stm, 4, to) == -1) {
+		sqlite3_finalize(stm);
+		return NULL;
+	}
+
+	return sbk_open_messages(ctx, stm);
+}
+
+/*
+ * Returns 1 and sets *msg if there is a next message, 0 if there are no more
+ * messages and -1 on error
+ */
+int
+sbk_next_message(struct sbk_message_iter *it, struct sbk_message **msg)
+{
+	uint64_t	start;
+	int		ret;
+
+	start = sbk_stats_clock();
+
+	switch (sbk_sqlite_step(it->ctx, it->stm)) {
+	case SQLITE_ROW:
+		if ((*msg = sbk_get_message(it->ctx, it->stm)) == NULL)
+			ret = -1;
+		else {
+			it->ctx->stats.messages++;
+			ret = 1;
+		}
+		break;
+	case SQLITE_DONE:
+		ret = 0;
+		break;
+	default:
+		ret = -1;
+		break;
+	}
+
+	sbk_stats_add_time(&it->ctx->stats.query_time, start);
+	return ret;
+}
+
+void
+sbk_close_messages(struct sbk_message_iter *it)
+{
+	if (it != NULL) {
+		sqlite3_finalize(it->stm);
+		free(it);
+	}
 }
 
 static struct sbk_message_list *
-sbk_get_messages(struct sbk_ctx *ctx, sqlite3_stmt *stm)
+sbk_get_messages(struct sbk_ctx *ctx, struct sbk_message_iter *it)
 {
 	struct sbk_message_list	*lst;
 	struct sbk_message	*msg;
 	int			 ret;
 
+	if (it == NULL)
+		return NULL;
+
 	if ((lst = malloc(sizeof *lst)) == NULL) {
 		sbk_error_set(ctx, NULL);
 		goto error;
@@ -2169,72 +5093,32 @@ sbk_get_messages(struct sbk_ctx *ctx, sqlite3_stmt *stm)
 
 	SIMPLEQ_INIT(lst);
 
-	while ((ret = sbk_sqlite_step(ctx, stm)) == SQLITE_ROW) {
-		if ((msg = sbk_get_message(ctx, stm)) == NULL)
-			goto error;
+	while ((ret = sbk_next_message(it, &msg)) == 1)
 		SIMPLEQ_INSERT_TAIL(lst, msg, entries);
-	}
 
-	if (ret != SQLITE_DONE)
+	if (ret == -1)
 		goto error;
 
-	sqlite3_finalize(stm);
+	sbk_close_messages(it);
 	return lst;
 
 error:
 	sbk_free_message_list(lst);
-	sqlite3_finalize(stm);
+	sbk_close_messages(it);
 	return NULL;
 }
 
 struct sbk_message_list *
 sbk_get_all_messages(struct sbk_ctx *ctx)
 {
-	sqlite3_stmt	*stm;
-	const char	*query;
-
-	if (sbk_create_database(ctx) == -1)
-		return NULL;
-
-	if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
-		query = SBK_MESSAGES_QUERY_ALL_1;
-	else
-		query = SBK_MESSAGES_QUERY_ALL_2;
-
-	if (sbk_sqlite_prepare(ctx, &stm, query) == -1)
-		return NULL;
-
-	return sbk_get_messages(ctx, stm);
+	return sbk_get_messages(ctx, sbk_open_all_messages(ctx));
 }
 
 struct sbk_message_list *
 sbk_get_messages_for_thread(struct sbk_ctx *ctx, int thread_id)
 {
-	sqlite3_stmt	*stm;
-	const char	*query;
-
-	if (sbk_create_database(ctx) == -1)
-		return NULL;
-
-	if (ctx->db_version < SBK_DB_VERSION_REACTIONS)
-		query = SBK_MESSAGES_QUERY_THREAD_1;
-	else
-		query = SBK_MESSAGES_QUERY_THREAD_2;
-
-	if (sbk_sqlite_prepare(ctx, &stm, query) == -1)
-		return NULL;
-
-	if (sbk_sqlite_bind_int(ctx, stm, 1, thread_id) == -1) {
-		sqlite3_finalize(stm);
-		return NULL;
-	}
-
-	if (sbk_sqlite_bind_int(ctx, stm, 2, thread_id) == -1) {
-		sqlite3_finalize(stm);
-		return NULL;
-	}
-
-	return sbk_get_messages(ctx, stm);
+	return sbk_get_messages(ctx, sbk_open_messages_for_thread(ctx,
+	    thread_id));
 }
 
 void
@@ -2370,6 +5254,9 @@ sbk_ctx_new(void)
 	ctx->ibufsize = 0;
 	ctx->obufsize = 0;
 	ctx->error = NULL;
+	memset(&ctx->stats, 0, sizeof ctx->stats);
+	ctx->file_fn = NULL;
+	ctx->file_arg = NULL;
 
 	if ((ctx->cipher = EVP_CIPHER_CTX_new()) == NULL)
 		goto error;
@@ -2391,6 +5278,8 @@ void
 sbk_ctx_free(struct sbk_ctx *ctx)
 {
 	if (ctx != NULL) {
+		if (sbk_stats_enabled)
+			sbk_add_stats(&ctx->stats);
 		sbk_error_clear(ctx);
 		EVP_CIPHER_CTX_free(ctx->cipher);
 		HMAC_CTX_free(ctx->hmac);
@@ -2400,10 +5289,15 @@ sbk_ctx_free(struct sbk_ctx *ctx)
 	}
 }
 
-int
-sbk_open(struct sbk_ctx *ctx, const char *path, const char *passphr)
+static int
+sbk_open_common(struct sbk_ctx *ctx, const char *path, const char *passphr,
+    const unsigned char *keys)
 {
 	Signal__BackupFrame	*frm;
+	struct stat		 st;
+	SHA256_CTX		 sha;
+	uint64_t		 start;
+	void			*map;
 	uint8_t			*salt;
 	size_t			 saltlen;
 
@@ -2412,8 +5306,37 @@ sbk_open(struct sbk_ctx *ctx, const char *path, const char *passphr)
 		return -1;
 	}
 
+	if (fstat(fileno(ctx->fp), &st) == -1) {
+		sbk_error_set(ctx, NULL);
+		fclose(ctx->fp);
+		return -1;
+	}
+
+	ctx->fpsize = st.st_size;
+	ctx->map = NULL;
+	ctx->mappos = 0;
+
+	/* Map regular files; fall back to stdio for other files */
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size <= SIZE_MAX) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		    fileno(ctx->fp), 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			ctx->map = map;
+		}
+	}
+
 	ctx->firstframe = 1;
 	ctx->eof = 0;
+	ctx->index.state = SBK_INDEX_NONE;
+	ctx->index.path = NULL;
+	ctx->index.entries = NULL;
+	ctx->index.nentries = ctx->index.size = ctx->index.next = 0;
+	ctx->cache = NULL;
+	ctx->tables = NULL;
+	sbk_arena_init(&ctx->frame_arena);
+	ctx->frames = &ctx->frame_arena;
 
 	if ((frm = sbk_get_frame(ctx, NULL)) == NULL)
 		goto error;
@@ -2445,8 +5368,28 @@ sbk_open(struct sbk_ctx *ctx, const char *path, const char *passphr)
 		saltlen = 0;
 	}
 
-	if (sbk_compute_keys(ctx, passphr, salt, saltlen) == -1)
-		goto error;
+	/* Identify the backup by its IV and salt */
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, ctx->iv, SBK_IV_LEN);
+	if (salt != NULL)
+		SHA256_Update(&sha, salt, saltlen);
+	SHA256_Final(ctx->ident, &sha);
+
+	if (keys != NULL) {
+		/* The keys are preceded by the identifier of their backup */
+		if (memcmp(keys, ctx->ident, sizeof ctx->ident) != 0) {
+			sbk_error_setx(ctx, "Keys do not match backup");
+			goto error;
+		}
+		keys += sizeof ctx->ident;
+		memcpy(ctx->cipherkey, keys, SBK_CIPHERKEY_LEN);
+		memcpy(ctx->mackey, keys + SBK_CIPHERKEY_LEN, SBK_MACKEY_LEN);
+	} else {
+		start = sbk_stats_clock();
+		if (sbk_compute_keys(ctx, passphr, salt, saltlen) == -1)
+			goto error;
+		sbk_stats_add_time(&ctx->stats.kdf_time, start);
+	}
 
 	if (EVP_DecryptInit_ex(ctx->cipher, EVP_aes_256_ctr(), NULL, NULL,
 	    NULL) == 0) {
@@ -2466,40 +5409,109 @@ sbk_open(struct sbk_ctx *ctx, const char *path, const char *passphr)
 	sbk_free_frame(frm);
 	ctx->db = NULL;
 	ctx->db_version = 0;
+	ctx->db_indexed = 0;
+	ctx->db_marked = 0;
+	ctx->db_search = 0;
+	ctx->db_shared = 0;
+	ctx->db_path = NULL;
+	ctx->db_image = NULL;
+	ctx->db_imagesize = 0;
 	RB_INIT(&ctx->attachments);
-	RB_INIT(&ctx->recipients);
+	ctx->recipients.entries = NULL;
+	ctx->recipients.nentries = 0;
+	ctx->recipients.slots = NULL;
+	ctx->recipients.nslots = 0;
+	RB_INIT(&ctx->statements);
 	return 0;
 
 error:
 	explicit_bzero(ctx->cipherkey, SBK_CIPHERKEY_LEN);
 	explicit_bzero(ctx->mackey, SBK_MACKEY_LEN);
 	sbk_free_frame(frm);
+	sbk_arena_free(&ctx->frame_arena);
+	if (ctx->map != NULL)
+		munmap(ctx->map, ctx->fpsize);
 	fclose(ctx->fp);
 	return -1;
 }
 
+int
+sbk_open(struct sbk_ctx *ctx, const char *path, const char *passphr)
+{
+	return sbk_open_common(ctx, path, passphr, NULL);
+}
+
+int
+sbk_open_with_keys(struct sbk_ctx *ctx, const char *path,
+    const unsigned char *keys, size_t keyslen)
+{
+	if (keyslen != SBK_KEYS_LEN) {
+		sbk_error_setx(ctx, "Invalid key length");
+		return -1;
+	}
+
+	return sbk_open_common(ctx, path, NULL, keys);
+}
+
+int
+sbk_get_keys(struct sbk_ctx *ctx, unsigned char *buf, size_t bufsize)
+{
+	if (bufsize != SBK_KEYS_LEN) {
+		sbk_error_setx(ctx, "Invalid key length");
+		return -1;
+	}
+
+	memcpy(buf, ctx->ident, sizeof ctx->ident);
+	buf += sizeof ctx->ident;
+	memcpy(buf, ctx->cipherkey, SBK_CIPHERKEY_LEN);
+	memcpy(buf + SBK_CIPHERKEY_LEN, ctx->mackey, SBK_MACKEY_LEN);
+	return 0;
+}
+
 void
 sbk_close(struct sbk_ctx *ctx)
 {
-	sbk_free_recipient_tree(ctx);
-	sbk_free_attachment_tree(ctx);
+	/*
+	 * The recipients and attachments of a shared database belong to the
+	 * other context.
+	 */
+	if (!ctx->db_shared) {
+		sbk_free_recipient_table(ctx);
+		sbk_free_attachment_tree(ctx);
+	}
+	sbk_free_statement_tree(ctx);
+	sbk_close_index(ctx);
+	sbk_arena_free(&ctx->frame_arena);
+	free(ctx->cache);
+	sbk_free_tables(ctx);
 	explicit_bzero(ctx->cipherkey, SBK_CIPHERKEY_LEN);
 	explicit_bzero(ctx->mackey, SBK_MACKEY_LEN);
 	sqlite3_close(ctx->db);
+	sbk_remove_disk_database(ctx);
+	sqlite3_free(ctx->db_image);
+	if (ctx->map != NULL)
+		munmap(ctx->map, ctx->fpsize);
 	fclose(ctx->fp);
 }
 
 int
 sbk_rewind(struct sbk_ctx *ctx)
 {
-	if (fseek(ctx->fp, 0, SEEK_SET) == -1) {
-		sbk_error_set(ctx, "Cannot seek");
-		return -1;
+	if (ctx->map != NULL)
+		ctx->mappos = 0;
+	else {
+		if (fseek(ctx->fp, 0, SEEK_SET) == -1) {
+			sbk_error_set(ctx, "Cannot seek");
+			return -1;
+		}
+		clearerr(ctx->fp);
 	}
 
-	clearerr(ctx->fp);
 	ctx->eof = 0;
 	ctx->firstframe = 1;
+	ctx->counter = (ctx->iv[0] << 24) | (ctx->iv[1] << 16) |
+	    (ctx->iv[2] << 8) | ctx->iv[3];
+	ctx->index.next = 0;
 	return 0;
 }
 
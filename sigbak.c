@@ -14,13 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <readpassphrase.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "sigbak.h"
@@ -82,6 +87,183 @@ get_passphrase(const char *passfile, char *buf, size_t bufsize)
 	return 0;
 }
 
+/* Returns 1 if the keys were read, 0 if the key file does not exist */
+static int
+read_keyfile(const char *keyfile, unsigned char *buf, size_t bufsize)
+{
+	struct stat	st;
+	ssize_t		len;
+	int		fd;
+
+	if ((fd = open(keyfile, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return 0;
+		warn("%s", keyfile);
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		warn("%s", keyfile);
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_mode & (S_IRWXG | S_IRWXO)) {
+		warnx("%s: Key file is accessible by other users", keyfile);
+		close(fd);
+		return -1;
+	}
+
+	if ((len = read(fd, buf, bufsize)) != (ssize_t)bufsize) {
+		if (len == -1)
+			warn("%s", keyfile);
+		else
+			warnx("%s: Invalid key file", keyfile);
+		explicit_bzero(buf, bufsize);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 1;
+}
+
+static int
+write_keyfile(const char *keyfile, const unsigned char *buf, size_t bufsize)
+{
+	ssize_t	len;
+	int	fd;
+
+	if ((fd = open(keyfile, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+		warn("%s", keyfile);
+		return -1;
+	}
+
+	if ((len = write(fd, buf, bufsize)) != (ssize_t)bufsize) {
+		if (len == -1)
+			warn("%s", keyfile);
+		else
+			warnx("%s: Short write", keyfile);
+		close(fd);
+		unlink(keyfile);
+		return -1;
+	}
+
+	if (close(fd) == -1) {
+		warn("%s", keyfile);
+		unlink(keyfile);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open a backup. If a key file is specified and exists, the keys are read from
+ * it. Otherwise the passphrase is read and, if a key file is specified, the
+ * derived keys are saved to it.
+ */
+int
+open_backup(struct sbk_ctx *ctx, const char *path, const char *passfile,
+    const char *keyfile)
+{
+	Signal__BackupFrame	*frm;
+	unsigned char		 keys[SBK_KEYS_LEN];
+	char			 passphr[128];
+	int			 i, ret;
+
+	if (keyfile != NULL) {
+		if ((ret = read_keyfile(keyfile, keys, sizeof keys)) == -1)
+			return -1;
+
+		if (ret == 1) {
+			ret = sbk_open_with_keys(ctx, path, keys, sizeof keys);
+			explicit_bzero(keys, sizeof keys);
+			if (ret == -1) {
+				warnx("%s: %s", path, sbk_error(ctx));
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	if (get_passphrase(passfile, passphr, sizeof passphr) == -1)
+		return -1;
+
+	ret = sbk_open(ctx, path, passphr);
+	explicit_bzero(passphr, sizeof passphr);
+
+	if (ret == -1) {
+		warnx("%s: %s", path, sbk_error(ctx));
+		return -1;
+	}
+
+	if (keyfile == NULL)
+		return 0;
+
+	/*
+	 * Do not save the keys before they have been verified. The first frame
+	 * is not encrypted, so read the second one as well.
+	 */
+	for (i = 0; i < 2; i++) {
+		if ((frm = sbk_get_frame(ctx, NULL)) == NULL)
+			goto error;
+		sbk_free_frame(frm);
+	}
+
+	if (sbk_rewind(ctx) == -1)
+		goto error;
+
+	if (sbk_get_keys(ctx, keys, sizeof keys) == -1)
+		goto error;
+
+	ret = write_keyfile(keyfile, keys, sizeof keys);
+	explicit_bzero(keys, sizeof keys);
+
+	if (ret == -1) {
+		sbk_close(ctx);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	warnx("%s: %s", path, sbk_error(ctx));
+	sbk_close(ctx);
+	return -1;
+}
+
+/* Open a backup again, for example for use by another thread */
+struct sbk_ctx *
+clone_backup(struct sbk_ctx *ctx, const char *path)
+{
+	struct sbk_ctx	*clone;
+	unsigned char	 keys[SBK_KEYS_LEN];
+	int		 ret;
+
+	if (sbk_get_keys(ctx, keys, sizeof keys) == -1) {
+		warnx("%s: %s", path, sbk_error(ctx));
+		return NULL;
+	}
+
+	if ((clone = sbk_ctx_new()) == NULL) {
+		warnx("Cannot create backup context");
+		explicit_bzero(keys, sizeof keys);
+		return NULL;
+	}
+
+	ret = sbk_open_with_keys(clone, path, keys, sizeof keys);
+	explicit_bzero(keys, sizeof keys);
+
+	if (ret == -1) {
+		warnx("%s: %s", path, sbk_error(clone));
+		sbk_ctx_free(clone);
+		return NULL;
+	}
+
+	return clone;
+}
+
 int
 unveil_dirname(const char *path, const char *perms)
 {
@@ -108,11 +290,126 @@ unveil_dirname(const char *path, const char *perms)
 	return 0;
 }
 
+static struct timespec start_time;
+
+static double
+seconds(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+static double
+rate(uint64_t n, double secs)
+{
+	return (secs > 0) ? n / secs : 0;
+}
+
+static void
+print_stats(void)
+{
+	struct sbk_stats	st;
+	struct timespec		now;
+	double			elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start_time.tv_sec) +
+	    (now.tv_nsec - start_time.tv_nsec) / 1e9;
+
+	sbk_get_stats(&st);
+
+	fprintf(stderr, "elapsed     %10.3f s\n", elapsed);
+	fprintf(stderr, "kdf         %10.3f s\n", seconds(st.kdf_time));
+	fprintf(stderr, "read        %10.3f s  %" PRIu64 " bytes\n",
+	    seconds(st.read_time), st.bytes_read);
+	fprintf(stderr, "decrypt     %10.3f s  %" PRIu64 " bytes, "
+	    "%.1f MB/s\n", seconds(st.decrypt_time), st.bytes_decrypted,
+	    rate(st.bytes_decrypted, seconds(st.decrypt_time)) / 1e6);
+	fprintf(stderr, "unpack      %10.3f s  %" PRIu64 " frames, "
+	    "%.0f frames/s\n", seconds(st.unpack_time), st.frames,
+	    rate(st.frames, elapsed));
+	fprintf(stderr, "sql         %10.3f s  %" PRIu64 " statements\n",
+	    seconds(st.sql_time), st.statements);
+	fprintf(stderr, "query       %10.3f s  %" PRIu64 " messages\n",
+	    seconds(st.query_time), st.messages);
+	fprintf(stderr, "write       %10.3f s  %" PRIu64 " bytes\n",
+	    seconds(st.write_time), st.bytes_written);
+	fprintf(stderr, "buffers     %10zu ibuf, %zu obuf\n", st.ibuf_size,
+	    st.obuf_size);
+}
+
+/* Parse a size in bytes, optionally followed by K, M or G */
+static size_t
+parse_size(const char *str)
+{
+	char			*end;
+	unsigned long long	 size, mult;
+
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (end == str || *str == '-' || errno != 0)
+		errx(1, "%s: invalid size", str);
+
+	switch (*end) {
+	case '\0':
+		mult = 1;
+		break;
+	case 'K':
+	case 'k':
+		mult = 1024;
+		break;
+	case 'M':
+	case 'm':
+		mult = 1024 * 1024;
+		break;
+	case 'G':
+	case 'g':
+		mult = 1024 * 1024 * 1024;
+		break;
+	default:
+		errx(1, "%s: invalid size", str);
+	}
+
+	if (*end != '\0' && end[1] != '\0')
+		errx(1, "%s: invalid size", str);
+
+	if (size > SIZE_MAX / mult)
+		errx(1, "%s: size is too large", str);
+
+	/* SQLite needs a few pages to work with */
+	if (size * mult < 1024 * 1024)
+		errx(1, "%s: size is too small", str);
+
+	return size * mult;
+}
+
 int
 main(int argc, char **argv)
 {
+	int	sflag;
+
+	sflag = 0;
+	for (;;) {
+		if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+			sflag = 1;
+			argc--;
+			argv++;
+		} else if (argc > 2 && strcmp(argv[1], "-M") == 0) {
+			sbk_set_memory_budget(parse_size(argv[2]));
+			argc -= 2;
+			argv += 2;
+		} else
+			break;
+	}
+
+	if (sflag) {
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		sbk_enable_stats();
+		if (atexit(print_stats) != 0)
+			err(1, "atexit");
+	}
+
 	if (argc < 2)
-		usage("command", "[argument ...]");
+		usage("[-s] [-M size] command", "[argument ...]");
 
 	argc--;
 	argv++;
@@ -121,12 +418,18 @@ main(int argc, char **argv)
 		return cmd_attachments(argc, argv);
 	if (strcmp(argv[0], "avatars") == 0)
 		return cmd_avatars(argc, argv);
+	if (strcmp(argv[0], "batch") == 0)
+		return cmd_batch(argc, argv);
 	if (strcmp(argv[0], "check") == 0)
 		return cmd_check(argc, argv);
 	if (strcmp(argv[0], "dump") == 0)
 		return cmd_dump(argc, argv);
+	if (strcmp(argv[0], "extract") == 0)
+		return cmd_extract(argc, argv);
 	if (strcmp(argv[0], "messages") == 0)
 		return cmd_messages(argc, argv);
+	if (strcmp(argv[0], "search") == 0)
+		return cmd_search(argc, argv);
 	if (strcmp(argv[0], "sqlite") == 0)
 		return cmd_sqlite(argc, argv);
 	if (strcmp(argv[0], "stickers") == 0)
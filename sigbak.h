@@ -100,14 +100,39 @@
 /* Content type of the long-text attachment of a long message */
 #define SBK_LONG_TEXT_TYPE	"text/x-signal-plain"
 
+/* Frame types */
+#define SBK_FRAME_HEADER	0x001
+#define SBK_FRAME_STATEMENT	0x002
+#define SBK_FRAME_PREFERENCE	0x004
+#define SBK_FRAME_ATTACHMENT	0x008
+#define SBK_FRAME_VERSION	0x010
+#define SBK_FRAME_END		0x020
+#define SBK_FRAME_AVATAR	0x040
+#define SBK_FRAME_STICKER	0x080
+#define SBK_FRAME_KEYVALUE	0x100
+#define SBK_FRAME_ALL		0x1ff
+
+/* Length of the derived keys as exported by sbk_get_keys() */
+#define SBK_KEYS_LEN		96
+
+/* Length of the digest computed by sbk_write_file_digest() */
+#define SBK_DIGEST_LEN		32
+
 #ifndef nitems
 #define nitems(a) (sizeof (a) / sizeof (a)[0])
 #endif
 
 struct sbk_ctx;
 
+struct sbk_arena;
+
+struct sbk_message_iter;
+
 struct sbk_file;
 
+struct manifest;
+struct sink;
+
 struct sbk_contact {
 	char		*phone;
 	char		*email;
@@ -129,6 +154,8 @@ struct sbk_recipient {
 	} type;
 	struct sbk_contact	*contact;
 	struct sbk_group	*group;
+	const char		*display_name;
+	size_t			 display_namelen;
 };
 
 struct sbk_attachment {
@@ -171,6 +198,7 @@ struct sbk_message {
 	struct sbk_attachment_list *attachments;
 	struct sbk_mention_list *mentions;
 	struct sbk_reaction_list *reactions;
+	struct sbk_arena *arena;	/* Owns the message and its contents */
 	SIMPLEQ_ENTRY(sbk_message) entries;
 };
 
@@ -186,16 +214,53 @@ struct sbk_thread {
 
 SIMPLEQ_HEAD(sbk_thread_list, sbk_thread);
 
+/* Times are in nanoseconds */
+struct sbk_stats {
+	uint64_t	 frames;		/* Frames read */
+	uint64_t	 statements;		/* SQL statements replayed */
+	uint64_t	 messages;		/* Messages assembled */
+	uint64_t	 bytes_read;		/* Bytes read from the backup */
+	uint64_t	 bytes_decrypted;	/* Bytes decrypted, verified */
+	uint64_t	 bytes_written;		/* Bytes of output written */
+	size_t		 ibuf_size;		/* Peak input buffer size */
+	size_t		 obuf_size;		/* Peak output buffer size */
+	uint64_t	 kdf_time;		/* Deriving the keys */
+	uint64_t	 read_time;		/* Reading from the backup */
+	uint64_t	 decrypt_time;		/* Decrypting and verifying */
+	uint64_t	 unpack_time;		/* Unpacking frames */
+	uint64_t	 sql_time;		/* Replaying SQL statements */
+	uint64_t	 query_time;		/* Querying the database */
+	uint64_t	 write_time;		/* Writing output */
+};
+
 struct sbk_ctx	*sbk_ctx_new(void);
 void		 sbk_ctx_free(struct sbk_ctx *);
 
+void		 sbk_enable_stats(void);
+void		 sbk_get_stats(struct sbk_stats *);
+uint64_t	 sbk_stats_clock(void);
+void		 sbk_stats_add_write(uint64_t, uint64_t);
+void		 sbk_set_memory_budget(size_t);
+size_t		 sbk_get_memory_budget(void);
+
 int		 sbk_open(struct sbk_ctx *, const char *, const char *);
+int		 sbk_open_with_keys(struct sbk_ctx *, const char *,
+		    const unsigned char *, size_t);
+int		 sbk_get_keys(struct sbk_ctx *, unsigned char *, size_t);
 void		 sbk_close(struct sbk_ctx *);
 int		 sbk_eof(struct sbk_ctx *);
 int		 sbk_rewind(struct sbk_ctx *);
+int		 sbk_open_index(struct sbk_ctx *, const char *);
+int		 sbk_set_cache(struct sbk_ctx *, const char *);
+int		 sbk_set_tables(struct sbk_ctx *, const char * const *);
 
 Signal__BackupFrame *sbk_get_frame(struct sbk_ctx *, struct sbk_file **);
-int		 sbk_write_file(struct sbk_ctx *, struct sbk_file *, FILE *);
+Signal__BackupFrame *sbk_get_filtered_frame(struct sbk_ctx *,
+		    struct sbk_file **, unsigned int);
+int		 sbk_write_file(struct sbk_ctx *, struct sbk_file *, int);
+size_t		 sbk_get_file_size(struct sbk_file *);
+int		 sbk_write_file_digest(struct sbk_ctx *, struct sbk_file *, int,
+		    unsigned char *);
 char		*sbk_get_file_as_string(struct sbk_ctx *, struct sbk_file *);
 void		 sbk_free_frame(Signal__BackupFrame *);
 void		 sbk_free_file(struct sbk_file *);
@@ -203,8 +268,20 @@ void		 sbk_free_file(struct sbk_file *);
 struct sbk_attachment_list *sbk_get_all_attachments(struct sbk_ctx *);
 struct sbk_attachment_list *sbk_get_attachments_for_thread(struct sbk_ctx *,
 		    int);
+int		 sbk_sort_attachments(struct sbk_ctx *,
+		    struct sbk_attachment_list *);
 void		 sbk_free_attachment_list(struct sbk_attachment_list *);
 
+int		 sbk_set_message_mark(struct sbk_ctx *, int, int64_t);
+struct sbk_message_iter *sbk_open_all_messages(struct sbk_ctx *);
+struct sbk_message_iter *sbk_open_messages_for_thread(struct sbk_ctx *, int);
+struct sbk_message_iter *sbk_search_messages(struct sbk_ctx *, const char *,
+		    int, int64_t, int64_t);
+int		 sbk_next_message(struct sbk_message_iter *,
+		    struct sbk_message **);
+void		 sbk_close_messages(struct sbk_message_iter *);
+void		 sbk_free_message(struct sbk_message *);
+
 struct sbk_message_list *sbk_get_all_messages(struct sbk_ctx *);
 struct sbk_message_list *sbk_get_messages_for_thread(struct sbk_ctx *, int);
 void		 sbk_free_message_list(struct sbk_message_list *);
@@ -216,18 +293,57 @@ void		 sbk_free_thread_list(struct sbk_thread_list *);
 const char	*sbk_get_recipient_display_name(const struct sbk_recipient *);
 
 int		 sbk_write_database(struct sbk_ctx *, const char *);
+int		 sbk_extract(struct sbk_ctx *, int (*)(struct sbk_ctx *,
+		    Signal__BackupFrame *, struct sbk_file *, void *), void *);
+int		 sbk_share_database(struct sbk_ctx *, struct sbk_ctx *);
 
 const char	*sbk_error(struct sbk_ctx *);
 
 int		 get_passphrase(const char *, char *, size_t);
+int		 open_backup(struct sbk_ctx *, const char *, const char *,
+		    const char *);
+struct sbk_ctx	*clone_backup(struct sbk_ctx *, const char *);
 int		 unveil_dirname(const char *, const char *);
 void		 usage(const char *, const char *) __dead;
 
+char		*get_attachment_filename(struct sbk_attachment *);
+int		 write_frame_file(struct sbk_ctx *, int, Signal__BackupFrame *,
+		    struct sbk_file *);
+int		 text_write_message(struct sink *, struct sbk_message *);
+
+struct manifest	*manifest_open(const char *);
+int		 manifest_write(struct manifest *);
+void		 manifest_free(struct manifest *);
+int		 manifest_set_mark(struct manifest *, int, int64_t);
+int		 manifest_set_message_marks(struct manifest *,
+		    struct sbk_ctx *);
+int		 manifest_has_attachment(struct manifest *, int64_t, int64_t);
+int		 manifest_add_attachment(struct manifest *, int64_t, int64_t);
+
+struct sink	*sink_new(int);
+void		 sink_free(struct sink *);
+int		 sink_flush(struct sink *);
+int		 sink_set_fd(struct sink *, int);
+uint64_t	 sink_tell(struct sink *);
+void		 sink_write(struct sink *, const char *, size_t);
+void		 sink_puts(struct sink *, const char *);
+void		 sink_putc(struct sink *, char);
+void		 sink_put_escaped(struct sink *, const char *, char, char);
+void		 sink_put_uint(struct sink *, uint64_t, int);
+void		 sink_put_int(struct sink *, int64_t);
+void		 sink_put_hex(struct sink *, const unsigned char *, size_t);
+void		 sink_put_base64(struct sink *, const unsigned char *, size_t);
+void		 sink_put_json_string(struct sink *, const char *);
+void		 sink_put_json_key(struct sink *, const char *);
+
 int		 cmd_attachments(int, char **);
 int		 cmd_avatars(int, char **);
+int		 cmd_batch(int, char **);
 int		 cmd_check(int, char **);
 int		 cmd_dump(int, char **);
+int		 cmd_extract(int, char **);
 int		 cmd_messages(int, char **);
+int		 cmd_search(int, char **);
 int		 cmd_sqlite(int, char **);
 int		 cmd_stickers(int, char **);
 int		 cmd_threads(int, char **);
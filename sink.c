@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sigbak.h"
+
+/*
+ * A sink is an output buffer in front of a file descriptor. Unlike stdio, it
+ * does no locking and no per-character work: text is copied in blocks and
+ * integers are formatted directly into the buffer. Data that does not fit is
+ * written together with the buffered data in a single writev() call.
+ *
+ * The first write error is remembered and returned by sink_flush(); later
+ * output is discarded.
+ */
+#define SINK_BUFSIZE	(64 * 1024)
+
+static const char sink_hex[] = "0123456789abcdef";
+
+static const char sink_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct sink {
+	int		 fd;
+	int		 error;
+	char		*buf;
+	size_t		 len;
+	uint64_t	 flushed;
+};
+
+struct sink *
+sink_new(int fd)
+{
+	struct sink *snk;
+
+	if ((snk = malloc(sizeof *snk)) == NULL)
+		return NULL;
+
+	if ((snk->buf = malloc(SINK_BUFSIZE)) == NULL) {
+		free(snk);
+		return NULL;
+	}
+
+	snk->fd = fd;
+	snk->error = 0;
+	snk->len = 0;
+	snk->flushed = 0;
+	return snk;
+}
+
+void
+sink_free(struct sink *snk)
+{
+	if (snk != NULL) {
+		free(snk->buf);
+		free(snk);
+	}
+}
+
+/* Write the buffered data, followed by len bytes from buf */
+static void
+sink_writev(struct sink *snk, const char *buf, size_t len)
+{
+	struct iovec	 iov[2];
+	struct iovec	*v;
+	uint64_t	 start, written;
+	ssize_t		 n;
+	int		 iovcnt;
+
+	iov[0].iov_base = snk->buf;
+	iov[0].iov_len = snk->len;
+	iov[1].iov_base = (char *)buf;
+	iov[1].iov_len = len;
+
+	v = iov;
+	iovcnt = 2;
+	snk->flushed += snk->len + len;
+	snk->len = 0;
+	start = sbk_stats_clock();
+	written = 0;
+
+	while (snk->error == 0 && iovcnt > 0) {
+		if (v->iov_len == 0) {
+			v++;
+			iovcnt--;
+			continue;
+		}
+
+		if ((n = writev(snk->fd, v, iovcnt)) == -1) {
+			if (errno != EINTR)
+				snk->error = errno;
+			continue;
+		}
+
+		written += n;
+
+		while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+
+	sbk_stats_add_write(written, start);
+}
+
+int
+sink_flush(struct sink *snk)
+{
+	if (snk->len > 0)
+		sink_writev(snk, NULL, 0);
+
+	if (snk->error != 0) {
+		errno = snk->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Flush and start writing to another file descriptor */
+int
+sink_set_fd(struct sink *snk, int fd)
+{
+	int ret;
+
+	ret = sink_flush(snk);
+	snk->fd = fd;
+	snk->error = 0;
+	return ret;
+}
+
+/* Return the number of bytes written to the sink so far */
+uint64_t
+sink_tell(struct sink *snk)
+{
+	return snk->flushed + snk->len;
+}
+
+void
+sink_write(struct sink *snk, const char *buf, size_t len)
+{
+	if (len <= SINK_BUFSIZE - snk->len) {
+		memcpy(snk->buf + snk->len, buf, len);
+		snk->len += len;
+	} else
+		sink_writev(snk, buf, len);
+}
+
+/* Like printf(), write "(null)" for a NULL string */
+void
+sink_puts(struct sink *snk, const char *str)
+{
+	if (str == NULL)
+		str = "(null)";
+
+	sink_write(snk, str, strlen(str));
+}
+
+void
+sink_putc(struct sink *snk, char c)
+{
+	if (snk->len == SINK_BUFSIZE)
+		sink_writev(snk, NULL, 0);
+
+	snk->buf[snk->len++] = c;
+}
+
+/*
+ * Write str, preceding every occurrence of c with esc. The text between
+ * occurrences is copied in blocks.
+ */
+void
+sink_put_escaped(struct sink *snk, const char *str, char c, char esc)
+{
+	const char *p;
+
+	while ((p = strchr(str, c)) != NULL) {
+		sink_write(snk, str, p - str);
+		sink_putc(snk, esc);
+		sink_putc(snk, c);
+		str = p + 1;
+	}
+
+	sink_puts(snk, str);
+}
+
+/* Write val in decimal, padded with zeroes to at least width digits */
+void
+sink_put_uint(struct sink *snk, uint64_t val, int width)
+{
+	char	buf[20], *p;
+
+	p = buf + sizeof buf;
+
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+		width--;
+	} while (val > 0 || (width > 0 && p > buf));
+
+	sink_write(snk, p, buf + sizeof buf - p);
+}
+
+void
+sink_put_int(struct sink *snk, int64_t val)
+{
+	if (val < 0) {
+		sink_putc(snk, '-');
+		sink_put_uint(snk, -(uint64_t)val, 0);
+	} else
+		sink_put_uint(snk, val, 0);
+}
+
+/* Write len bytes from buf as lowercase hexadecimal digits */
+void
+sink_put_hex(struct sink *snk, const unsigned char *buf, size_t len)
+{
+	char	*p;
+	size_t	 i, n;
+
+	while (len > 0) {
+		if (SINK_BUFSIZE - snk->len < 2)
+			sink_writev(snk, NULL, 0);
+
+		/* Encode directly into the buffer */
+		n = (SINK_BUFSIZE - snk->len) / 2;
+		if (n > len)
+			n = len;
+
+		p = snk->buf + snk->len;
+		for (i = 0; i < n; i++) {
+			*p++ = sink_hex[buf[i] >> 4];
+			*p++ = sink_hex[buf[i] & 0xf];
+		}
+
+		snk->len += n * 2;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Write len bytes from buf in base64, with padding */
+void
+sink_put_base64(struct sink *snk, const unsigned char *buf, size_t len)
+{
+	char		*p;
+	size_t		 i, n;
+	uint32_t	 v;
+
+	while (len >= 3) {
+		if (SINK_BUFSIZE - snk->len < 4)
+			sink_writev(snk, NULL, 0);
+
+		/* Encode groups of three bytes directly into the buffer */
+		n = (SINK_BUFSIZE - snk->len) / 4;
+		if (n > len / 3)
+			n = len / 3;
+
+		p = snk->buf + snk->len;
+		for (i = 0; i < n; i++) {
+			v = (uint32_t)buf[0] << 16 | (uint32_t)buf[1] << 8 |
+			    buf[2];
+			*p++ = sink_base64[v >> 18];
+			*p++ = sink_base64[(v >> 12) & 0x3f];
+			*p++ = sink_base64[(v >> 6) & 0x3f];
+			*p++ = sink_base64[v & 0x3f];
+			buf += 3;
+		}
+
+		snk->len += n * 4;
+		len -= n * 3;
+	}
+
+	if (len > 0) {
+		v = (uint32_t)buf[0] << 16;
+		if (len == 2)
+			v |= (uint32_t)buf[1] << 8;
+
+		sink_putc(snk, sink_base64[v >> 18]);
+		sink_putc(snk, sink_base64[(v >> 12) & 0x3f]);
+		sink_putc(snk, (len == 2) ? sink_base64[(v >> 6) & 0x3f] : '=');
+		sink_putc(snk, '=');
+	}
+}
+
+/* Write a JSON string, or null if str is NULL */
+void
+sink_put_json_string(struct sink *snk, const char *str)
+{
+	const char	*p;
+	unsigned char	 c;
+
+	if (str == NULL) {
+		sink_write(snk, "null", 4);
+		return;
+	}
+
+	sink_putc(snk, '"');
+
+	/* Copy the text between the characters that need escaping */
+	for (p = str; (c = *p) != '\0'; p++) {
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		sink_write(snk, str, p - str);
+		str = p + 1;
+
+		sink_putc(snk, '\\');
+		switch (c) {
+		case '"':
+		case '\\':
+			sink_putc(snk, c);
+			break;
+		case '\n':
+			sink_putc(snk, 'n');
+			break;
+		case '\r':
+			sink_putc(snk, 'r');
+			break;
+		case '\t':
+			sink_putc(snk, 't');
+			break;
+		default:
+			sink_write(snk, "u00", 3);
+			sink_putc(snk, sink_hex[c >> 4]);
+			sink_putc(snk, sink_hex[c & 0xf]);
+			break;
+		}
+	}
+
+	sink_write(snk, str, p - str);
+	sink_putc(snk, '"');
+}
+
+/* Write a key and the colon that follows it */
+void
+sink_put_json_key(struct sink *snk, const char *key)
+{
+	sink_putc(snk, '"');
+	sink_puts(snk, key);
+	sink_write(snk, "\":", 2);
+}